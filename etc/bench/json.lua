@@ -0,0 +1,199 @@
+-- SPDX-License-Identifier: AGPL-3.0-or-later
+-- Copyright 2022-2023 - Thadeu de Paula and contributors
+
+-- Benchmark of wax.json decoding and encoding. The documents are built
+-- with a fixed seed and no help of the module, so they are the same on
+-- every Lua version and commit. Their shapes follow the usual JSON
+-- corpus: twitter.json, citm_catalog.json and canada.json, plus string
+-- heavy and deeply nested ones.
+--
+--   ./run bench json [base]
+--   lua etc/bench/json.lua [results.json [base.json]]
+--   lua etc/bench/json.lua <case> <op>
+
+
+local bench = require 'etc.run.bench'
+local json  = require 'wax.json'
+
+
+-- Park-Miller generator, exact on the doubles of Lua 5.1
+local seed
+local function rand(n)
+  seed = seed * 16807 % 2147483647
+  return seed % n + 1
+end
+
+local function pick(list)
+  return list[rand(#list)]
+end
+
+local words = {
+  'lorem', 'ipsum', 'dolor', 'sit', 'amet', 'wax', 'lua', 'json', 'caf\195\169',
+  '\227\129\130\227\130\138\227\129\140\227\129\168\227\129\134', 'na\195\175ve',
+  '\240\159\152\128', 'quote"d', 'back\\slash', 'tab\tbed', 'new\nline',
+}
+
+local function str(s)
+  return '"' .. s:gsub('[%c"\\]', function(c)
+    local esc = { ['"']='\\"', ['\\']='\\\\', ['\n']='\\n', ['\t']='\\t' }
+    return esc[c] or ('\\u%04x'):format(c:byte())
+  end) .. '"'
+end
+
+local function text(n)
+  local t = {}
+  for i = 1, n do t[i] = pick(words) end
+  return str(table.concat(t, ' '))
+end
+
+local function digits(n)
+  local t = { tostring(rand(9)) }
+  for i = 2, n do t[i] = tostring(rand(10) - 1) end
+  return table.concat(t)
+end
+
+local function float(lo, span)
+  return ('%.15f'):format(lo + span * rand(1000000000) / 1000000000)
+end
+
+
+-- Statuses of a search, nested objects with long ids and UTF-8 text
+local function twitter()
+  local out = {}
+  for i = 1, 600 do
+    local id = '5058' .. digits(14)
+    out[i] = table.concat {
+      '{"metadata":{"result_type":"recent","iso_language_code":"ja"},',
+      '"created_at":"Sun Aug 31 00:29:15 +0000 2014",',
+      '"id":', id, ',"id_str":"', id, '","text":', text(rand(20)),
+      ',"source":', str('<a href="http://twitter.com/#!/download">web</a>'),
+      ',"truncated":false,"in_reply_to_status_id":null,"user":{',
+      '"id":', digits(10), ',"name":', text(2), ',"screen_name":"u', digits(6),
+      '","location":', text(1), ',"description":', text(rand(12)),
+      ',"url":null,"protected":false,"followers_count":', digits(rand(6)),
+      ',"friends_count":', digits(rand(4)), ',"verified":false,',
+      '"profile_background_color":"C0DEED","default_profile":true},',
+      '"geo":null,"coordinates":null,"retweet_count":', rand(1000) - 1,
+      ',"favorite_count":', rand(100) - 1, ',"entities":{"hashtags":[],',
+      '"symbols":[],"urls":[],"user_mentions":[{"screen_name":"u',
+      digits(6), '","name":', text(2), ',"id":', digits(10),
+      ',"indices":[0,', rand(20), ']}]},"favorited":false,',
+      '"retweeted":false,"lang":"ja"}'
+    }
+  end
+  return '{"statuses":[' .. table.concat(out, ',')
+      .. '],"search_metadata":{"completed_in":0.087,"count":600}}'
+end
+
+
+-- Catalog of events and performances, small objects of integers
+local function citm()
+  local areas, events, perfs = {}, {}, {}
+  for i = 1, 400 do
+    areas[i] = ('"%s":%s'):format(digits(9), text(2))
+  end
+  for i = 1, 1200 do
+    local id = digits(9)
+    events[i] = table.concat {
+      '"', id, '":{"description":null,"id":', id, ',"logo":null,"name":',
+      text(3), ',"subTopicIds":[', digits(9), ',', digits(9), ',', digits(9),
+      '],"subjectCode":null,"subtitle":null,"topicIds":[', digits(9), ',',
+      digits(9), ']}'
+    }
+  end
+  for i = 1, 2400 do
+    local prices, seats = {}, {}
+    for j = 1, rand(4) do
+      prices[j] = ('{"amount":%d,"audienceSubCategoryId":%s,'
+                 ..'"seatCategoryId":%s}'):format(rand(100000), digits(9), digits(9))
+      seats[j] = ('{"areas":[{"areaId":%s,"blockIds":[]},{"areaId":%s,'
+                ..'"blockIds":[]}],"seatCategoryId":%s}')
+                :format(digits(9), digits(9), digits(9))
+    end
+    perfs[i] = table.concat {
+      '{"eventId":', digits(9), ',"id":', digits(9), ',"logo":null,',
+      '"name":null,"prices":[', table.concat(prices, ','),
+      '],"seatCategories":[', table.concat(seats, ','),
+      '],"seatMapImage":null,"start":', digits(13),
+      ',"venueCode":"PLEYEL_PLEYEL"}'
+    }
+  end
+  return table.concat {
+    '{"areaNames":{', table.concat(areas, ','), '},"events":{',
+    table.concat(events, ','), '},"performances":[', table.concat(perfs, ','),
+    ']}'
+  }
+end
+
+
+-- Polygons of coordinates, floats with many digits
+local function canada()
+  local rings = {}
+  for i = 1, 120 do
+    local ring = {}
+    for j = 1, 400 do
+      ring[j] = '[' .. float(-141, 89) .. ',' .. float(41, 42) .. ']'
+    end
+    rings[i] = '[' .. table.concat(ring, ',') .. ']'
+  end
+  return '{"type":"FeatureCollection","features":[{"type":"Feature",'
+      .. '"properties":{"name":"Canada"},"geometry":{"type":"Polygon",'
+      .. '"coordinates":[' .. table.concat(rings, ',') .. ']}}]}'
+end
+
+
+-- Long strings with escapes and multibyte characters
+local function strings()
+  local out = {}
+  for i = 1, 2000 do out[i] = text(80) end
+  return '[' .. table.concat(out, ',') .. ']'
+end
+
+
+-- Arrays and objects nested 500 levels deep
+local function nested()
+  local out = {}
+  for i = 1, 100 do
+    local open, close = {}, {}
+    for d = 1, 500 do
+      if d % 2 == 0 then
+        open[d], close[501 - d] = '{"k' .. d % 7 .. '":', '}'
+      else
+        open[d], close[501 - d] = '[' .. d .. ',', ']'
+      end
+    end
+    out[i] = table.concat(open) .. 'null' .. table.concat(close)
+  end
+  return '[' .. table.concat(out, ',') .. ']'
+end
+
+
+local ops = {
+  { name = 'decode',
+    prepare = function(doc) return doc end,
+    run = function(doc) json.decode(doc) return #doc end },
+  { name = 'into',
+    prepare = function(doc) return { doc = doc, target = json.decode(doc) } end,
+    run = function(r) json.decode_into(r.doc, r.target) return #r.doc end },
+  { name = 'encode',
+    prepare = function(doc) return json.decode(doc) end,
+    run = function(val) return #json.encode(val) end },
+}
+
+local cases = {}
+for _, c in ipairs {
+  { 'twitter', twitter }, { 'citm', citm }, { 'canada', canada },
+  { 'strings', strings }, { 'nested', nested },
+} do
+  local name, build = c[1], c[2]
+  cases[#cases+1] = {
+    name = name,
+    ops  = ops,
+    doc  = function()
+      seed = 20230101
+      return build()
+    end,
+  }
+end
+
+bench.run(cases, arg)
@@ -28,7 +28,8 @@ modules = {
 
   ['wax.json'] = {
     init = 'json/init.lua',
-    initc = { 'json/_cjson/cJSON.c', 'json/init.c' },
+    initc = { 'json/_cjson/cJSON.c', 'json/init.c', 'json/msgpack.c',
+              'json/cbor.c', lflags='-lpthread' },
   },
 
   ['wax.os'] = {
@@ -38,7 +39,7 @@ modules = {
 
   ['wax.sql'] = {
     init = 'sql/init.lua',
-    initc = {'sql/init.c', lflags='-lsqlite3'}
+    initc = {'sql/init.c', lflags='-lsqlite3 -lpthread'}
   },
 
   ['wax.user'] = {
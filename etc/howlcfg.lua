@@ -16,6 +16,7 @@ howl_index = {
   
   {doc='clib_wax',     src='doc/lib_cool.md'},
   {doc='clib_wax_arr', src='src/wax/arr.h'},
+  {doc='clib_wax_num', src='src/w/num.h'},
 
   {doc='clib_wax_lua', src='src/wax/lua.h'}
 }
@@ -0,0 +1,189 @@
+-- SPDX-License-Identifier: AGPL-3.0-or-later
+-- Copyright 2022-2023 - Thadeu de Paula and contributors
+
+-- Measurement of the benchmark suites at etc/bench. A suite is a list of
+-- cases, each one a document and the operations run on it. Every case
+-- runs in its own process, so the peak RSS is of that case only.
+
+
+local bench = {}
+
+unpack = unpack or table.unpack
+
+local ROUNDS   = 5     -- timed rounds, the best one is kept
+local ROUNDMIN = 0.2   -- CPU seconds of each round
+
+
+--$ bench.time(fn: function) : number, number
+--| Runs `fn` in rounds of at least 0.2s of CPU time, returning the seconds
+--| per run of the best round and the total of runs.
+function bench.time(fn)
+  local best, total = math.huge, 0
+  fn()
+  for _ = 1, ROUNDS do
+    local runs, start, spent = 0, os.clock(), 0
+    repeat
+      fn()
+      runs  = runs + 1
+      spent = os.clock() - start
+    until spent >= ROUNDMIN
+    best  = math.min(best, spent / runs)
+    total = total + runs
+  end
+  return best, total
+end
+
+
+--$ bench.heap(fn: function) : number
+--| Kilobytes of Lua heap allocated by one run of `fn`, with the garbage
+--| collector stopped. Memory of C allocators isn't counted.
+function bench.heap(fn)
+  collectgarbage()
+  collectgarbage()
+  collectgarbage 'stop'
+  local before = collectgarbage 'count'
+  local keep = fn()
+  local kb = collectgarbage 'count' - before
+  collectgarbage 'restart'
+  keep = nil
+  return kb
+end
+
+
+--$ bench.rss() : number | nil
+--| Peak resident memory of the process in kilobytes, where /proc is
+--| available.
+function bench.rss()
+  local f = io.open '/proc/self/status'
+  if not f then return nil end
+  local kb = f:read '*a':match 'VmHWM:%s*(%d+)'
+  f:close()
+  return tonumber(kb)
+end
+
+
+-- Results are kept one per line, with their fields always in the same
+-- order, so result files of two commits can be diffed and read back
+-- without a JSON decoder.
+local FIELDS = { 'case', 'op', 'bytes', 'runs', 'mbps', 'heap_kb', 'rss_kb' }
+
+local function encode(r)
+  local out = {}
+  for i, k in ipairs(FIELDS) do
+    local v = r[k]
+    if type(v) == 'string' then
+      v = ('%q'):format(v)
+    elseif type(v) == 'number' then
+      v = v == math.floor(v) and ('%d'):format(v) or ('%.3f'):format(v)
+    else
+      v = 'null'
+    end
+    out[i] = ('"%s":%s'):format(k, v)
+  end
+  return '{' .. table.concat(out, ',') .. '}'
+end
+
+local function decode(line)
+  local r = {}
+  for k, v in line:gmatch '"([%w_]+)":("?[^,"}]*)' do
+    if v:sub(1, 1) == '"' then
+      r[k] = v:sub(2)
+    else
+      r[k] = tonumber(v)
+    end
+  end
+  return r.case and r
+end
+
+
+--$ bench.load(path: string) : table | nil
+--| Reads the results saved at `path`.
+function bench.load(path)
+  local f = io.open(path)
+  if not f then return nil end
+  local results = {}
+  for line in f:lines() do
+    results[#results+1] = decode(line)
+  end
+  f:close()
+  return results
+end
+
+
+--$ bench.compare(base: table, results: table)
+--| Prints the throughput of each result against the one of `base`.
+function bench.compare(base, results)
+  local old = {}
+  for _, r in ipairs(base) do old[r.case .. ' ' .. r.op] = r end
+  print(('%-10s %-8s %10s %10s %7s %10s'):format(
+    'case', 'op', 'base MB/s', 'MB/s', 'ratio', 'heap KB'))
+  for _, r in ipairs(results) do
+    local o = old[r.case .. ' ' .. r.op]
+    print(('%-10s %-8s %10s %10.1f %7s %10.1f'):format(
+      r.case, r.op,
+      o and ('%.1f'):format(o.mbps) or '-', r.mbps,
+      o and ('%.2fx'):format(r.mbps / o.mbps) or '-', r.heap_kb or 0))
+  end
+end
+
+
+--$ bench.run(cases: table, arg: table)
+--| Main of a suite. `cases` is a list of `{name=, doc=function, ops={}}`
+--| where each op is `{name=, prepare=function(doc), run=function(input)}`
+--| returning the bytes measured. Called with a case and op name runs it
+--| and prints its result. Otherwise runs every case in a child process,
+--| saving the results at `arg[1]` and comparing them with the results
+--| at `arg[2]`.
+function bench.run(cases, arg)
+  local case, op = arg[1], arg[2]
+
+  for _, c in ipairs(cases) do
+    for _, o in ipairs(c.ops) do
+      if c.name == case and o.name == op then
+        local input = o.prepare(c.doc())
+        local bytes = o.run(input)
+        local secs, runs = bench.time(function() o.run(input) end)
+        io.write(encode {
+          case    = case,
+          op      = op,
+          bytes   = bytes,
+          runs    = runs,
+          mbps    = bytes / secs / 1048576,
+          heap_kb = bench.heap(function() return o.run(input) end),
+          rss_kb  = bench.rss(),
+        }, '\n')
+        return
+      end
+    end
+  end
+
+  -- children run with the interpreter and module paths of this process
+  local i = -1
+  while arg[i - 1] do i = i - 1 end
+  local lua = ('%s -e %q'):format(arg[i], ('package.path=%q package.cpath=%q')
+                                  :format(package.path, package.cpath))
+
+  local results = {}
+  for _, c in ipairs(cases) do
+    for _, o in ipairs(c.ops) do
+      local p = io.popen(('%s %q %q %q'):format(lua, arg[0], c.name, o.name))
+      local r = decode(p:read '*a' or '')
+      p:close()
+      if not r then
+        io.stderr:write(('%s %s failed\n'):format(c.name, o.name))
+        os.exit(1)
+      end
+      results[#results+1] = r
+    end
+  end
+
+  if case then
+    local f = assert(io.open(case, 'w'))
+    for _, r in ipairs(results) do f:write(encode(r), '\n') end
+    f:close()
+  end
+  bench.compare(op and bench.load(op) or {}, results)
+end
+
+
+return bench
@@ -57,6 +57,7 @@
 #endif
 
 #include "cJSON.h"
+#include "../../w/num.h"
 
 #ifndef __DBL_EPSILON__
   #define __DBL_EPSILON__ 2.2204460492503131e-16
@@ -93,7 +94,8 @@ typedef struct {
     const unsigned char *json;
     size_t position;
 } error;
-static error global_error = { NULL, 0 };
+/* wax: one per thread, lines are parsed in parallel by json.lines */
+static __thread error global_error = { NULL, 0 };
 
 CJSON_PUBLIC(const char *) cJSON_GetErrorPtr(void)
 {
@@ -277,17 +279,6 @@ CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
     }
 }
 
-/* get the decimal point character of the current locale */
-static unsigned char get_decimal_point(void)
-{
-#ifdef ENABLE_LOCALES
-    struct lconv *lconv = localeconv();
-    return (unsigned char) lconv->decimal_point[0];
-#else
-    return '.';
-#endif
-}
-
 typedef struct
 {
     const unsigned char *content;
@@ -309,58 +300,27 @@ typedef struct
 static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
 {
     double number = 0;
-    unsigned char *after_end = NULL;
-    unsigned char number_c_string[64];
-    unsigned char decimal_point = get_decimal_point();
-    size_t i = 0;
+    long long integer = 0;
+    const char *start = NULL;
+    const char *after_end = NULL;
+    int kind = WNUM_NONE;
 
     if ((input_buffer == NULL) || (input_buffer->content == NULL))
     {
         return false;
     }
 
-    /* copy the number into a temporary buffer and replace '.' with the decimal point
-     * of the current locale (for strtod)
-     * This also takes care of '\0' not necessarily being available for marking the end of the input */
-    for (i = 0; (i < (sizeof(number_c_string) - 1)) && can_access_at_index(input_buffer, i); i++)
-    {
-        switch (buffer_at_offset(input_buffer)[i])
-        {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-            case '+':
-            case '-':
-            case 'e':
-            case 'E':
-                number_c_string[i] = buffer_at_offset(input_buffer)[i];
-                break;
-
-            case '.':
-                number_c_string[i] = decimal_point;
-                break;
-
-            default:
-                goto loop_end;
-        }
-    }
-loop_end:
-    number_c_string[i] = '\0';
-
-    number = strtod((const char*)number_c_string, (char**)&after_end);
-    if (number_c_string == after_end)
+    /* wNum_parse is locale independent and doesn't need a '\0' at the end of the input */
+    start = (const char*)buffer_at_offset(input_buffer);
+    after_end = start;
+    kind = wNum_parse(&after_end, (const char*)(input_buffer->content + input_buffer->length), &number, &integer);
+    if (kind == WNUM_NONE)
     {
         return false; /* parse_error */
     }
 
     item->valuedouble = number;
+    item->valueint64 = integer;
 
     /* use saturation in case of overflow */
     if (number >= INT_MAX)
@@ -377,8 +337,12 @@ loop_end:
     }
 
     item->type = cJSON_Number;
+    if (kind == WNUM_INT)
+    {
+        item->type |= cJSON_NumberIsInt64;
+    }
 
-    input_buffer->offset += (size_t)(after_end - number_c_string);
+    input_buffer->offset += (size_t)(after_end - start);
     return true;
 }
 
@@ -398,6 +362,7 @@ CJSON_PUBLIC(double) cJSON_SetNumberHelper(cJSON *object, double number)
         object->valueint = (int)number;
     }
 
+    object->type &= ~cJSON_NumberIsInt64;
     return object->valuedouble = number;
 }
 
@@ -551,10 +516,7 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     unsigned char *output_pointer = NULL;
     double d = item->valuedouble;
     int length = 0;
-    size_t i = 0;
-    unsigned char number_buffer[26] = {0}; /* temporary buffer to print the number into */
-    unsigned char decimal_point = get_decimal_point();
-    double test = 0.0;
+    char number_buffer[WNUM_BUFSZ] = {0}; /* temporary buffer to print the number into */
 
     if (output_buffer == NULL)
     {
@@ -564,29 +526,20 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     /* This checks for NaN and Infinity */
     if (isnan(d) || isinf(d))
     {
-        length = sprintf((char*)number_buffer, "null");
+        length = sprintf(number_buffer, "null");
     }
-  else if(d == (double)item->valueint)
-  {
-    length = sprintf((char*)number_buffer, "%d", item->valueint);
-  }
-    else
+    else if (item->type & cJSON_NumberIsInt64)
     {
-        /* Try 15 decimal places of precision to avoid nonsignificant nonzero digits */
-        length = sprintf((char*)number_buffer, "%1.15g", d);
-
-        /* Check whether the original double can be recovered */
-        if ((sscanf((char*)number_buffer, "%lg", &test) != 1) || !compare_double((double)test, d))
-        {
-            /* If not, print with 17 decimal places of precision */
-            length = sprintf((char*)number_buffer, "%1.17g", d);
-        }
+        length = wNum_itoa(item->valueint64, number_buffer);
     }
-
-    /* sprintf failed or buffer overrun occurred */
-    if ((length < 0) || (length > (int)(sizeof(number_buffer) - 1)))
+    else if (d == (double)item->valueint)
     {
-        return false;
+        length = wNum_itoa(item->valueint, number_buffer);
+    }
+    else
+    {
+        /* shortest digits that read back as the same double, always with '.' */
+        length = wNum_dtoa(d, number_buffer);
     }
 
     /* reserve appropriate space in the output */
@@ -596,20 +549,7 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
         return false;
     }
 
-    /* copy the printed number to the output and replace locale
-     * dependent decimal point with '.' */
-    for (i = 0; i < ((size_t)length); i++)
-    {
-        if (number_buffer[i] == decimal_point)
-        {
-            output_pointer[i] = '.';
-            continue;
-        }
-
-        output_pointer[i] = number_buffer[i];
-    }
-    output_pointer[i] = '\0';
-
+    memcpy(output_pointer, number_buffer, (size_t)length + sizeof(""));
     output_buffer->offset += (size_t)length;
 
     return true;
@@ -2456,6 +2396,18 @@ CJSON_PUBLIC(cJSON *) cJSON_CreateNumber(double num)
     return item;
 }
 
+CJSON_PUBLIC(cJSON *) cJSON_CreateInt64(long long num)
+{
+    cJSON *item = cJSON_CreateNumber((double)num);
+    if(item)
+    {
+        item->type |= cJSON_NumberIsInt64;
+        item->valueint64 = num;
+    }
+
+    return item;
+}
+
 CJSON_PUBLIC(cJSON *) cJSON_CreateString(const char *string)
 {
     cJSON *item = cJSON_New_Item(&global_hooks);
@@ -2729,6 +2681,7 @@ CJSON_PUBLIC(cJSON *) cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
     newitem->type = item->type & (~cJSON_IsReference);
     newitem->valueint = item->valueint;
     newitem->valuedouble = item->valuedouble;
+    newitem->valueint64 = item->valueint64;
     if (item->valuestring)
     {
         newitem->valuestring = (char*)cJSON_strdup((unsigned char*)item->valuestring, &global_hooks);
@@ -3026,6 +2979,10 @@ CJSON_PUBLIC(cJSON_bool) cJSON_Compare(const cJSON * const a, const cJSON * cons
             return true;
 
         case cJSON_Number:
+            if ((a->type & b->type & cJSON_NumberIsInt64) != 0)
+            {
+                return a->valueint64 == b->valueint64;
+            }
             if (compare_double(a->valuedouble, b->valuedouble))
             {
                 return true;
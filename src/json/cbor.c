@@ -0,0 +1,723 @@
+/*
+SPDX-License-Identifier: AGPL-3.0-or-later
+Copyright 2022-2023 - Thadeu de Paula and contributors
+*/
+#include "json.h"
+#include "../w/arr.h"
+#include <string.h>
+#include <errno.h>
+
+
+
+/* ///////// DECLARATION ///////// */
+
+/* Incremental CBOR input. The bytes of an incomplete value are kept and
+   scanned once, only complete values are decoded. */
+#define UD_CBORP "waxJsonCborParser"
+#define CBOR_INDEF  (~0ULL)      /* indefinite array or map */
+#define CBOR_ISTR   (~0ULL - 4)  /* indefinite string, plus its major type */
+typedef struct waxJsonCborParser {
+  char               *buf;     /* wArr: bytes not decoded yet */
+  unsigned long long *lvl;     /* wArr: items left on each open item */
+  size_t              scan;    /* buf bytes already scanned */
+  size_t              pos;     /* input offset of buf start */
+  const char         *err;
+  size_t              errpos;
+  int                 qref;    /* registry table of complete values */
+  lua_Integer         head;
+  lua_Integer         tail;
+  int                 open;
+} waxJsonCborParser;
+
+Lua
+wax_json_tocbor  (lua_State *L),
+wax_json_fromcbor(lua_State *L),
+wax_json_cborwriter(lua_State *L),
+wax_json_cwwrite (lua_State *L),
+wax_json_cwarray (lua_State *L),
+wax_json_cwmap   (lua_State *L),
+wax_json_cwtext  (lua_State *L),
+wax_json_cwbytes (lua_State *L),
+wax_json_cwfinish(lua_State *L),
+wax_json_cwflush (lua_State *L),
+wax_json_cwclose (lua_State *L),
+wax_json_cwfree  (lua_State *L),
+wax_json_cborparser(lua_State *L),
+wax_json_cpfeed  (lua_State *L),
+wax_json_cpvalues(lua_State *L),
+wax_json_cpclose (lua_State *L),
+aux_dotocbor   (lua_State *L),
+iter_cborvalues(lua_State *L);
+
+static int
+aux_uncbor   (lua_State *L, jrd_s *R),
+aux_uncborhead(jrd_s *R, int *major, int *ai, unsigned long long *u),
+aux_uncborstr(lua_State *L, jrd_s *R, int major, const unsigned char *at),
+aux_uncborarr(lua_State *L, jrd_s *R, unsigned long long n, int indef,
+              const unsigned char *at),
+aux_uncbormap(lua_State *L, jrd_s *R, unsigned long long n, int indef,
+              const unsigned char *at),
+aux_uncborkey(lua_State *L, jrd_s *R),
+aux_cwbegin  (lua_State *L, waxJsonWriter *W, int kind),
+aux_cpscan   (waxJsonCborParser *P, const unsigned char *s, size_t len);
+
+LuaReg cbor[] = {
+  { "tocbor",     wax_json_tocbor },
+  { "fromcbor",   wax_json_fromcbor },
+  { "cborwriter", wax_json_cborwriter },
+  { "cborparser", wax_json_cborparser },
+  { NULL,         NULL            }
+};
+
+LuaReg cborw_mt[] = {
+  { "write",      wax_json_cwwrite  },
+  { "array",      wax_json_cwarray  },
+  { "map",        wax_json_cwmap    },
+  { "text",       wax_json_cwtext   },
+  { "bytes",      wax_json_cwbytes  },
+  { "finish",     wax_json_cwfinish },
+  { "flush",      wax_json_cwflush  },
+  { "close",      wax_json_cwclose  },
+  { "__gc",       wax_json_cwfree   },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",    wax_json_cwclose  },
+  #endif
+  { NULL,         NULL              }
+};
+
+LuaReg cborp_mt[] = {
+  { "feed",       wax_json_cpfeed   },
+  { "values",     wax_json_cpvalues },
+  { "close",      wax_json_cpclose  },
+  { "__gc",       wax_json_cpclose  },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",    wax_json_cpclose  },
+  #endif
+  { NULL,         NULL              }
+};
+
+
+/* Sets the CBOR functions on the module table at the top */
+void
+wax_json_cbor_open(lua_State *L) {
+  wLua_newuserdata_mt(L, UD_CBORW, cborw_mt);
+  wLua_newuserdata_mt(L, UD_CBORP, cborp_mt);
+  lua_pop(L, 2);
+  aux_setfuncs(L, cbor);
+}
+
+
+
+/* ///////// IMPLEMENTATION ///////// */
+
+/* ---- CBOR ---- */
+
+Lua
+wax_json_tocbor(lua_State *L) {
+  lua_settop(L, 1);
+  return waxJson_inarena(L, aux_dotocbor);
+}
+
+/* Same walking of json.pack, with the CBOR heads */
+Lua
+aux_dotocbor(lua_State *L) {
+  jbuf_s  B     = { NULL, 0, 0, 1, 0, 0 };
+  stack_s stack = { 0, LUA_MINSTACK };
+
+  stack.used = lua_gettop(L);
+  if (!waxJson_pack(L, &B, &stack, 0)) lua_error(L);
+  lua_pushlstring(L, B.b, B.len);
+  return 1;
+}
+
+/* Head of the major type with the argument n, in the shortest form */
+int
+waxJson_cborhead(jbuf_s *B, unsigned major, unsigned long long n) {
+  major <<= 5;
+  if (n < 24)             return waxJson_putbe(B, major | (unsigned) n, 0, 0);
+  if (n <= 0xFF)          return waxJson_putbe(B, major | 24, n, 1);
+  if (n <= 0xFFFF)        return waxJson_putbe(B, major | 25, n, 2);
+  if (n <= 0xFFFFFFFFULL) return waxJson_putbe(B, major | 26, n, 4);
+  return waxJson_putbe(B, major | 27, n, 8);
+}
+
+/* Floats use the smallest of half, single and double precision that
+   keeps the value */
+int
+waxJson_cborfloat(jbuf_s *B, double d) {
+  unsigned long long bits;
+  unsigned int fb, sign, exp, man, sh;
+  float f = (float) d;
+
+  if (d != d) return waxJson_putbe(B, 0xf9, 0x7e00, 2);
+  if ((double) f != d) {
+    memcpy(&bits, &d, sizeof(bits));
+    return waxJson_putbe(B, 0xfb, bits, 8);
+  }
+
+  memcpy(&fb, &f, sizeof(fb));
+  sign = (fb >> 16) & 0x8000;
+  exp  = (fb >> 23) & 0xff;
+  man  = fb & 0x7fffff;
+  if (exp == 0xff || (exp == 0 && man == 0))          /* infinity, zero */
+    return waxJson_putbe(B, 0xf9, sign | (exp ? 0x7c00 : 0), 2);
+  if (exp >= 113 && exp <= 142 && !(man & 0x1fff))    /* half normal */
+    return waxJson_putbe(B, 0xf9, sign | ((exp - 112) << 10) | (man >> 13), 2);
+  if (exp >= 103 && exp < 113) {                      /* half subnormal */
+    sh   = 126 - exp;
+    man |= 0x800000;
+    if (!(man & ((1u << sh) - 1)))
+      return waxJson_putbe(B, 0xf9, sign | (man >> sh), 2);
+  }
+  return waxJson_putbe(B, 0xfa, fb, 4);
+}
+
+
+Lua
+wax_json_fromcbor(lua_State *L) {
+  jrd_s R;
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lua_Integer pos = luaL_optinteger(L, 2, 1);
+
+  luaL_argcheck(L, pos >= 1 && (size_t) pos <= len + 1, 2, "out of bounds");
+  lua_settop(L, 2);
+  R.s = (const unsigned char *) s;
+  R.p = R.s + pos - 1;
+  R.e = R.s + len;
+  R.depth = 0;
+  waxJson_keysinit(L, &R.K);       /* 3 */
+
+  if (!aux_uncbor(L, &R)) return waxJson_binerror(L, R.err, R.errpos);
+  lua_pushinteger(L, (lua_Integer) (R.p - R.s) + 1);
+  return 2;
+}
+
+/* Pushes the CBOR item at R->p. On error sets R->err and returns 0. */
+static int
+aux_uncbor(lua_State *L, jrd_s *R) {
+  const unsigned char *at = R->p;
+  unsigned long long u;
+  int major, ai;
+
+  if (!aux_uncborhead(R, &major, &ai, &u)) return 0;
+
+  switch (major) {
+    case 0:
+      if (u > 0x7FFFFFFFFFFFFFFFULL) lua_pushnumber(L, (lua_Number) u);
+      else aux_pushint(L, (long long) u);
+      return 1;
+
+    case 1:
+      if (u > 0x7FFFFFFFFFFFFFFFULL) lua_pushnumber(L, -1 - (lua_Number) u);
+      else aux_pushint(L, -1 - (long long) u);
+      return 1;
+
+    case 2: case 3:
+      if (ai == 31) return aux_uncborstr(L, R, major, at);
+      return waxJson_unpstr(L, R, u, at);
+
+    case 4: return aux_uncborarr(L, R, u, ai == 31, at);
+    case 5: return aux_uncbormap(L, R, u, ai == 31, at);
+
+    case 6:                                    /* tags are skipped */
+      if (++R->depth > PACK_DEPTH)
+        return aux_unpfail(R, "too many nesting levels", at);
+      if (!aux_uncbor(L, R)) return 0;
+      R->depth--;
+      return 1;
+  }
+
+  switch (ai) {
+    case 20: lua_pushboolean(L, 0);          return 1;
+    case 21: lua_pushboolean(L, 1);          return 1;
+    case 22:                                   /* null */
+    case 23: aux_pushludata(L, waxJsonNull); return 1;  /* undefined */
+
+    case 25: {                                 /* half float */
+      unsigned int h = (unsigned int) u, fb;
+      float f;
+      if ((h & 0x7c00) == 0) {
+        lua_pushnumber(L, (h & 0x8000 ? -1 : 1)
+                          * (lua_Number) (h & 0x3ff) / 16777216.0);
+        return 1;
+      }
+      fb = ((h & 0x8000) << 16) | ((h & 0x3ff) << 13)
+         | ((h & 0x7c00) == 0x7c00 ? 0x7f800000 : ((h >> 10 & 0x1f) + 112) << 23);
+      memcpy(&f, &fb, sizeof(f));
+      lua_pushnumber(L, (lua_Number) f);
+      return 1;
+    }
+
+    case 26: {                                 /* single float */
+      unsigned int fb = (unsigned int) u;
+      float f;
+      memcpy(&f, &fb, sizeof(f));
+      lua_pushnumber(L, (lua_Number) f);
+      return 1;
+    }
+
+    case 27: {                                 /* double float */
+      double d;
+      memcpy(&d, &u, sizeof(d));
+      lua_pushnumber(L, (lua_Number) d);
+      return 1;
+    }
+
+    case 31:
+      return aux_unpfail(R, "unexpected break", at);
+  }
+  return aux_unpfail(R, "unsupported simple value", at);
+}
+
+/* Reads the head of an item: its major type, additional information and
+   argument. Additional information 31 is an indefinite length or, on
+   major type 7, the break. */
+static int
+aux_uncborhead(jrd_s *R, int *major, int *ai, unsigned long long *u) {
+  const unsigned char *at = R->p;
+
+  if (R->p >= R->e) return aux_unpfail(R, "unexpected end of input", at);
+  *major = *R->p >> 5;
+  *ai    = *R->p++ & 0x1f;
+  *u     = (unsigned long long) *ai;
+
+  if (*ai < 24) return 1;
+  if (*ai < 28) {
+    if (waxJson_getbe(R, 1 << (*ai - 24), u)) return 1;
+    return aux_unpfail(R, "unexpected end of input", at);
+  }
+  if (*ai == 31 && *major >= 2 && *major != 6) return 1;
+  return aux_unpfail(R, "invalid additional information", at);
+}
+
+/* Chunks of indefinite strings are definite strings of the same major
+   type, they are joined until the break */
+static int
+aux_uncborstr(lua_State *L, jrd_s *R, int major, const unsigned char *at) {
+  const unsigned char *chunk;
+  unsigned long long u;
+  luaL_Buffer b;
+  int m, ai;
+
+  luaL_buffinit(L, &b);
+  for (;;) {
+    chunk = R->p;
+    if (!aux_uncborhead(R, &m, &ai, &u)) return 0;
+    if (m == 7 && ai == 31) break;
+    if (m != major || ai == 31)
+      return aux_unpfail(R, "invalid string chunk", chunk);
+    if ((unsigned long long) (R->e - R->p) < u)
+      return aux_unpfail(R, "unexpected end of input", at);
+    luaL_addlstring(&b, (const char *) R->p, (size_t) u);
+    R->p += u;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* Indefinite arrays and maps end at the break byte */
+static int
+aux_uncborarr(lua_State *L, jrd_s *R, unsigned long long n, int indef,
+              const unsigned char *at) {
+  int i;
+
+  if (!indef && (unsigned long long) (R->e - R->p) < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  if (++R->depth > PACK_DEPTH || !lua_checkstack(L, 3))
+    return aux_unpfail(R, "too many nesting levels", at);
+
+  lua_createtable(L, indef ? 0 : (int) n, 0);
+  for (i = 1; indef || (unsigned long long) i <= n; i++) {
+    if (indef) {
+      if (R->p >= R->e) return aux_unpfail(R, "unexpected end of input", at);
+      if (*R->p == 0xff) {
+        R->p++;
+        break;
+      }
+    }
+    if (!aux_uncbor(L, R)) return 0;
+    lua_rawseti(L, -2, i);
+  }
+  R->depth--;
+  return 1;
+}
+
+static int
+aux_uncbormap(lua_State *L, jrd_s *R, unsigned long long n, int indef,
+              const unsigned char *at) {
+  unsigned long long i;
+
+  if (!indef && (unsigned long long) (R->e - R->p) / 2 < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  if (++R->depth > PACK_DEPTH || !lua_checkstack(L, 3))
+    return aux_unpfail(R, "too many nesting levels", at);
+
+  lua_createtable(L, 0, indef ? 0 : (int) n);
+  for (i = 0; indef || i < n; i++) {
+    if (indef) {
+      if (R->p >= R->e) return aux_unpfail(R, "unexpected end of input", at);
+      if (*R->p == 0xff) {
+        R->p++;
+        break;
+      }
+    }
+    if (!aux_uncborkey(L, R) || !aux_uncbor(L, R)) return 0;
+    lua_rawset(L, -3);
+  }
+  R->depth--;
+  return 1;
+}
+
+/* Definite text keys are pushed through the key cache */
+static int
+aux_uncborkey(lua_State *L, jrd_s *R) {
+  const unsigned char *at = R->p;
+  unsigned long long n;
+  int major, ai;
+
+  if (R->p < R->e && (*R->p >> 5) == 3 && (*R->p & 0x1f) < 28) {
+    if (!aux_uncborhead(R, &major, &ai, &n)) return 0;
+    if ((unsigned long long) (R->e - R->p) < n)
+      return aux_unpfail(R, "unexpected end of input", at);
+    waxJson_pushkey(L, &R->K, (const char *) R->p, (size_t) n);
+    R->p += n;
+    return 1;
+  }
+  if (!aux_uncbor(L, R)) return 0;
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1))
+    return aux_unpfail(R, "invalid map key", at);
+  return 1;
+}
+
+
+Lua
+wax_json_cborwriter(lua_State *L) {
+  waxJsonWriter *W = waxJson_wnew(L, UD_CBORW);
+  if (W == NULL) return 2;
+  W->B.cbor = 1;
+  return 1;
+}
+
+/*
+ * Each write starts from the end of the last complete one, dropping
+ * what a failed write left behind. Inside an indefinite string only
+ * string chunks are accepted.
+ */
+Lua
+wax_json_cwwrite(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_CBORW);
+  stack_s stack = { 0, LUA_MINSTACK };
+  const char *s;
+  size_t len;
+  int n, kind;
+
+  wLua_assert(L, W->open, "closed writer");
+  luaL_checkany(L, 2);
+  lua_settop(L, 2);
+  W->B.len = W->mark;
+
+  n    = wArr_len(W->nest);
+  kind = n > 0 ? W->nest[n-1] : 0;
+  if (kind == 't' || kind == 'b') {
+    luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING, 2, "string chunk expected");
+    s = lua_tolstring(L, 2, &len);
+    luaL_argcheck(L, kind == 'b'
+                     || waxJson_isutf8((const unsigned char *) s, len),
+                  2, "invalid UTF-8");
+    if (!waxJson_cborhead(&W->B, kind == 't' ? 3 : 2, (unsigned long long) len)
+        || !aux_bufneed(&W->B, len))
+      return luaL_error(L, "not enough memory");
+    memcpy(W->B.b + W->B.len, s, len);
+    W->B.len += len;
+  } else {
+    stack.used = lua_gettop(L);
+    if (!waxJson_pack(L, &W->B, &stack, 0)) return lua_error(L);
+  }
+  waxJson_witem(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+Lua
+wax_json_cwarray(lua_State *L) {
+  return aux_cwbegin(L, luaL_checkudata(L, 1, UD_CBORW), 'a');
+}
+
+Lua
+wax_json_cwmap(lua_State *L) {
+  return aux_cwbegin(L, luaL_checkudata(L, 1, UD_CBORW), 'm');
+}
+
+Lua
+wax_json_cwtext(lua_State *L) {
+  return aux_cwbegin(L, luaL_checkudata(L, 1, UD_CBORW), 't');
+}
+
+Lua
+wax_json_cwbytes(lua_State *L) {
+  return aux_cwbegin(L, luaL_checkudata(L, 1, UD_CBORW), 'b');
+}
+
+/* Opens an indefinite item, it counts as one item of its parent */
+static int
+aux_cwbegin(lua_State *L, waxJsonWriter *W, int kind) {
+  static const char head[] = { 'a', '\x9f', 'm', '\xbf', 't', '\x7f', 'b', '\x5f' };
+  int i, n;
+
+  wLua_assert(L, W->open, "closed writer");
+  n = wArr_len(W->nest);
+  wLua_assert(L, n == 0 || (W->nest[n-1] != 't' && W->nest[n-1] != 'b'),
+              "strings only take string chunks");
+  W->B.len = W->mark;
+  for (i = 0; head[i] != kind; i += 2);
+  if (!waxJson_putbe(&W->B, (unsigned char) head[i+1], 0, 0)
+      || !wArr_capsz(W->nest, 1) || !wArr_capsz(W->cnt, 1))
+    return luaL_error(L, "not enough memory");
+  waxJson_witem(L, W);
+  wArr_push(W->nest, (char) kind);
+  wArr_push(W->cnt, 0);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Closes the innermost open item with a break */
+Lua
+wax_json_cwfinish(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_CBORW);
+  int n;
+
+  wLua_assert(L, W->open, "closed writer");
+  n = wArr_len(W->nest);
+  wLua_assert(L, n > 0, "no open item to finish");
+  wLua_assert(L, W->nest[n-1] != 'm' || W->cnt[n-1] % 2 == 0,
+              "map key without value");
+  W->B.len = W->mark;
+  if (!waxJson_putbe(&W->B, 0xff, 0, 0)) return luaL_error(L, "not enough memory");
+  wArr_pop(W->nest, 0);
+  wArr_pop(W->cnt, 0);
+  W->mark = W->B.len;
+  if (W->mark >= W->flush) waxJson_wsink(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+Lua
+wax_json_cwflush(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_CBORW);
+  wLua_assert(L, W->open, "closed writer");
+  waxJson_wsink(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Finishes the open items and flushes. On errors the writer stays open. */
+Lua
+wax_json_cwclose(lua_State *L) {
+  return waxJson_wclose(L, luaL_checkudata(L, 1, UD_CBORW), wax_json_cwfinish);
+}
+
+Lua
+wax_json_cwfree(lua_State *L) {
+  waxJson_wgc(L, luaL_checkudata(L, 1, UD_CBORW));
+  return 0;
+}
+
+
+Lua
+wax_json_cborparser(lua_State *L) {
+  waxJsonCborParser *P = lua_newuserdata(L, sizeof(*P));
+
+  memset(P, 0, sizeof(*P));
+  P->qref = LUA_NOREF;
+  P->open = 1;
+  luaL_getmetatable(L, UD_CBORP);
+  lua_setmetatable(L, -2);
+
+  P->buf = wArr_new(*P->buf, 256);
+  P->lvl = wArr_new(*P->lvl, 8);
+  wLua_assert(L, P->buf != NULL && P->lvl != NULL, strerror(errno));
+  lua_newtable(L);
+  P->qref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+/*
+ * The chunk is scanned in place when no bytes are pending, only the
+ * start of an incomplete value is copied to the parser buffer. Complete
+ * values are decoded by aux_uncbor.
+ */
+Lua
+wax_json_cpfeed(lua_State *L) {
+  waxJsonCborParser *P = luaL_checkudata(L, 1, UD_CBORP);
+  int eof = lua_isnoneornil(L, 2), st;
+  size_t len = 0, start = 0;
+  const char *chunk = eof ? "" : luaL_checklstring(L, 2, &len);
+  const unsigned char *s = (const unsigned char *) chunk;
+  jrd_s R;
+
+  wLua_assert(L, P->open, "closed parser");
+  if (P->err) return waxJson_binerror(L, P->err, P->errpos);
+
+  if (wArr_len(P->buf) > 0) {
+    if (!waxJson_append(&P->buf, chunk, len)) goto nomem;
+    s   = (const unsigned char *) P->buf;
+    len = wArr_len(P->buf);
+  }
+
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, P->qref);  /* 3: queue */
+  waxJson_keysinit(L, &R.K);                   /* 4 */
+  R.s = s;
+  while ((st = aux_cpscan(P, s, len)) > 0) {
+    R.p = s + start;
+    R.e = s + P->scan;
+    R.depth = 0;
+    if (!aux_uncbor(L, &R)) {
+      P->err    = R.err;
+      P->errpos = P->pos + R.errpos;
+      break;
+    }
+    lua_rawseti(L, 3, ++P->tail);
+    start = P->scan;
+  }
+
+  /* Keep the incomplete value */
+  if (s == (const unsigned char *) chunk) {
+    if (!waxJson_append(&P->buf, chunk + start, len - start)) goto nomem;
+  } else {
+    memmove(P->buf, P->buf + start, len - start);
+    _wArr_len(P->buf) = len - start;
+  }
+  P->pos  += start;
+  P->scan -= start;
+
+  if (eof && !P->err && wArr_len(P->buf) > 0) {
+    P->err    = "unexpected end of input";
+    P->errpos = P->pos;
+  }
+  if (P->err) return waxJson_binerror(L, P->err, P->errpos);
+  lua_pushboolean(L, 1);
+  return 1;
+
+  nomem:
+    lua_pushstring(L, strerror(errno));
+    return lua_error(L);
+}
+
+#define aux_cpfail(P, msg, p) \
+  ((P)->err = (msg), (P)->errpos = (P)->pos + (size_t) ((p) - s), -1)
+
+/*
+ * Walks the item heads from P->scan, keeping on P->lvl how many items
+ * are left on each open array, map or string, so the bytes of a value
+ * arriving in many chunks are scanned once. Returns 1 when a top level
+ * value ends at P->scan, 0 when more input is needed and -1 on errors.
+ */
+static int
+aux_cpscan(waxJsonCborParser *P, const unsigned char *s, size_t len) {
+  const unsigned char *p, *e = s + len;
+  unsigned long long u, top;
+  int major, ai, w, i, n;
+
+  while ((p = s + P->scan) < e) {
+    major = *p >> 5;
+    ai    = *p & 0x1f;
+    w     = ai < 24 || ai == 31 ? 0 : 1 << (ai - 24);
+    if (ai >= 28 && ai < 31)
+      return aux_cpfail(P, "invalid additional information", p);
+    if ((size_t) (e - p) <= (size_t) w) return 0;
+    for (u = ai < 24 ? (unsigned) ai : 0, i = 1; i <= w; i++)
+      u = (u << 8) | p[i];
+
+    n   = wArr_len(P->lvl);
+    top = n > 0 ? P->lvl[n-1] : 0;
+    if (top >= CBOR_ISTR && top != CBOR_INDEF && !(major == 7 && ai == 31)
+        && (ai == 31 || CBOR_ISTR + major != top))
+      return aux_cpfail(P, "invalid string chunk", p);
+
+    if (ai == 31) {
+      if (major == 7) {                         /* break */
+        if (top < CBOR_ISTR) return aux_cpfail(P, "unexpected break", p);
+        P->scan++;
+        wArr_pop(P->lvl, 0);
+        goto done;
+      }
+      if (major < 2 || major == 6)
+        return aux_cpfail(P, "invalid additional information", p);
+      if (n >= PACK_DEPTH || !wArr_push(P->lvl, major < 4 ? CBOR_ISTR + major
+                                                          : CBOR_INDEF))
+        return aux_cpfail(P, "too many nesting levels", p);
+      P->scan++;
+      continue;
+    }
+
+    switch (major) {
+      case 2: case 3:
+        if ((unsigned long long) (e - p - 1 - w) < u) return 0;
+        P->scan += 1 + w + (size_t) u;
+        break;
+
+      case 4: case 5:
+        P->scan += 1 + w;
+        if (u == 0) break;
+        if (u > 0x7FFFFFFF) return aux_cpfail(P, "too many items", p);
+        if (n >= PACK_DEPTH || !wArr_push(P->lvl, major == 5 ? 2 * u : u))
+          return aux_cpfail(P, "too many nesting levels", p);
+        continue;
+
+      case 6:                                   /* the tagged item follows */
+        P->scan += 1 + w;
+        continue;
+
+      default:
+        P->scan += 1 + w;
+    }
+
+    /* An item is complete, count it on the open items */
+    done:
+    while ((n = wArr_len(P->lvl)) > 0) {
+      if (P->lvl[n-1] >= CBOR_ISTR || --P->lvl[n-1] > 0) break;
+      wArr_pop(P->lvl, 0);
+    }
+    if (wArr_len(P->lvl) == 0) return 1;
+  }
+  return 0;
+}
+
+Lua
+wax_json_cpvalues(lua_State *L) {
+  luaL_checkudata(L, 1, UD_CBORP);
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, iter_cborvalues, 1);
+  return 1;
+}
+
+Lua
+iter_cborvalues(lua_State *L) {
+  waxJsonCborParser *P = lua_touserdata(L, lua_upvalueindex(1));
+  if (!P->open || P->head >= P->tail) return 0;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, P->qref);
+  lua_rawgeti(L, -1, ++P->head);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, P->head);
+  return 1;
+}
+
+Lua
+wax_json_cpclose(lua_State *L) {
+  waxJsonCborParser *P = luaL_checkudata(L, 1, UD_CBORP);
+  if (!P->open) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  wArr_free(P->buf);
+  wArr_free(P->lvl);
+  luaL_unref(L, LUA_REGISTRYINDEX, P->qref);
+  P->open = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* vim: set fdm=indent fdn=1 ts=2 sts=2 sw=2: */
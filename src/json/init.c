@@ -3,9 +3,18 @@ SPDX-License-Identifier: AGPL-3.0-or-later
 Copyright 2022-2023 - Thadeu de Paula and contributors
 */
 #include "../w/lua.h"
+#include "../w/arr.h"
+#include "../w/num.h"
+#include "json.h"
 #include <stdlib.h>    /* realpath */
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>    /* write, sysconf */
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lua.h"
 
 #define  CJSON_NESTING_LIMIT INT_MAX
@@ -15,51 +24,406 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
 
 /* ///////// DECLARATION ///////// */
 
-typedef struct { int used; int limit; } stack_s;
+/* Tokens returned by the stream lexer */
+enum {
+  JTK_MORE, JTK_END, JTK_ERROR,
+  JTK_OBJ, JTK_ENDOBJ, JTK_ARR, JTK_ENDARR,
+  JTK_KEY, JTK_STR, JTK_NUM, JTK_TRUE, JTK_FALSE, JTK_NULL
+};
+
+/* What the lexer grammar accepts next */
+enum { JEX_VALUE, JEX_FIRSTKEY, JEX_FIRSTVALUE, JEX_KEY, JEX_COLON, JEX_NEXT,
+       JEX_END };
+
+/* Kind of token split between two chunks */
+enum { JPT_NONE, JPT_STR, JPT_NUM, JPT_LIT };
+
+typedef struct jlex_s {
+  char       *nest;    /* wArr: '{' or '[' for each open container */
+  char       *tok;     /* wArr: bytes of a token split between chunks */
+  char       *str;     /* wArr: unescaped string contents */
+  const char *val;     /* contents of last string, key or number token */
+  size_t      vlen;    /* length of val */
+  size_t      pos;     /* amount of input bytes consumed */
+  const char *err;     /* syntax error message */
+  size_t      errpos;  /* input offset of the syntax error */
+  int         expect;  /* JEX_* */
+  int         partial; /* JPT_* */
+  int         esc;     /* partial string ends on a backslash */
+  int         iskey;   /* partial string is an object key */
+  int         multi;   /* accepts many top level values */
+} jlex_s;
+
+#define UD_PARSER "waxJsonParser"
+typedef struct waxJsonParser {
+  jlex_s       X;
+  size_t      *cnt;    /* wArr: item count of each open array */
+  int          slots;  /* Lua values kept between feeds */
+  int          sref;   /* registry table where the slots are kept */
+  int          qref;   /* registry table of complete values */
+  lua_Integer  head;   /* last value taken from queue */
+  lua_Integer  tail;   /* last value put on queue */
+} waxJsonParser;
+
+/* A JSON Pointer path of json.select */
+typedef struct jpat_s {
+  const char *path;
+  size_t     *seg;     /* offset of each segment, plus one after the end */
+  int         nseg;
+  int         wild;    /* has a '*' segment */
+  int         lvl;     /* segments matched by the current path */
+} jpat_s;
+
+/* State of json.select walking */
+typedef struct jsel_s {
+  const char *s;       /* input start */
+  const char *e;       /* input end */
+  const char *p;       /* current position */
+  jpat_s     *pat;
+  int         npat;
+  int         paths;   /* Lua stack index of the paths table */
+  int         res;     /* Lua stack index of the result table */
+  jlex_s      X;       /* key unescaping and error reporting */
+  jkeys_s     K;       /* keys of the decoded values */
+} jsel_s;
+
+/* Nesting limit of json.valid, its open containers are a bit set */
+#define VALID_DEPTH 131072
+
+/* Bump allocator of the cJSON nodes of a call */
+#define UD_ARENA "waxJsonArena"
+#define ARENA_SLAB  65536    /* size of first slab, the next ones double */
+#define ARENA_KEEP  1048576  /* bigger slabs are freed at the end of call */
+#define ARENA_ALIGN 16
+#define ARENA_HEAD  ((sizeof(jslab_s) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+typedef struct jslab_s {
+  struct jslab_s *next;    /* previous slab */
+  size_t          size;    /* usable bytes after the header */
+} jslab_s;
+
+typedef struct jarena_s {
+  jslab_s *slab;           /* current slab */
+  char    *p;              /* its free space */
+  char    *end;
+  int      busy;           /* used by a call down the C stack */
+} jarena_s;
+
+/* Object key of canonical JSON, sorted by its bytes */
+typedef struct jsort_s {
+  const char *s;
+  size_t      len;
+} jsort_s;
+
+/* State of json.decode_into. Each table of the target is updated once,
+   tables reached again (shared or cyclic) are replaced by new ones. */
+typedef struct jinto_s {
+  stack_s      S;
+  jkeys_s      K;
+  const void **seen;   /* tables already updated, open addressing */
+  size_t       cap;
+  size_t       n;
+} jinto_s;
+
+/* Encoder compiled for records of one shape. The text before each
+   value, `,"key":`, is escaped once; the leading comma is skipped on the
+   first field written. */
+#define UD_SHAPE "waxJsonShape"
+typedef struct jfield_s {
+  size_t off;        /* text in pre */
+  size_t len;
+  int    type;       /* Lua type of the values, LUA_TNONE for any */
+  int    integer;    /* numbers must be integral */
+} jfield_s;
+
+typedef struct waxJsonShape {
+  jbuf_s    B;       /* output, kept between calls */
+  jfield_s *f;       /* n fields, after the struct */
+  char     *pre;     /* texts of the fields */
+  int       n;
+  int       keyref;  /* registry array of the field names */
+} waxJsonShape;
+
+/* Parallel decoding of JSON Lines. The input is split after new lines
+   in slices parsed by worker threads, each job keeping its cJSON trees
+   in its own arena. Two batches of jobs run in turns: while the values
+   of one are pushed to Lua the other is parsed. */
+#define UD_LINES "waxJsonLines"
+#define LINES_SLICE   262144   /* input bytes of a job */
+#define LINES_THREADS 64       /* most jobs of a batch */
+enum { JOB_IDLE, JOB_RUNNING, JOB_DONE };
+typedef struct jjob_s {
+  jarena_s    A;          /* cJSON trees of the slice */
+  const char *s;          /* slice of the input */
+  const char *e;
+  size_t      off;        /* input offset of the slice */
+  cJSON     **vals;       /* wArr: values of the lines, in order */
+  size_t      lines;      /* new lines in the slice */
+  const char *err;        /* parsing stops on the first error */
+  size_t      errline;    /* line of the error in the slice */
+  size_t      errpos;     /* input offset of the error */
+  pthread_t   tid;
+  int         state;
+} jjob_s;
+
+typedef struct waxJsonLines {
+  char    *map;           /* input, mapped or read */
+  size_t   len;
+  size_t   pos;           /* input not given to jobs yet */
+  int      mapped;
+  size_t   line;          /* lines of the jobs already consumed */
+  jjob_s  *jobs;          /* two batches of n jobs */
+  int      n;
+  int      cur;           /* job being consumed */
+  size_t   item;          /* its next value */
+  jkeys_s  K;
+  int      keyref;        /* strings table of K */
+  int      open;
+} waxJsonLines;
+
+#define UD_EVENTS "waxJsonEvents"
+#define EVENTS_CHUNK 65536
+typedef struct waxJsonEvents {
+  jlex_s      X;
+  const char *p;       /* unread part of current chunk */
+  const char *end;
+  int         eof;     /* source has no more chunks */
+  int         open;
+  int         srcref;  /* source function or file handler */
+  int         chkref;  /* current chunk, kept while it is lexed */
+} waxJsonEvents;
 
 
 int luaopen_wax_json_initc(lua_State *L);
 
 Lua
 wax_json_decode(lua_State *L),
-wax_json_encode(lua_State *L);
+wax_json_decodefile(lua_State *L),
+wax_json_decode_into(lua_State *L),
+wax_json_lines (lua_State *L),
+wax_json_lclose(lua_State *L),
+wax_json_encode(lua_State *L),
+wax_json_canonical(lua_State *L),
+wax_json_diff  (lua_State *L),
+wax_json_patch (lua_State *L),
+wax_json_parser(lua_State *L),
+wax_json_feed  (lua_State *L),
+wax_json_values(lua_State *L),
+wax_json_pclose(lua_State *L),
+wax_json_events(lua_State *L),
+wax_json_eclose(lua_State *L),
+wax_json_select(lua_State *L),
+wax_json_valid (lua_State *L),
+wax_json_encoder (lua_State *L),
+wax_json_enitem  (lua_State *L),
+wax_json_enarray (lua_State *L),
+wax_json_enobject(lua_State *L),
+wax_json_enfinish(lua_State *L),
+wax_json_enflush (lua_State *L),
+wax_json_enclose (lua_State *L),
+wax_json_enfree  (lua_State *L),
+wax_json_compile_encoder(lua_State *L),
+wax_json_shencode(lua_State *L),
+wax_json_shlist  (lua_State *L),
+wax_json_shfree  (lua_State *L),
+wax_json_afree (lua_State *L),
+aux_dodecode   (lua_State *L),
+aux_dodecodefile(lua_State *L),
+aux_dodecodeinto(lua_State *L),
+aux_doencode   (lua_State *L),
+aux_docanonical(lua_State *L),
+aux_doselect   (lua_State *L),
+iter_values    (lua_State *L),
+iter_events    (lua_State *L),
+iter_lines     (lua_State *L);
 
 static void
-aux_luastack_alloc(lua_State *L, stack_s *stack, int size),
-aux_decode(lua_State *L, cJSON *val, stack_s *S),
-aux_decobj(lua_State *L, cJSON *node, stack_s *stack, int len),
-aux_decarr(lua_State *L, cJSON *node, stack_s *stack, int len);
+aux_decode(lua_State *L, cJSON *val, stack_s *S, jkeys_s *K),
+aux_decobj(lua_State *L, cJSON *node, stack_s *stack, jkeys_s *K, int len),
+aux_decarr(lua_State *L, cJSON *node, stack_s *stack, jkeys_s *K, int len),
+aux_into   (lua_State *L, jinto_s *I, cJSON *val),
+aux_intoobj(lua_State *L, jinto_s *I, cJSON *node, int len),
+aux_intoarr(lua_State *L, jinto_s *I, cJSON *node, int len),
+aux_intoval(lua_State *L, jinto_s *I, cJSON *node, int t);
 
 static cJSON
 *aux_encode    (lua_State*, stack_s*),
 *aux_enc_tdict (lua_State*, stack_s*),
 *aux_enc_tlist (lua_State*, stack_s*, int);
 
-static int waxJsonNull = 0;
+static int
+aux_lexinit  (jlex_s *X, int multi),
+aux_lex      (jlex_s *X, const char **p, const char *end, int eof),
+aux_lextoken (jlex_s *X, const char *s, const char *e),
+aux_unescape (jlex_s *X),
+aux_isnumber (const char *s, size_t len),
+aux_hex4     (const unsigned char *s),
+aux_lexerror (lua_State *L, jlex_s *X),
+aux_select   (lua_State *L, jsel_s *S, int depth),
+aux_selskip  (jsel_s *S),
+aux_selstore (lua_State *L, jsel_s *S, const char *start, int depth),
+aux_selmatch (jpat_s *P, int d, const char *key, size_t klen),
+aux_utf8len  (const unsigned char *s, const unsigned char *e),
+aux_wfd      (waxJsonWriter *W, int fd),
+aux_enbegin  (lua_State *L, waxJsonWriter *W, int kind),
+aux_enkey    (lua_State *L, waxJsonWriter *W),
+aux_shkeys   (lua_State *L, waxJsonShape *W),
+aux_shrecord (lua_State *L, waxJsonShape *W, int keys, stack_s *S),
+aux_jsonval  (lua_State *L, jbuf_s *B, stack_s *S, int depth),
+aux_jsontable(lua_State *L, jbuf_s *B, stack_s *S, int depth),
+aux_jsonsorted(lua_State *L, jbuf_s *B, stack_s *S, int depth),
+aux_sortcmp  (const void *a, const void *b),
+aux_isobject (lua_State *L, int idx),
+aux_intofresh(lua_State *L, jinto_s *I),
+aux_diff     (lua_State *L, int a, int b, int depth),
+aux_equal    (lua_State *L, int x, int y, int depth),
+aux_jsonnum  (lua_State *L, jbuf_s *B),
+aux_jsonstr  (jbuf_s *B, const char *s, size_t len),
+aux_bufput   (jbuf_s *B, const char *s, size_t len);
+
+static const char
+*aux_strend  (const char *p, const char *e),
+*aux_valid   (const unsigned char *s, const unsigned char *e,
+              const unsigned char **at);
+
+static void
+*aux_arenalloc(size_t size),
+*aux_lnwork   (void *job);
+
+static size_t
+aux_intoslot(jsort_s *set, size_t cap, const char *s, size_t len);
+
+static unsigned long long
+aux_xxh64   (const unsigned char *p, size_t len, unsigned long long seed),
+aux_xxhread (const unsigned char *p, int n);
+
+static void
+aux_wfree     (lua_State *L, waxJsonWriter *W),
+aux_shreset   (waxJsonShape *W),
+aux_lnlaunch  (waxJsonLines *J, int first),
+aux_lnfree    (waxJsonLines *J),
+aux_patch     (lua_State *L, int t, int p, int depth),
+aux_arenafree (void *ptr),
+aux_arenareset(jarena_s *A, int keep),
+aux_lexfree   (jlex_s *X),
+aux_pushtoken (lua_State *L, jlex_s *X, int tk),
+aux_pushnumstr(lua_State *L, const char *s, size_t len);
+
+int waxJsonNull = 0;
+
+/* Arena of the running call on this thread, NULL uses the heap */
+static __thread jarena_s *aux_arena = NULL;
 
 LuaReg module[] = {
   { "decode",     wax_json_decode },
+  { "decodefile", wax_json_decodefile },
+  { "decode_into", wax_json_decode_into },
+  { "lines",      wax_json_lines  },
   { "encode",     wax_json_encode },
+  { "canonical",  wax_json_canonical },
+  { "diff",       wax_json_diff   },
+  { "patch",      wax_json_patch  },
+  { "parser",     wax_json_parser },
+  { "events",     wax_json_events },
+  { "select",     wax_json_select },
+  { "valid",      wax_json_valid  },
+  { "encoder",    wax_json_encoder },
+  { "compile_encoder", wax_json_compile_encoder },
+  { NULL,         NULL            }
+};
+
+LuaReg parser_mt[] = {
+  { "feed",       wax_json_feed   },
+  { "values",     wax_json_values },
+  { "close",      wax_json_pclose },
+  { "__gc",       wax_json_pclose },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",    wax_json_pclose },
+  #endif
+  { NULL,         NULL            }
+};
+
+LuaReg arena_mt[] = {
+  { "__gc",       wax_json_afree  },
+  { NULL,         NULL            }
+};
+
+LuaReg encoder_mt[] = {
+  { "write",        wax_json_enitem   },
+  { "item",         wax_json_enitem   },
+  { "begin_array",  wax_json_enarray  },
+  { "begin_object", wax_json_enobject },
+  { "finish",       wax_json_enfinish },
+  { "flush",        wax_json_enflush  },
+  { "close",        wax_json_enclose  },
+  { "__gc",         wax_json_enfree   },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",      wax_json_enclose  },
+  #endif
+  { NULL,           NULL              }
+};
+
+LuaReg shape_mt[] = {
+  { "encode",     wax_json_shencode },
+  { "encodelist", wax_json_shlist   },
+  { "__gc",       wax_json_shfree   },
+  { NULL,         NULL              }
+};
+
+LuaReg lines_mt[] = {
+  { "__gc",       wax_json_lclose },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",    wax_json_lclose },
+  #endif
+  { NULL,         NULL            }
+};
+
+LuaReg events_mt[] = {
+  { "__gc",       wax_json_eclose },
+  #if LUA_VERSION_NUM >= 504
+  { "__close",    wax_json_eclose },
+  #endif
   { NULL,         NULL            }
 };
 
 
 int
 luaopen_wax_json_initc(lua_State *L) {
+  cJSON_Hooks hooks = { aux_arenalloc, aux_arenafree };
+  cJSON_InitHooks(&hooks);
+  wLua_newuserdata_mt(L, UD_ARENA,  arena_mt);
+  wLua_newuserdata_mt(L, UD_PARSER, parser_mt);
+  wLua_newuserdata_mt(L, UD_EVENTS, events_mt);
+  wLua_newuserdata_mt(L, UD_LINES,  lines_mt);
+  wLua_newuserdata_mt(L, UD_ENCODER, encoder_mt);
+  wLua_newuserdata_mt(L, UD_SHAPE,   shape_mt);
   wLua_export(L, module);
+  wax_json_msgpack_open(L);
+  wax_json_cbor_open(L);
   lua_pushlightuserdata(L, (void *) &waxJsonNull);
   lua_setfield(L,-2, "null");
   return 1;
 }
 
+#if LUA_VERSION_NUM >= 503
 #define aux_pushnumber(L,j) \
-  if ((j)->valuedouble>(j->valueint)) { \
-    lua_pushnumber((L),(j->valuedouble)); \
+  if ((j)->type & cJSON_NumberIsInt64) { \
+    lua_pushinteger((L),(lua_Integer)((j)->valueint64)); \
   } else { \
-    lua_pushinteger((L),(j->valueint));\
+    lua_pushnumber((L),((j)->valuedouble)); \
   };
+#else
+#define aux_pushnumber(L,j) lua_pushnumber((L),((j)->valuedouble));
+#endif
 
-#define aux_pushludata(L,d) lua_pushlightuserdata((L),(void *)&(d));
+#define aux_isspace(c) ((c)==' ' || (c)=='\n' || (c)=='\r' || (c)=='\t')
+#define aux_isnumc(c)  (((c)>='0' && (c)<='9') \
+                       || (c)=='-' || (c)=='+' || (c)=='.' || (c)=='e' || (c)=='E')
+#define aux_islitc(c)  ((c)>='a' && (c)<='z')
+#define aux_isdelim(c) (aux_isspace(c) || (c)=='{' || (c)=='}' || (c)=='[' \
+                       || (c)==']' || (c)==':' || (c)==',')
+#define aux_canvalue(X) ((X)->expect == JEX_VALUE   \
+                        || (X)->expect == JEX_FIRSTVALUE \
+                        || ((X)->expect == JEX_END && (X)->multi))
 
 
 
@@ -70,20 +434,114 @@ luaopen_wax_json_initc(lua_State *L) {
 
 Lua
 wax_json_decode(lua_State *L) {
-  cJSON *json   = cJSON_Parse(luaL_checkstring(L, 1));
+  luaL_checkstring(L, 1);
+  return waxJson_inarena(L, aux_dodecode);
+}
+
+/* The nodes are released with the arena, no need for cJSON_Delete.
+   On errors json.valid finds what is wrong. */
+Lua
+aux_dodecode(lua_State *L) {
+  size_t len;
+  const char *str = lua_tolstring(L, 1, &len), *err;
+  const unsigned char *at = (const unsigned char *) str;
+  cJSON *json   = cJSON_ParseWithLength(str, len);
   stack_s stack = { 0, LUA_MINSTACK };
+  jkeys_s keys;
+
+  if (json == NULL) {
+    err = aux_valid(at, at + len, &at);
+    return waxJson_binerror(L, err ? err : "not enough memory",
+                            (size_t) (at - (const unsigned char *) str));
+  }
+  waxJson_keysinit(L, &keys);
   stack.used    = lua_gettop(L);
-  aux_decode(L, json, &stack);
-  cJSON_Delete(json);
+  aux_decode(L, json, &stack, &keys);
+  return 1;
+}
+
+Lua
+wax_json_decodefile(lua_State *L) {
+  luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  return waxJson_inarena(L, aux_dodecodefile);
+}
+
+/*
+ * Regular files are parsed from a memory map, without a copy on the Lua
+ * heap, others (as pipes, or files reporting no size as the ones on
+ * /proc) are read to the call arena. cJSON copies the
+ * strings to the nodes, so the map is released before any Lua value is
+ * made and errors can't leak it.
+ */
+Lua
+aux_dodecodefile(lua_State *L) {
+  const unsigned char *at;
+  const char *err = "unexpected end of input";
+  jbuf_s B = { NULL, 0, 0, 0, 0, 0 };
+  size_t len = 0, pos = 0;
+  struct stat st;
+  stack_s stack = { 0, LUA_MINSTACK };
+  jkeys_s keys;
+  cJSON *json = NULL;
+  char *map = NULL;
+  ssize_t n;
+  int fd, e;
+
+  wLua_failnil(L, (fd = open(lua_tostring(L, 1), O_RDONLY)) < 0);
+  e = fstat(fd, &st) < 0 ? errno
+    : S_ISDIR(st.st_mode) ? EISDIR
+    : (unsigned long long) st.st_size > (size_t) -1 ? EFBIG : 0;
+
+  if (!e && S_ISREG(st.st_mode) && (len = (size_t) st.st_size) > 0) {
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) e = errno;
+#ifdef MADV_SEQUENTIAL
+    else madvise(map, len, MADV_SEQUENTIAL);
+#endif
+  } else if (!e) {
+    for (;;) {
+      if (!aux_bufneed(&B, 65536)) {
+        e = ENOMEM;
+        break;
+      }
+      if ((n = read(fd, B.b + B.len, B.cap - B.len)) > 0)
+        B.len += (size_t) n;
+      else if (n == 0)
+        break;
+      else if (errno != EINTR) {
+        e = errno;
+        break;
+      }
+    }
+    map = B.b;
+    len = B.len;
+  }
+  close(fd);
+  wLua_failnil_m(L, e, strerror(e));
+
+  if (len > 0 && (json = cJSON_ParseWithLength(map, len)) == NULL) {
+    at  = (const unsigned char *) map;
+    err = aux_valid(at, at + len, &at);
+    pos = (size_t) (at - (const unsigned char *) map);
+    if (err == NULL) err = "not enough memory";
+  }
+  if (len > 0 && map != B.b) munmap(map, len);
+  if (json == NULL) return waxJson_binerror(L, err, pos);
+
+  waxJson_keysinit(L, &keys);
+  stack.used = lua_gettop(L);
+  aux_decode(L, json, &stack, &keys);
   return 1;
 }
 
+
 static void
-aux_decode(lua_State *L, cJSON *val, stack_s *S) {
+aux_decode(lua_State *L, cJSON *val, stack_s *S, jkeys_s *K) {
   if ( cJSON_IsObject(val) ) {
-    aux_decobj(L, val->child, S, cJSON_GetArraySize(val));
+    aux_decobj(L, val->child, S, K, cJSON_GetArraySize(val));
   } else if ( cJSON_IsArray(val) ) {
-    aux_decarr(L, val->child, S, cJSON_GetArraySize(val));
+    aux_decarr(L, val->child, S, K, cJSON_GetArraySize(val));
   } else if ( cJSON_IsString(val) ) {
     lua_pushstring  (L, val->valuestring);
   } else if ( cJSON_IsNumber(val) ) {
@@ -96,44 +554,497 @@ aux_decode(lua_State *L, cJSON *val, stack_s *S) {
 }
 
 static void
-aux_decobj(lua_State *L, cJSON *node, stack_s *stack, int len) {
+aux_decobj(lua_State *L, cJSON *node, stack_s *stack, jkeys_s *K, int len) {
   int i;
-  aux_luastack_alloc(L, stack, 2);
+  waxJson_luastack_alloc(L, stack, 3);
   lua_createtable(L,0,len);
   for (i=0; i < len; i++) {
-    lua_pushstring(L, node->string); /* The object key */
-    aux_decode(L, node, stack);
+    waxJson_pushkey(L, K, node->string, strlen(node->string)); /* The object key */
+    aux_decode(L, node, stack, K);
     lua_settable(L,-3);
     node = node->next;
   }
-  aux_luastack_alloc(L, stack, -2);
+  waxJson_luastack_alloc(L, stack, -3);
 }
 
 static void
-aux_decarr(lua_State *L, cJSON *node, stack_s *stack, int len) {
+aux_decarr(lua_State *L, cJSON *node, stack_s *stack, jkeys_s *K, int len) {
   int i;
-  aux_luastack_alloc(L, stack, 2);
+  waxJson_luastack_alloc(L, stack, 2);
   lua_createtable(L,len,0);
   for (i=1; i <= len; i++) {
     lua_pushinteger(L, i); /* The object key */
-    aux_decode(L, node, stack);
+    aux_decode(L, node, stack, K);
     lua_settable(L,-3);
     node = node->next;
   }
-  aux_luastack_alloc(L, stack, -2);
+  waxJson_luastack_alloc(L, stack, -2);
+}
+
+/* Pushes the table of cached keys and empties the cache */
+void
+waxJson_keysinit(lua_State *L, jkeys_s *K) {
+  lua_createtable(L, KEYS_SLOTS, 0);
+  K->idx = lua_gettop(L);
+  memset(K->key, 0, sizeof(K->key));
+}
+
+void
+waxJson_pushkey(lua_State *L, jkeys_s *K, const char *key, size_t len) {
+  int h = len == 0 ? 0 : (int) ((len * 31 + (unsigned char) key[0] * 7
+                                    + (unsigned char) key[len-1]) % KEYS_SLOTS);
+
+  if (K->key[h] != NULL && K->len[h] == len && memcmp(K->key[h], key, len) == 0) {
+    lua_rawgeti(L, K->idx, h+1);
+    return;
+  }
+  lua_pushlstring(L, key, len);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, K->idx, h+1);
+  K->key[h] = key;
+  K->len[h] = len;
+}
+
+/* ---- Decode into ---- */
+
+Lua
+wax_json_decode_into(lua_State *L) {
+  luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  return waxJson_inarena(L, aux_dodecodeinto);
+}
+
+/*
+ * Updates the table at 2 with the object or array of the text at 1.
+ * Tables of the target found at the place of an object or array are
+ * reused, any other value is decoded as by json.decode. Parsing ends
+ * before the target is touched, so a syntax error leaves it as it was.
+ */
+Lua
+aux_dodecodeinto(lua_State *L) {
+  size_t len;
+  const char *str = lua_tolstring(L, 1, &len), *err;
+  const unsigned char *at = (const unsigned char *) str;
+  cJSON *json = cJSON_ParseWithLength(str, len);
+  jinto_s I;
+
+  if (json == NULL) {
+    err = aux_valid(at, at + len, &at);
+    return waxJson_binerror(L, err ? err : "not enough memory",
+                            (size_t) (at - (const unsigned char *) str));
+  }
+  if (!cJSON_IsObject(json) && !cJSON_IsArray(json)) {
+    while (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r') at++;
+    return waxJson_binerror(L, "expected object or array",
+                            (size_t) (at - (const unsigned char *) str));
+  }
+  memset(&I, 0, sizeof(I));
+  waxJson_keysinit(L, &I.K);
+  I.S.limit = LUA_MINSTACK;
+  I.S.used  = lua_gettop(L);
+  lua_pushvalue(L, 2);
+  aux_intofresh(L, &I);
+  aux_into(L, &I, json);
+  return 1;
+}
+
+/* Updates the table on top of the stack with the object or array `val` */
+static void
+aux_into(lua_State *L, jinto_s *I, cJSON *val) {
+  if ( cJSON_IsObject(val) )
+    aux_intoobj(L, I, val->child, cJSON_GetArraySize(val));
+  else
+    aux_intoarr(L, I, val->child, cJSON_GetArraySize(val));
+}
+
+/*
+ * The keys of the object are kept in a set, counting the distinct ones.
+ * When the table ends with more keys, the ones not in the set are
+ * cleared, what the Lua manual allows while traversing with lua_next.
+ */
+static void
+aux_intoobj(lua_State *L, jinto_s *I, cJSON *node, int len) {
+  size_t cap = 8, keys = 0, count = 0, klen, h;
+  int t = lua_gettop(L);
+  const char *key;
+  jsort_s *set;
+
+  while (cap < (size_t) len * 2) cap <<= 1;
+  if ((set = aux_arenalloc(cap * sizeof(*set))) == NULL)
+    luaL_error(L, "not enough memory");
+  memset(set, 0, cap * sizeof(*set));
+  waxJson_luastack_alloc(L, &I->S, 3);
+
+  for (; node != NULL; node = node->next) {
+    klen = strlen(node->string);
+    h = aux_intoslot(set, cap, node->string, klen);
+    if (set[h].s == NULL) {
+      set[h].s   = node->string;
+      set[h].len = klen;
+      keys++;
+    }
+    waxJson_pushkey(L, &I->K, node->string, klen);
+    aux_intoval(L, I, node, t);
+    lua_rawset(L, t);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    lua_pop(L, 1);
+    count++;
+  }
+  if (count != keys) {
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+      lua_pop(L, 1);
+      if (lua_type(L, -1) == LUA_TSTRING) {
+        key = lua_tolstring(L, -1, &klen);
+        if (set[aux_intoslot(set, cap, key, klen)].s != NULL) continue;
+      }
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, t);
+    }
+  }
+  waxJson_luastack_alloc(L, &I->S, -3);
+}
+
+static void
+aux_intoarr(lua_State *L, jinto_s *I, cJSON *node, int len) {
+  int t = lua_gettop(L), i;
+  size_t count = 0;
+  lua_Number d;
+
+  waxJson_luastack_alloc(L, &I->S, 3);
+  for (i = 1; node != NULL; node = node->next, i++) {
+    lua_pushinteger(L, i);
+    aux_intoval(L, I, node, t);
+    lua_rawset(L, t);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    lua_pop(L, 1);
+    count++;
+  }
+  if (count != (size_t) len) {
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+      lua_pop(L, 1);
+      if (lua_type(L, -1) == LUA_TNUMBER) {
+        d = lua_tonumber(L, -1);
+        if (d >= 1 && d <= len && d == (lua_Number) (int) d) continue;
+      }
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, t);
+    }
+  }
+  waxJson_luastack_alloc(L, &I->S, -3);
+}
+
+/* Pushes the value of `node` for the key on top of the table at `t`:
+   its old table updated in place, or a new value */
+static void
+aux_intoval(lua_State *L, jinto_s *I, cJSON *node, int t) {
+  if (cJSON_IsObject(node) || cJSON_IsArray(node)) {
+    lua_pushvalue(L, -1);
+    lua_rawget(L, t);
+    if (aux_intofresh(L, I)) {
+      aux_into(L, I, node);
+      return;
+    }
+    lua_pop(L, 1);
+  }
+  aux_decode(L, node, &I->S, &I->K);
+}
+
+/* Whether the value on top is a table not updated yet, marking it */
+static int
+aux_intofresh(lua_State *L, jinto_s *I) {
+  const void *p, **old = I->seen;
+  size_t i, j, cap = I->cap;
+
+  if (!lua_istable(L, -1)) return 0;
+  if (I->n * 2 >= I->cap) {
+    I->cap = cap ? cap * 2 : 64;
+    if ((I->seen = aux_arenalloc(I->cap * sizeof(*I->seen))) == NULL)
+      luaL_error(L, "not enough memory");
+    memset((void *) I->seen, 0, I->cap * sizeof(*I->seen));
+    for (j = 0; j < cap; j++) {
+      if (old[j] == NULL) continue;
+      i = ((size_t) old[j] >> 3) * 2654435761u & (I->cap - 1);
+      while (I->seen[i] != NULL) i = (i + 1) & (I->cap - 1);
+      I->seen[i] = old[j];
+    }
+  }
+  p = lua_topointer(L, -1);
+  i = ((size_t) p >> 3) * 2654435761u & (I->cap - 1);
+  for (; I->seen[i] != NULL; i = (i + 1) & (I->cap - 1))
+    if (I->seen[i] == p) return 0;
+  I->seen[i] = p;
+  I->n++;
+  return 1;
+}
+
+/* Slot of the key in the set, or the empty one where it goes (FNV-1a) */
+static size_t
+aux_intoslot(jsort_s *set, size_t cap, const char *s, size_t len) {
+  unsigned long long h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+  for (i = (size_t) h & (cap - 1); set[i].s != NULL; i = (i + 1) & (cap - 1))
+    if (set[i].len == len && memcmp(set[i].s, s, len) == 0) break;
+  return i;
+}
+
+
+/* ---- JSON Lines ---- */
+
+/*
+ * Iterates the values of the JSON Lines file at `path`, parsed by
+ * opts.threads workers, by default the number of processors. Blank lines
+ * are skipped. If the file can't be read returns nil and the message.
+ */
+Lua
+wax_json_lines(lua_State *L) {
+  waxJsonLines *J;
+  struct stat st;
+  lua_Integer threads = 0;
+  size_t cap = 0;
+  ssize_t n;
+  char *b;
+  int fd, e, i;
+
+  luaL_checkstring(L, 1);
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "threads");
+    threads = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, threads >= 0, 2, "threads must not be negative");
+    lua_pop(L, 1);
+  }
+  if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  if (threads > LINES_THREADS) threads = LINES_THREADS;
+  lua_settop(L, 1);
+
+  J = lua_newuserdata(L, sizeof(*J));
+  memset(J, 0, sizeof(*J));
+  J->keyref = LUA_NOREF;
+  luaL_getmetatable(L, UD_LINES);
+  lua_setmetatable(L, -2);
+
+  wLua_failnil(L, (fd = open(lua_tostring(L, 1), O_RDONLY)) < 0);
+  e = fstat(fd, &st) < 0 ? errno
+    : S_ISDIR(st.st_mode) ? EISDIR
+    : (unsigned long long) st.st_size > (size_t) -1 ? EFBIG : 0;
+
+  if (!e && S_ISREG(st.st_mode)) {
+    if ((J->len = (size_t) st.st_size) > 0) {
+      J->map = mmap(NULL, J->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (J->map == MAP_FAILED) {
+        J->map = NULL;
+        e = errno;
+      } else {
+        J->mapped = 1;
+#ifdef MADV_SEQUENTIAL
+        madvise(J->map, J->len, MADV_SEQUENTIAL);
+#endif
+      }
+    }
+  } else while (!e) {
+    if (J->len == cap) {
+      cap = cap ? cap * 2 : 65536;
+      if ((b = realloc(J->map, cap)) == NULL) {
+        e = ENOMEM;
+        break;
+      }
+      J->map = b;
+    }
+    if ((n = read(fd, J->map + J->len, cap - J->len)) > 0)
+      J->len += (size_t) n;
+    else if (n == 0)
+      break;
+    else if (errno != EINTR)
+      e = errno;
+  }
+  close(fd);
+  if (e) aux_lnfree(J);
+  wLua_failnil_m(L, e, strerror(e));
+
+  J->n    = (int) threads;
+  J->jobs = calloc((size_t) (2 * J->n), sizeof(jjob_s));
+  for (i = 0; J->jobs != NULL && i < 2 * J->n; i++)
+    if ((J->jobs[i].vals = wArr_new(*J->jobs[i].vals, 64)) == NULL) break;
+  if (J->jobs == NULL || i < 2 * J->n) {
+    aux_lnfree(J);
+    return luaL_error(L, "not enough memory");
+  }
+  J->open = 1;
+
+  waxJson_keysinit(L, &J->K);
+  J->keyref = luaL_ref(L, LUA_REGISTRYINDEX);
+  aux_lnlaunch(J, 0);
+  aux_lnlaunch(J, J->n);
+  lua_pushcclosure(L, iter_lines, 1);
+  return 1;
+}
+
+/* Pushes the next value, raising an error on invalid lines */
+Lua
+iter_lines(lua_State *L) {
+  waxJsonLines *J = lua_touserdata(L, lua_upvalueindex(1));
+  stack_s stack = { 0, LUA_MINSTACK };
+  jjob_s *job;
+  char msg[128];
+
+  if (!J->open) return 0;
+  for (;;) {
+    job = J->jobs + J->cur;
+    if (job->state == JOB_IDLE) {
+      aux_lnfree(J);
+      return 0;
+    }
+    if (job->state == JOB_RUNNING) {
+      pthread_join(job->tid, NULL);
+      job->state = JOB_DONE;
+    }
+    if (J->item < wArr_len(job->vals)) break;
+    if (job->err != NULL) {
+      snprintf(msg, sizeof(msg), "%s at line %lu, offset %lu", job->err,
+               (unsigned long) (J->line + job->errline + 1),
+               (unsigned long) job->errpos);
+      return luaL_error(L, "%s", msg);
+    }
+
+    /* the cached keys point to the trees of the job */
+    memset(J->K.key, 0, sizeof(J->K.key));
+    aux_arenareset(&job->A, 1);
+    wArr_clear(job->vals);
+    J->line += job->lines;
+    J->item  = 0;
+    job->state = JOB_IDLE;
+    J->cur = (J->cur + 1) % (2 * J->n);
+    if (J->cur % J->n == 0) aux_lnlaunch(J, J->cur == 0 ? J->n : 0);
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, J->keyref);
+  J->K.idx   = lua_gettop(L);
+  stack.used = J->K.idx;
+  aux_decode(L, job->vals[J->item++], &stack, &J->K);
+  return 1;
+}
+
+Lua
+wax_json_lclose(lua_State *L) {
+  waxJsonLines *J = luaL_checkudata(L, 1, UD_LINES);
+  aux_lnfree(J);
+  luaL_unref(L, LUA_REGISTRYINDEX, J->keyref);
+  J->keyref = LUA_NOREF;
+  return 0;
+}
+
+/* Gives the next slices of input to the batch of jobs from `first`. If
+   a thread can't be created the job runs on the caller. */
+static void
+aux_lnlaunch(waxJsonLines *J, int first) {
+  jjob_s *job;
+  const char *nl;
+  size_t end;
+  int i;
+
+  for (i = first; i < first + J->n && J->pos < J->len; i++) {
+    job = J->jobs + i;
+    end = J->len - J->pos > LINES_SLICE ? J->pos + LINES_SLICE : J->len;
+    if (end < J->len) {
+      nl  = memchr(J->map + end, '\n', J->len - end);
+      end = nl != NULL ? (size_t) (nl - J->map) + 1 : J->len;
+    }
+    job->s     = J->map + J->pos;
+    job->e     = J->map + end;
+    job->off   = J->pos;
+    job->lines = 0;
+    job->err   = NULL;
+    J->pos     = end;
+    job->state = JOB_RUNNING;
+    if (pthread_create(&job->tid, NULL, aux_lnwork, job) != 0) {
+      aux_lnwork(job);
+      job->state = JOB_DONE;
+    }
+  }
+}
+
+/* Parses the lines of a job, with no access to Lua */
+static void
+*aux_lnwork(void *arg) {
+  jjob_s *job = arg;
+  jarena_s *prev = aux_arena;
+  const unsigned char *at;
+  const char *p, *nl, *end;
+  cJSON *val;
+
+  aux_arena = &job->A;
+  for (p = job->s; p < job->e; p = nl + 1) {
+    if ((nl = memchr(p, '\n', (size_t) (job->e - p))) == NULL) nl = job->e;
+    for (end = p; end < nl && aux_isspace(*end); end++);
+    if (end < nl) {
+      val = cJSON_ParseWithLengthOpts(p, (size_t) (nl - p), &end, 0);
+      if (val != NULL)
+        for (; end < nl && aux_isspace(*end); end++);
+      if (val == NULL || end < nl || !wArr_push(job->vals, val)) {
+        at = (const unsigned char *) p;
+        if ((job->err = aux_valid(at, (const unsigned char *) nl, &at)) == NULL)
+          job->err = "not enough memory";
+        job->errline = job->lines;
+        job->errpos  = job->off + (size_t) ((const char *) at - job->s);
+        break;
+      }
+    }
+    if (nl < job->e) job->lines++;
+  }
+  aux_arena = prev;
+  return NULL;
+}
+
+/* Waits the running jobs and releases the input and the trees */
+static void
+aux_lnfree(waxJsonLines *J) {
+  int i;
+
+  for (i = 0; J->jobs != NULL && i < 2 * J->n; i++) {
+    if (J->jobs[i].state == JOB_RUNNING) pthread_join(J->jobs[i].tid, NULL);
+    aux_arenareset(&J->jobs[i].A, 0);
+    wArr_free(J->jobs[i].vals);
+  }
+  free(J->jobs);
+  J->jobs = NULL;
+  if (J->mapped) munmap(J->map, J->len);
+  else free(J->map);
+  J->map    = NULL;
+  J->mapped = 0;
+  J->open   = 0;
 }
 
+
 /* ---- Encode ---- */
 
 Lua
 wax_json_encode(lua_State *L) {
+  lua_settop(L, 1);
+  return waxJson_inarena(L, aux_doencode);
+}
+
+Lua
+aux_doencode(lua_State *L) {
   cJSON *res;
   stack_s stack = { 0, LUA_MINSTACK };
 
   lua_pushvalue(L, 1);
   if ((res = aux_encode(L, &stack)) != NULL) {
     lua_pushstring(L,cJSON_PrintUnformatted(res));
-    cJSON_Delete(res);
     return 1;
   }
 
@@ -152,6 +1063,10 @@ static cJSON
     }
 
     case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, -1))
+        return cJSON_CreateInt64((long long) lua_tointeger(L, -1));
+#endif
       return cJSON_CreateNumber(lua_tonumber(L, -1));
 
     case LUA_TSTRING:
@@ -181,7 +1096,7 @@ static cJSON
 
   cJSON *val,
         *array = cJSON_CreateArray();
-  aux_luastack_alloc(L,S,2);
+  waxJson_luastack_alloc(L,S,2);
   for (i=1; i <= len; i++) {
     lua_rawgeti(L,idx,i);
     if ((val = aux_encode(L, S)) == NULL) goto fail;
@@ -190,12 +1105,12 @@ static cJSON
   }
 
   /* success: */
-  aux_luastack_alloc(L,S,-2);
+  waxJson_luastack_alloc(L,S,-2);
   return array;
   
   fail:
     lua_pop(L,1);
-    aux_luastack_alloc(L,S,-2);
+    waxJson_luastack_alloc(L,S,-2);
     cJSON_Delete(array);
     return NULL;
 }
@@ -204,7 +1119,7 @@ static cJSON
 *aux_enc_tdict(lua_State *L, stack_s *S) {
   cJSON *val, *obj;
   int idx = lua_gettop(L);
-  aux_luastack_alloc(L,S,2);
+  waxJson_luastack_alloc(L,S,2);
   lua_pushnil(L);
   obj = cJSON_CreateObject();
   while (lua_next(L, idx) != 0) {
@@ -217,7 +1132,7 @@ static cJSON
     }
     lua_pop(L,1);
   }
-  aux_luastack_alloc(L,S,-2);
+  waxJson_luastack_alloc(L,S,-2);
   return obj;
 
   fail :
@@ -226,10 +1141,2297 @@ static cJSON
 }
 
 
-/* ---- Stack allocation ---- */
+/* ---- Push parser ---- */
+
+Lua
+wax_json_parser(lua_State *L) {
+  waxJsonParser *P = lua_newuserdata(L, sizeof(*P));
+  P->cnt   = wArr_new(*P->cnt, 8);
+  P->slots = 0;
+  P->head  = 0;
+  P->tail  = 0;
+  wLua_assert(L, P->cnt != NULL && aux_lexinit(&P->X, 1), strerror(errno));
+
+  lua_newtable(L);
+  P->sref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  P->qref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  luaL_getmetatable(L, UD_PARSER);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/*
+ * The containers still open and their pending keys are kept on the Lua
+ * stack while the chunk is parsed, like in aux_decobj, and saved on the
+ * slots table when the chunk ends.
+ */
+Lua
+wax_json_feed(lua_State *L) {
+  waxJsonParser *P = luaL_checkudata(L, 1, UD_PARSER);
+  int eof = lua_isnoneornil(L, 2);
+  size_t len = 0;
+  const char *p = eof ? "" : luaL_checklstring(L, 2, &len),
+             *end = p + len;
+  stack_s stack = { 0, LUA_MINSTACK };
+  int tk, i, n;
+
+  wLua_assert(L, P->cnt != NULL, "closed parser");
+  if (P->X.err) return aux_lexerror(L, &P->X);
+
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, P->sref);  /* 3: slots */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, P->qref);  /* 4: queue */
+  stack.used = lua_gettop(L);
+  waxJson_luastack_alloc(L, &stack, P->slots);
+  for (i = 1; i <= P->slots; i++) lua_rawgeti(L, 3, i);
+
+  while ((tk = aux_lex(&P->X, &p, end, eof)) > JTK_ERROR) {
+    switch (tk) {
+      case JTK_OBJ:
+      case JTK_ARR:
+        waxJson_luastack_alloc(L, &stack, 2);
+        lua_newtable(L);
+        if (tk == JTK_ARR && !wArr_push(P->cnt, 0)) goto nomem;
+        continue;
+
+      case JTK_KEY:
+        lua_pushlstring(L, P->X.val, P->X.vlen);
+        continue;
+
+      case JTK_ENDARR:
+        wArr_pop(P->cnt, 0);
+        /* fallthrough */
+      case JTK_ENDOBJ:
+        waxJson_luastack_alloc(L, &stack, -2);
+        break;
+
+      default:
+        aux_pushtoken(L, &P->X, tk);
+    }
+
+    /* Settle the complete value into its parent or the queue */
+    if ((n = wArr_len(P->X.nest)) == 0)
+      lua_rawseti(L, 4, ++P->tail);
+    else if (P->X.nest[n-1] == '{')
+      lua_rawset(L, -3);
+    else
+      lua_rawseti(L, -2, ++P->cnt[wArr_len(P->cnt)-1]);
+  }
+
+  /* Save what is still open */
+  n = lua_gettop(L) - 4;
+  for (i = n; i > 0; i--) lua_rawseti(L, 3, i);
+  for (i = n+1; i <= P->slots; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, 3, i);
+  }
+  P->slots = n;
+
+  if (tk == JTK_ERROR) return aux_lexerror(L, &P->X);
+  lua_pushboolean(L, 1);
+  return 1;
+
+  nomem:
+    lua_pushstring(L, strerror(errno));
+    return lua_error(L);
+}
+
+Lua
+wax_json_values(lua_State *L) {
+  luaL_checkudata(L, 1, UD_PARSER);
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, iter_values, 1);
+  return 1;
+}
+
+Lua
+iter_values(lua_State *L) {
+  waxJsonParser *P = lua_touserdata(L, lua_upvalueindex(1));
+  if (P->cnt == NULL || P->head >= P->tail) return 0;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, P->qref);
+  lua_rawgeti(L, -1, ++P->head);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, P->head);
+  return 1;
+}
+
+Lua
+wax_json_pclose(lua_State *L) {
+  waxJsonParser *P = luaL_checkudata(L, 1, UD_PARSER);
+  if (P->cnt == NULL) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  aux_lexfree(&P->X);
+  wArr_free(P->cnt);
+  luaL_unref(L, LUA_REGISTRYINDEX, P->sref);
+  luaL_unref(L, LUA_REGISTRYINDEX, P->qref);
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
 static void
-aux_luastack_alloc(lua_State *L, stack_s *stack, int size) {
+aux_pushtoken(lua_State *L, jlex_s *X, int tk) {
+  switch (tk) {
+    case JTK_STR:
+    case JTK_KEY:   lua_pushlstring(L, X->val, X->vlen);  break;
+    case JTK_NUM:   aux_pushnumstr(L, X->val, X->vlen);   break;
+    case JTK_TRUE:  lua_pushboolean(L, 1);                break;
+    case JTK_FALSE: lua_pushboolean(L, 0);                break;
+    default:        aux_pushludata(L, waxJsonNull);
+  }
+}
+
+/* Integer literals are pushed as integers, others as floats */
+static void
+aux_pushnumstr(lua_State *L, const char *s, size_t len) {
+  double d = 0;
+  long long i = 0;
+
+  if (wNum_parse(&s, s + len, &d, &i) == WNUM_INT && (lua_Integer) i == i)
+    lua_pushinteger(L, (lua_Integer) i);
+  else
+    lua_pushnumber(L, d);
+}
+
+
+/* ---- Event stream ---- */
+
+Lua
+wax_json_events(lua_State *L) {
+  waxJsonEvents *E;
+  int type = lua_type(L, 1);
+
+  luaL_argcheck(L, type == LUA_TSTRING || type == LUA_TFUNCTION
+                || type == LUA_TUSERDATA || type == LUA_TTABLE, 1,
+                "string, function or file expected");
+
+  E = lua_newuserdata(L, sizeof(*E));
+  E->open = 0;
+  wLua_assert(L, aux_lexinit(&E->X, 1), strerror(errno));
+  E->open = 1;
+  E->p    = E->end = "";
+  E->eof  = 0;
+
+  lua_pushvalue(L, 1);
+  E->srcref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushboolean(L, 0);
+  E->chkref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  luaL_getmetatable(L, UD_EVENTS);
+  lua_setmetatable(L, -2);
+  lua_pushcclosure(L, iter_events, 1);
+  return 1;
+}
+
+/*
+ * Returns the event name, the key or scalar value and the depth.
+ * Containers have the depth of their items, scalars on top have depth 0.
+ */
+Lua
+iter_events(lua_State *L) {
+  waxJsonEvents *E = lua_touserdata(L, lua_upvalueindex(1));
+  size_t len;
+  int tk;
+
+  if (!E->open) return 0;
+
+  while ((tk = aux_lex(&E->X, &E->p, E->end, E->eof)) == JTK_MORE) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, E->srcref);
+    switch (lua_type(L, -1)) {
+      case LUA_TSTRING:
+        E->eof = 1;
+        break;
+      case LUA_TFUNCTION:
+        lua_call(L, 0, 1);
+        break;
+      default:
+        lua_getfield(L, -1, "read");
+        lua_insert(L, -2);
+        lua_pushinteger(L, EVENTS_CHUNK);
+        lua_call(L, 2, 1);
+    }
+    if (lua_isnil(L, -1)) {
+      E->eof = 1;
+      lua_pop(L, 1);
+      continue;
+    }
+    wLua_assert(L, lua_type(L, -1) == LUA_TSTRING, "source must return strings");
+    E->p   = lua_tolstring(L, -1, &len);
+    E->end = E->p + len;
+    lua_rawseti(L, LUA_REGISTRYINDEX, E->chkref);
+  }
+
+  switch (tk) {
+    case JTK_END:
+      return 0;
+    case JTK_ERROR:
+      aux_lexerror(L, &E->X);
+      return lua_error(L);
+    case JTK_OBJ:
+      lua_pushstring(L, "start_object");
+      lua_pushnil(L);
+      break;
+    case JTK_ARR:
+      lua_pushstring(L, "start_array");
+      lua_pushnil(L);
+      break;
+    case JTK_ENDOBJ:
+      lua_pushstring(L, "end_object");
+      lua_pushnil(L);
+      lua_pushinteger(L, wArr_len(E->X.nest) + 1);
+      return 3;
+    case JTK_ENDARR:
+      lua_pushstring(L, "end_array");
+      lua_pushnil(L);
+      lua_pushinteger(L, wArr_len(E->X.nest) + 1);
+      return 3;
+    case JTK_KEY:
+      lua_pushstring(L, "key");
+      aux_pushtoken(L, &E->X, tk);
+      break;
+    default:
+      lua_pushstring(L, "value");
+      aux_pushtoken(L, &E->X, tk);
+  }
+  lua_pushinteger(L, wArr_len(E->X.nest));
+  return 3;
+}
+
+Lua
+wax_json_eclose(lua_State *L) {
+  waxJsonEvents *E = luaL_checkudata(L, 1, UD_EVENTS);
+  if (E->open) {
+    aux_lexfree(&E->X);
+    luaL_unref(L, LUA_REGISTRYINDEX, E->srcref);
+    luaL_unref(L, LUA_REGISTRYINDEX, E->chkref);
+    E->open = 0;
+  }
+  return 0;
+}
+
+
+/* ---- Path selection ---- */
+
+/*
+ * Walks the document only through the subtrees that can match the paths.
+ * Other subtrees are skipped by bracket and quote balancing and only the
+ * matched fragments are decoded.
+ */
+Lua
+wax_json_select(lua_State *L) {
+  return waxJson_inarena(L, aux_doselect);
+}
+
+Lua
+aux_doselect(lua_State *L) {
+  jsel_s S;
+  size_t len, plen, nseg = 0;
+  const char *path;
+  int i, j, n;
+
+  S.s = S.p = luaL_checklstring(L, 1, &len);
+  S.e = S.s + len;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  S.paths = 2;
+  S.npat  = wLua_rawlen(L, 2);
+
+  /* Paths and their segment offsets live in a single userdatum */
+  for (i = 1; i <= S.npat; i++) {
+    lua_rawgeti(L, 2, i);
+    wLua_assert(L, lua_type(L, -1) == LUA_TSTRING, "path %d is not a string", i);
+    path = lua_tolstring(L, -1, &plen);
+    wLua_assert(L, plen == 0 || path[0] == '/', "path %d must start with /", i);
+    for (j = 0; j < (int) plen; j++) if (path[j] == '/') nseg++;
+    lua_pop(L, 1);
+  }
+  S.pat = lua_newuserdata(L, sizeof(jpat_s) * S.npat
+                           + sizeof(size_t) * (nseg + S.npat));  /* 3 */
+
+  for (i = 0, nseg = 0; i < S.npat; i++) {
+    lua_rawgeti(L, 2, i+1);
+    path = lua_tolstring(L, -1, &plen);
+    lua_pop(L, 1); /* kept alive by paths table */
+    S.pat[i].path = path;
+    S.pat[i].seg  = (size_t *) (S.pat + S.npat) + nseg;
+    S.pat[i].nseg = 0;
+    S.pat[i].wild = 0;
+    S.pat[i].lvl  = 0;
+    for (j = 0; j < (int) plen; j++) if (path[j] == '/') {
+      S.pat[i].seg[S.pat[i].nseg++] = j+1;
+      if (path[j+1] == '*' && (j+2 == (int) plen || path[j+2] == '/'))
+        S.pat[i].wild = 1;
+    }
+    S.pat[i].seg[S.pat[i].nseg] = plen+1;
+    nseg += S.pat[i].nseg + 1;
+  }
+
+  lua_createtable(L, 0, S.npat);  /* 4 */
+  S.res = 4;
+  waxJson_keysinit(L, &S.K);      /* 5 */
+  for (i = 0; i < S.npat; i++) if (S.pat[i].wild) {
+    lua_rawgeti(L, 2, i+1);
+    lua_newtable(L);
+    lua_rawset(L, S.res);
+  }
+
+  wLua_assert(L, aux_lexinit(&S.X, 0), strerror(errno));
+  n = aux_select(L, &S, 0);
+  if (n) {
+    while (S.p < S.e && aux_isspace(*S.p)) S.p++;
+    if (S.p < S.e) {
+      S.X.err    = "unexpected character";
+      S.X.errpos = S.p - S.s;
+      n = 0;
+    }
+  }
+  if (!n) {
+    n = aux_lexerror(L, &S.X);
+    aux_lexfree(&S.X);
+    return n;
+  }
+  aux_lexfree(&S.X);
+  lua_pushvalue(L, S.res);
+  return 1;
+}
+
+#define aux_selspace(S) while ((S)->p < (S)->e && aux_isspace(*(S)->p)) (S)->p++
+
+#define aux_selfail(S, msg) do {    \
+  (S)->X.err    = (msg);            \
+  (S)->X.errpos = (S)->p - (S)->s;  \
+  return 0;                         \
+} while (0)
+
+static int
+aux_select(lua_State *L, jsel_s *S, int depth) {
+  const char *start, *key;
+  char idx[24];
+  size_t klen;
+  lua_Integer i;
+  int p, full = 0, deeper = 0;
+
+  for (p = 0; p < S->npat; p++) if (S->pat[p].lvl == depth) {
+    if (S->pat[p].nseg == depth) full = 1;
+    else deeper = 1;
+  }
+
+  aux_selspace(S);
+  if (S->p == S->e) aux_selfail(S, "unexpected end of input");
+  start = S->p;
+
+  if (!deeper) {
+    if (!aux_selskip(S)) return 0;
+
+  } else if (*S->p == '{') {
+    S->p++;
+    aux_selspace(S);
+    if (S->p < S->e && *S->p == '}') goto closed;
+    for (;;) {
+      aux_selspace(S);
+      if (S->p == S->e || *S->p != '"') aux_selfail(S, "key expected");
+      key = ++S->p;
+      if ((S->p = aux_strend(key, S->e)) == NULL) {
+        S->p = key;
+        aux_selfail(S, "unterminated string");
+      }
+      S->X.val  = key;
+      S->X.vlen = S->p++ - key;
+      if (!aux_unescape(&S->X)) {
+        S->X.errpos = key - S->s;
+        return 0;
+      }
+      key  = S->X.val;
+      klen = S->X.vlen;
+
+      aux_selspace(S);
+      if (S->p == S->e || *S->p != ':') aux_selfail(S, "colon expected");
+      S->p++;
+
+      for (p = 0; p < S->npat; p++)
+        if (S->pat[p].lvl == depth && S->pat[p].nseg > depth
+        && aux_selmatch(&S->pat[p], depth, key, klen))
+          S->pat[p].lvl = depth+1;
+      if (!aux_select(L, S, depth+1)) return 0;
+      for (p = 0; p < S->npat; p++)
+        if (S->pat[p].lvl > depth) S->pat[p].lvl = depth;
+
+      aux_selspace(S);
+      if (S->p < S->e && *S->p == ',') { S->p++; continue; }
+      if (S->p < S->e && *S->p == '}') break;
+      aux_selfail(S, "unexpected character");
+    }
+    closed:
+      S->p++;
+
+  } else if (*S->p == '[') {
+    S->p++;
+    aux_selspace(S);
+    if (S->p < S->e && *S->p == ']') goto aclosed;
+    for (i = 0;; i++) {
+      klen = snprintf(idx, sizeof(idx), "%ld", (long) i);
+      for (p = 0; p < S->npat; p++)
+        if (S->pat[p].lvl == depth && S->pat[p].nseg > depth
+        && aux_selmatch(&S->pat[p], depth, idx, klen))
+          S->pat[p].lvl = depth+1;
+      if (!aux_select(L, S, depth+1)) return 0;
+      for (p = 0; p < S->npat; p++)
+        if (S->pat[p].lvl > depth) S->pat[p].lvl = depth;
+
+      aux_selspace(S);
+      if (S->p < S->e && *S->p == ',') { S->p++; continue; }
+      if (S->p < S->e && *S->p == ']') break;
+      aux_selfail(S, "unexpected character");
+    }
+    aclosed:
+      S->p++;
+
+  } else {
+    if (!aux_selskip(S)) return 0;
+  }
+
+  return full ? aux_selstore(L, S, start, depth) : 1;
+}
+
+/* Decodes the matched fragment into the result of each matching path */
+static int
+aux_selstore(lua_State *L, jsel_s *S, const char *start, int depth) {
+  stack_s stack = { 0, LUA_MINSTACK };
+  cJSON *json = cJSON_ParseWithLength(start, S->p - start);
+  int p;
+
+  if (json == NULL) {
+    S->X.err    = "invalid value";
+    S->X.errpos = start - S->s;
+    return 0;
+  }
+  luaL_checkstack(L, 4, "Cannot allocate space for Lua stack");
+  stack.used = lua_gettop(L);
+  aux_decode(L, json, &stack, &S->K);
+
+  for (p = 0; p < S->npat; p++)
+    if (S->pat[p].lvl == depth && S->pat[p].nseg == depth) {
+      lua_rawgeti(L, S->paths, p+1);
+      if (S->pat[p].wild) {
+        lua_rawget(L, S->res);
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, -2, wLua_rawlen(L, -2) + 1);
+        lua_pop(L, 1);
+      } else {
+        lua_pushvalue(L, -2);
+        lua_rawset(L, S->res);
+      }
+    }
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* Skips a value by bracket and quote balancing */
+static int
+aux_selskip(jsel_s *S) {
+  const char *p = S->p, *e = S->e;
+  int depth = 0;
+
+  do {
+    if (p == e) aux_selfail(S, "unexpected end of input");
+    switch (*p) {
+      case '"':
+        if ((p = aux_strend(p+1, e)) == NULL) aux_selfail(S, "unterminated string");
+        p++;
+        break;
+      case '{':
+      case '[':
+        depth++;
+        p++;
+        break;
+      case '}':
+      case ']':
+        if (--depth < 0) aux_selfail(S, "unexpected character");
+        p++;
+        break;
+      default:
+        if (depth > 0) { p++; break; }
+        while (p < e && !aux_isspace(*p) && *p != ',' && *p != '}' && *p != ']')
+          p++;
+        if (p == S->p) aux_selfail(S, "unexpected character");
+    }
+  } while (depth > 0);
+
+  S->p = p;
+  return 1;
+}
+
+/* Closing quote of a string starting at `p` or NULL */
+static const char
+*aux_strend(const char *p, const char *e) {
+  const char *q, *b;
+  while ((q = memchr(p, '"', e - p)) != NULL) {
+    for (b = q; b > p && b[-1] == '\\'; b--);
+    if (((q - b) & 1) == 0) return q;
+    p = q + 1;
+  }
+  return NULL;
+}
+
+/* Compares the segment `d` of path, unescaping ~0 and ~1, with a key */
+static int
+aux_selmatch(jpat_s *P, int d, const char *key, size_t klen) {
+  const char *s = P->path + P->seg[d],
+             *e = P->path + P->seg[d+1] - 1;
+  if (e - s == 1 && *s == '*') return 1;
+  for (; s < e; s++, key++, klen--) {
+    if (klen == 0) return 0;
+    if (*s == '~' && s+1 < e && (s[1] == '0' || s[1] == '1')) {
+      if (*key != (*++s == '0' ? '~' : '/')) return 0;
+    } else if (*s != *key) {
+      return 0;
+    }
+  }
+  return klen == 0;
+}
+
+
+/* ---- Stream lexer ---- */
+
+/*
+ * Tokenizes JSON arriving in chunks. Each call consumes input from `*p`
+ * until a token is complete. Tokens crossing the chunk end are kept
+ * on X->tok and completed on next calls, so the caller may discard the
+ * chunk after JTK_MORE is returned. With `eof` the lexer knows that no
+ * more input will come.
+ */
+static int
+aux_lex(jlex_s *X, const char **pp, const char *end, int eof) {
+  const char *p = *pp, *s = p;
+  int tk;
+  size_t n;
+
+  if (X->err != NULL) return JTK_ERROR;
+
+  switch (X->partial) {
+    case JPT_STR: goto string;
+    case JPT_NUM: goto number;
+    case JPT_LIT: goto literal;
+  }
+
+  space:
+    while (p < end && aux_isspace(*p)) p++;
+    if (p == end) {
+      if (!eof) { tk = JTK_MORE; goto done; }
+      if (X->expect == JEX_END
+      || (X->multi && X->expect == JEX_VALUE && wArr_len(X->nest) == 0)) {
+        tk = JTK_END;
+        goto done;
+      }
+      X->err = "unexpected end of input";
+      goto error;
+    }
+
+    s = p;
+    n = wArr_len(X->nest);
+    switch (*p) {
+      case '{':
+      case '[':
+        if (!aux_canvalue(X)) goto unexpected;
+        if (!wArr_push(X->nest, *p)) goto nomem;
+        X->expect = *p == '{' ? JEX_FIRSTKEY : JEX_FIRSTVALUE;
+        tk        = *p == '{' ? JTK_OBJ      : JTK_ARR;
+        p++;
+        goto done;
+
+      case '}':
+        if (n == 0 || X->nest[n-1] != '{'
+        || (X->expect != JEX_NEXT && X->expect != JEX_FIRSTKEY))
+          goto unexpected;
+        tk = JTK_ENDOBJ;
+        goto close;
+
+      case ']':
+        if (n == 0 || X->nest[n-1] != '['
+        || (X->expect != JEX_NEXT && X->expect != JEX_FIRSTVALUE))
+          goto unexpected;
+        tk = JTK_ENDARR;
+        goto close;
+
+      case ':':
+        if (X->expect != JEX_COLON) goto unexpected;
+        X->expect = JEX_VALUE;
+        p++;
+        goto space;
+
+      case ',':
+        if (X->expect != JEX_NEXT) goto unexpected;
+        X->expect = X->nest[n-1] == '{' ? JEX_KEY : JEX_VALUE;
+        p++;
+        goto space;
+
+      case '"':
+        if (X->expect == JEX_FIRSTKEY || X->expect == JEX_KEY)
+          X->iskey = 1;
+        else if (aux_canvalue(X))
+          X->iskey = 0;
+        else
+          goto unexpected;
+        X->esc = 0;
+        s = ++p;
+        goto string;
+
+      default:
+        if (!aux_canvalue(X)) goto unexpected;
+        if (aux_isnumc(*p)) goto number;
+        if (aux_islitc(*p)) goto literal;
+        goto unexpected;
+    }
+
+  close:
+    wArr_pop(X->nest, 0);
+    X->expect = wArr_len(X->nest) ? JEX_NEXT : JEX_END;
+    p++;
+    goto done;
+
+  string:
+    for (; p < end; p++) {
+      if (X->esc)         X->esc = 0;
+      else if (*p == '\\') X->esc = 1;
+      else if (*p == '"')  break;
+    }
+    if (p == end) {
+      if (eof) { X->err = "unterminated string"; goto error; }
+      X->partial = JPT_STR;
+      goto more;
+    }
+    X->partial = JPT_NONE;
+    if (!aux_lextoken(X, s, p++)) goto nomem;
+    if (!aux_unescape(X)) goto error;
+    if (X->iskey) {
+      X->expect = JEX_COLON;
+      tk = JTK_KEY;
+    } else {
+      X->expect = wArr_len(X->nest) ? JEX_NEXT : JEX_END;
+      tk = JTK_STR;
+    }
+    goto done;
+
+  number:
+    while (p < end && aux_isnumc(*p)) p++;
+    if (p == end && !eof) {
+      X->partial = JPT_NUM;
+      goto more;
+    }
+    X->partial = JPT_NONE;
+    if (p < end && !aux_isdelim(*p)) goto unexpected;
+    if (!aux_lextoken(X, s, p)) goto nomem;
+    if (!aux_isnumber(X->val, X->vlen)) {
+      X->err = "invalid number";
+      goto error;
+    }
+    X->expect = wArr_len(X->nest) ? JEX_NEXT : JEX_END;
+    tk = JTK_NUM;
+    goto done;
+
+  literal:
+    while (p < end && aux_islitc(*p)) p++;
+    if (p == end && !eof) {
+      X->partial = JPT_LIT;
+      goto more;
+    }
+    X->partial = JPT_NONE;
+    if (p < end && !aux_isdelim(*p)) goto unexpected;
+    if (!aux_lextoken(X, s, p)) goto nomem;
+    if      (X->vlen == 4 && memcmp(X->val, "true",  4) == 0) tk = JTK_TRUE;
+    else if (X->vlen == 5 && memcmp(X->val, "false", 5) == 0) tk = JTK_FALSE;
+    else if (X->vlen == 4 && memcmp(X->val, "null",  4) == 0) tk = JTK_NULL;
+    else {
+      X->err = "invalid literal";
+      goto error;
+    }
+    X->expect = wArr_len(X->nest) ? JEX_NEXT : JEX_END;
+    goto done;
+
+  more:
+    if (!waxJson_append(&X->tok, s, p - s)) goto nomem;
+    tk = JTK_MORE;
+    goto done;
+
+  unexpected:
+    X->err = "unexpected character";
+    goto error;
+
+  nomem:
+    X->err = strerror(errno);
+
+  error:
+    X->errpos = X->pos + (p - *pp);
+    tk = JTK_ERROR;
+
+  done:
+    X->pos += p - *pp;
+    *pp = p;
+    return tk;
+}
+
+static int
+aux_lexinit(jlex_s *X, int multi) {
+  X->nest    = wArr_new(*X->nest, 16);
+  X->tok     = wArr_new(*X->tok, 64);
+  X->str     = wArr_new(*X->str, 64);
+  X->val     = NULL;
+  X->vlen    = 0;
+  X->pos     = 0;
+  X->err     = NULL;
+  X->errpos  = 0;
+  X->expect  = JEX_VALUE;
+  X->partial = JPT_NONE;
+  X->esc     = 0;
+  X->iskey   = 0;
+  X->multi   = multi;
+  if (X->nest == NULL || X->tok == NULL || X->str == NULL) {
+    aux_lexfree(X);
+    return 0;
+  }
+  return 1;
+}
+
+static void
+aux_lexfree(jlex_s *X) {
+  wArr_free(X->nest);
+  wArr_free(X->tok);
+  wArr_free(X->str);
+}
+
+/* Pushes nil and the syntax error message */
+static int
+aux_lexerror(lua_State *L, jlex_s *X) {
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s at offset %lu", X->err,
+           (unsigned long) X->errpos);
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+/* Token from `s` to `e`, joined to the bytes of previous chunks if any */
+static int
+aux_lextoken(jlex_s *X, const char *s, const char *e) {
+  if (wArr_len(X->tok) == 0) {
+    X->val  = s;
+    X->vlen = e - s;
+    return 1;
+  }
+  if (!waxJson_append(&X->tok, s, e - s)) return 0;
+  X->val  = X->tok;
+  X->vlen = wArr_len(X->tok);
+  wArr_clear(X->tok);
+  return 1;
+}
+
+int
+waxJson_append(char **arr, const char *s, size_t len) {
+  if (wArr_len(*arr) + len > wArr_cap(*arr) && !wArr_capsz(*arr, len))
+    return 0;
+  memcpy(*arr + wArr_len(*arr), s, len);
+  _wArr_len(*arr) += len;
+  return 1;
+}
+
+static int
+aux_hex4(const unsigned char *s) {
+  int i, c, r = 0;
+  for (i = 0; i < 4; i++) {
+    c = s[i];
+    if      (c >= '0' && c <= '9') c -= '0';
+    else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+    else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+    else return -1;
+    r = r << 4 | c;
+  }
+  return r;
+}
+
+/*
+ * Replaces X->val by its unescaped contents. The unescaped string is
+ * never longer than the escaped one.
+ */
+static int
+aux_unescape(jlex_s *X) {
+  const unsigned char *s = (const unsigned char *) X->val,
+                      *e = s + X->vlen;
+  unsigned char *o;
+  long cp, lo;
+  int esc = 0;
+
+  for (; s < e; s++) {
+    if (*s < 0x20) { X->err = "control character in string"; return 0; }
+    if (*s == '\\') esc = 1;
+  }
+  if (!esc) return 1;
+
+  s = (const unsigned char *) X->val;
+  wArr_clear(X->str);
+  if (X->vlen > wArr_cap(X->str) && !wArr_capsz(X->str, X->vlen)) {
+    X->err = strerror(errno);
+    return 0;
+  }
+  o = (unsigned char *) X->str;
+
+  while (s < e) {
+    if (*s != '\\') { *o++ = *s++; continue; }
+    switch (s[1]) {
+      case '"':
+      case '\\':
+      case '/': *o++ = s[1];  break;
+      case 'b': *o++ = '\b';  break;
+      case 'f': *o++ = '\f';  break;
+      case 'n': *o++ = '\n';  break;
+      case 'r': *o++ = '\r';  break;
+      case 't': *o++ = '\t';  break;
+      case 'u':
+        if (e - s < 6 || (cp = aux_hex4(s+2)) < 0) goto invalid;
+        if (cp >= 0xDC00 && cp <= 0xDFFF) goto invalid;
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+          if (e - s < 12 || s[6] != '\\' || s[7] != 'u'
+          || (lo = aux_hex4(s+8)) < 0xDC00 || lo > 0xDFFF) goto invalid;
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+          s += 6;
+        }
+        if (cp < 0x80) {
+          *o++ = cp;
+        } else if (cp < 0x800) {
+          *o++ = 0xC0 | (cp >> 6);
+          *o++ = 0x80 | (cp & 0x3F);
+        } else if (cp < 0x10000) {
+          *o++ = 0xE0 | (cp >> 12);
+          *o++ = 0x80 | ((cp >> 6) & 0x3F);
+          *o++ = 0x80 | (cp & 0x3F);
+        } else {
+          *o++ = 0xF0 | (cp >> 18);
+          *o++ = 0x80 | ((cp >> 12) & 0x3F);
+          *o++ = 0x80 | ((cp >> 6) & 0x3F);
+          *o++ = 0x80 | (cp & 0x3F);
+        }
+        s += 4;
+        break;
+      default:
+        goto invalid;
+    }
+    s += 2;
+  }
+  X->val  = X->str;
+  X->vlen = (char *) o - X->str;
+  return 1;
+
+  invalid:
+    X->err = "invalid escape sequence";
+    return 0;
+}
+
+/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+static int
+aux_isnumber(const char *s, size_t len) {
+  const char *e = s + len;
+  if (s < e && *s == '-') s++;
+  if (s == e) return 0;
+  if (*s == '0') s++;
+  else if (*s >= '1' && *s <= '9') while (s < e && *s >= '0' && *s <= '9') s++;
+  else return 0;
+  if (s < e && *s == '.') {
+    if (++s == e || *s < '0' || *s > '9') return 0;
+    while (s < e && *s >= '0' && *s <= '9') s++;
+  }
+  if (s < e && (*s == 'e' || *s == 'E')) {
+    if (++s < e && (*s == '+' || *s == '-')) s++;
+    if (s == e || *s < '0' || *s > '9') return 0;
+    while (s < e && *s >= '0' && *s <= '9') s++;
+  }
+  return s == e;
+}
+
+
+/* ---- Validation ---- */
+
+Lua
+wax_json_valid(lua_State *L) {
+  size_t len;
+  const unsigned char *s = (const unsigned char *) luaL_checklstring(L, 1, &len),
+                      *at;
+  const char *err = aux_valid(s, s + len, &at);
+
+  if (err == NULL) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  waxJson_binerror(L, err, (size_t) (at - s));
+  lua_pushinteger(L, (lua_Integer) (at - s));
+  return 3;
+}
+
+/* Words of 8 bytes with a byte that stops the string scanning: '"',
+   '\', a control or a non ASCII one */
+#define VALID_ONES 0x0101010101010101ULL
+#define VALID_HIGH 0x8080808080808080ULL
+#define aux_haszero(w) (((w) - VALID_ONES) & ~(w) & VALID_HIGH)
+#define aux_strstop(w) (aux_haszero((w) ^ (VALID_ONES * '"'))  \
+                     | aux_haszero((w) ^ (VALID_ONES * '\\')) \
+                     | (((w) - VALID_ONES * 0x20) & ~(w) & VALID_HIGH) \
+                     | ((w) & VALID_HIGH))
+
+/*
+ * Checks the JSON syntax and the UTF-8 of the strings in one pass,
+ * without allocations: the kind of each open container is a bit on the
+ * C stack. Returns NULL when valid or the error message, with its
+ * position on `at`.
+ */
+static const char
+*aux_valid(const unsigned char *s, const unsigned char *e,
+           const unsigned char **at) {
+  unsigned char nest[VALID_DEPTH / 8];    /* bit set for objects */
+  const unsigned char *p = s, *lit;
+  unsigned long long w;
+  const char *err;
+  long cp;
+  int depth = 0, iskey = 0, n;
+
+  value:
+    while (p < e && aux_isspace(*p)) p++;
+    if (p == e) goto end;
+    switch (*p) {
+      case '{':
+      case '[':
+        if (depth == VALID_DEPTH) {
+          err = "too many nesting levels";
+          goto fail;
+        }
+        if (*p == '{') nest[depth / 8] |=  (1 << depth % 8);
+        else           nest[depth / 8] &= ~(1 << depth % 8);
+        depth++;
+        iskey = *p++ == '{';
+        while (p < e && aux_isspace(*p)) p++;
+        if (p < e && *p == (iskey ? '}' : ']')) goto close;
+        if (!iskey) goto value;
+        goto key;
+
+      case '"':
+        iskey = 0;
+        goto string;
+
+      case 't': lit = (const unsigned char *) "true";  goto literal;
+      case 'f': lit = (const unsigned char *) "false"; goto literal;
+      case 'n': lit = (const unsigned char *) "null";  goto literal;
+
+      default:
+        if (!aux_isnumc(*p)) goto unexpected;
+        for (s = p; p < e && aux_isnumc(*p); p++);
+        if (!aux_isnumber((const char *) s, p - s)) {
+          err = "invalid number";
+          p   = s;
+          goto fail;
+        }
+        goto next;
+    }
+
+  literal:
+    for (s = p; *lit && p < e && *p == *lit; p++, lit++);
+    if (*lit || (p < e && aux_islitc(*p))) {
+      err = "invalid literal";
+      p   = s;
+      goto fail;
+    }
+    goto next;
+
+  key:
+    while (p < e && aux_isspace(*p)) p++;
+    if (p == e) goto end;
+    if (*p != '"') goto unexpected;
+    iskey = 1;
+
+  string:
+    s = p++;
+    for (;;) {
+      while (e - p >= 8) {
+        memcpy(&w, p, sizeof(w));
+        if (aux_strstop(w)) break;
+        p += 8;
+      }
+      if (p == e) {
+        err = "unterminated string";
+        p   = s;
+        goto fail;
+      }
+      if (*p == '"') break;
+      if (*p == '\\') {
+        if (e - p < 2) {
+          p = e;
+          continue;
+        }
+        switch (p[1]) {
+          case '"': case '\\': case '/':
+          case 'b': case 'f': case 'n': case 'r': case 't':
+            p += 2;
+            continue;
+          case 'u':
+            if (e - p < 6 || (cp = aux_hex4(p+2)) < 0
+            || (cp >= 0xDC00 && cp <= 0xDFFF)) goto escape;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+              if (e - p < 12 || p[6] != '\\' || p[7] != 'u'
+              || (cp = aux_hex4(p+8)) < 0xDC00 || cp > 0xDFFF) goto escape;
+              p += 6;
+            }
+            p += 6;
+            continue;
+        }
+        goto escape;
+      }
+      if (*p < 0x20) {
+        err = "control character in string";
+        goto fail;
+      }
+      if (*p < 0x80) {
+        p++;
+        continue;
+      }
+      if ((n = aux_utf8len(p, e)) == 0) {
+        err = "invalid UTF-8";
+        goto fail;
+      }
+      p += n;
+    }
+    p++;
+    if (!iskey) goto next;
+    while (p < e && aux_isspace(*p)) p++;
+    if (p == e) goto end;
+    if (*p != ':') goto unexpected;
+    p++;
+    goto value;
+
+  next:
+    while (p < e && aux_isspace(*p)) p++;
+    if (depth == 0) {
+      if (p == e) return NULL;
+      goto unexpected;
+    }
+    if (p == e) goto end;
+    iskey = nest[(depth-1) / 8] & (1 << (depth-1) % 8);
+    if (*p == ',') {
+      p++;
+      if (iskey) goto key;
+      goto value;
+    }
+    if (*p != (iskey ? '}' : ']')) goto unexpected;
+
+  close:
+    depth--;
+    p++;
+    goto next;
+
+  escape:
+    err = "invalid escape sequence";
+    goto fail;
+
+  end:
+    err = "unexpected end of input";
+    goto fail;
+
+  unexpected:
+    err = "unexpected character";
+
+  fail:
+    *at = p;
+    return err;
+}
+
+/* Length of the UTF-8 sequence at s, 0 if it is not well formed (as
+   RFC 3629: no overlong forms, surrogates or code points after U+10FFFF) */
+static int
+aux_utf8len(const unsigned char *s, const unsigned char *e) {
+  int c = *s, n, i;
+
+  if (c < 0x80) return 1;
+  if (c < 0xc2 || c > 0xf4) return 0;
+  n = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+  if (e - s < n) return 0;
+  if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] > 0x9f)
+      || (c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] > 0x8f))
+    return 0;
+  for (i = 1; i < n; i++)
+    if ((s[i] & 0xc0) != 0x80) return 0;
+  return n;
+}
+
+/* Strings are checked 8 bytes at a time while they are ASCII */
+int
+waxJson_isutf8(const unsigned char *s, size_t len) {
+  const unsigned char *e = s + len;
+  unsigned long long w;
+  int n;
+
+  while (s < e) {
+    if (e - s >= 8) {
+      memcpy(&w, s, sizeof(w));
+      if (!(w & VALID_HIGH)) {
+        s += 8;
+        continue;
+      }
+    }
+    if ((n = aux_utf8len(s, e)) == 0) return 0;
+    s += n;
+  }
+  return 1;
+}
+
+/* Pushes nil and the message with the input offset */
+int
+waxJson_binerror(lua_State *L, const char *err, size_t pos) {
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s at offset %lu", err, (unsigned long) pos);
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+
+/* ---- Stream writers ---- */
+
+Lua
+wax_json_encoder(lua_State *L) {
+  return waxJson_wnew(L, UD_ENCODER) != NULL ? 1 : 2;
+}
+
+/*
+ * Writes a value: on top level followed by a new line, so many values
+ * make JSON Lines, inside an array as its next item and inside an object
+ * as the value of the key given before it.
+ */
+Lua
+wax_json_enitem(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_ENCODER);
+  stack_s stack = { 0, LUA_MINSTACK };
+
+  wLua_assert(L, W->open, "closed encoder");
+  lua_settop(L, 3);
+  W->B.len = W->mark;
+  if (!aux_enkey(L, W)) return lua_error(L);
+  stack.used = lua_gettop(L);
+  if (!aux_jsonval(L, &W->B, &stack, 0)
+      || (wArr_len(W->nest) == 0 && !waxJson_putbe(&W->B, '\n', 0, 0)))
+    return lua_error(L);
+  waxJson_witem(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+Lua
+wax_json_enarray(lua_State *L) {
+  return aux_enbegin(L, luaL_checkudata(L, 1, UD_ENCODER), '[');
+}
+
+Lua
+wax_json_enobject(lua_State *L) {
+  return aux_enbegin(L, luaL_checkudata(L, 1, UD_ENCODER), '{');
+}
+
+/* Inside objects the key is the second argument */
+static int
+aux_enbegin(lua_State *L, waxJsonWriter *W, int kind) {
+  wLua_assert(L, W->open, "closed encoder");
+  lua_settop(L, 2);
+  W->B.len = W->mark;
+  if (!aux_enkey(L, W)) return lua_error(L);
+  if (!waxJson_putbe(&W->B, (unsigned) kind, 0, 0)
+      || !wArr_capsz(W->nest, 1) || !wArr_capsz(W->cnt, 1))
+    return luaL_error(L, "not enough memory");
+  waxJson_witem(L, W);
+  wArr_push(W->nest, (char) kind);
+  wArr_push(W->cnt, 0);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Writes the comma before the item and, inside objects, the key at index
+   2, leaving the value on top. On error pushes the message. */
+static int
+aux_enkey(lua_State *L, waxJsonWriter *W) {
+  int n = wArr_len(W->nest);
+  const char *key;
+  size_t len;
+
+  if (n > 0 && W->cnt[n-1] > 0 && !waxJson_putbe(&W->B, ',', 0, 0)) goto nomem;
+  if (n == 0 || W->nest[n-1] == '[') {
+    lua_settop(L, 2);
+    return 1;
+  }
+  if (lua_type(L, 2) != LUA_TSTRING) {
+    lua_pushstring(L, "No string key found on table");
+    return 0;
+  }
+  key = lua_tolstring(L, 2, &len);
+  if (!aux_jsonstr(&W->B, key, len) || !waxJson_putbe(&W->B, ':', 0, 0))
+    goto nomem;
+  return 1;
+
+  nomem:
+    lua_pushstring(L, "not enough memory");
+    return 0;
+}
+
+Lua
+wax_json_enfinish(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_ENCODER);
+  int n;
+
+  wLua_assert(L, W->open, "closed encoder");
+  n = wArr_len(W->nest);
+  wLua_assert(L, n > 0, "no open array or object to finish");
+  W->B.len = W->mark;
+  if (!waxJson_putbe(&W->B, W->nest[n-1] == '[' ? ']' : '}', 0, 0)
+      || (n == 1 && !waxJson_putbe(&W->B, '\n', 0, 0)))
+    return luaL_error(L, "not enough memory");
+  wArr_pop(W->nest, 0);
+  wArr_pop(W->cnt, 0);
+  W->mark = W->B.len;
+  if (W->mark >= W->flush) waxJson_wsink(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+Lua
+wax_json_enflush(lua_State *L) {
+  waxJsonWriter *W = luaL_checkudata(L, 1, UD_ENCODER);
+  wLua_assert(L, W->open, "closed encoder");
+  waxJson_wsink(L, W);
+  lua_settop(L, 1);
+  return 1;
+}
+
+Lua
+wax_json_enclose(lua_State *L) {
+  return waxJson_wclose(L, luaL_checkudata(L, 1, UD_ENCODER), wax_json_enfinish);
+}
+
+Lua
+wax_json_enfree(lua_State *L) {
+  waxJson_wgc(L, luaL_checkudata(L, 1, UD_ENCODER));
+  return 0;
+}
+
+
+/* Same rules and output of json.encode, written straight to the buffer
+   without building cJSON nodes. On error pushes the message and returns
+   0. */
+static int
+aux_jsonval(lua_State *L, jbuf_s *B, stack_s *S, int depth) {
+  const char *str;
+  size_t len;
+  int ok;
+
+  switch (lua_type(L, -1)) {
+    case LUA_TTABLE:
+      if (depth >= PACK_DEPTH) {
+        lua_pushstring(L, "Too many nesting levels");
+        return 0;
+      }
+      return aux_jsontable(L, B, S, depth+1);
+
+    case LUA_TNUMBER:
+      ok = aux_jsonnum(L, B);
+      break;
+
+    case LUA_TSTRING:
+      str = lua_tolstring(L, -1, &len);
+      ok  = aux_jsonstr(B, str, len);
+      break;
+
+    case LUA_TBOOLEAN:
+      ok = lua_toboolean(L, -1) ? aux_bufput(B, "true", 4)
+                                : aux_bufput(B, "false", 5);
+      break;
+
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, -1) == &waxJsonNull) {
+        ok = aux_bufput(B, "null", 4);
+        break;
+      }
+      lua_pushstring(L, "Invalid lightuserdata found");
+      return 0;
+
+    default:
+      lua_pushstring(L, "Invalid table values");
+      return 0;
+  }
+
+  if (!ok) lua_pushstring(L, "not enough memory");
+  return ok;
+}
+
+static int
+aux_jsontable(lua_State *L, jbuf_s *B, stack_s *S, int depth) {
+  int    i, len, idx = lua_gettop(L);
+  size_t klen;
+  const char *key;
+
+  waxJson_luastack_alloc(L, S, 2);
+  if ((len = wLua_rawlen(L, idx)) > 0) {
+    for (i = 1; i <= len; i++) {
+      if (!waxJson_putbe(B, i == 1 ? '[' : ',', 0, 0)) goto nomem;
+      lua_rawgeti(L, idx, i);
+      if (!aux_jsonval(L, B, S, depth)) return 0;
+      lua_pop(L, 1);
+    }
+    if (!waxJson_putbe(B, ']', 0, 0)) goto nomem;
+  } else if (B->canon) {
+    if (!aux_jsonsorted(L, B, S, depth)) return 0;
+  } else {
+    if (!waxJson_putbe(B, '{', 0, 0)) goto nomem;
+    for (i = 0, lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1), i++) {
+      if (lua_type(L, -2) != LUA_TSTRING) {
+        lua_pushstring(L, "No string key found on table");
+        return 0;
+      }
+      key = lua_tolstring(L, -2, &klen);
+      if ((i > 0 && !waxJson_putbe(B, ',', 0, 0))
+          || !aux_jsonstr(B, key, klen) || !waxJson_putbe(B, ':', 0, 0))
+        goto nomem;
+      if (!aux_jsonval(L, B, S, depth)) return 0;
+    }
+    if (!waxJson_putbe(B, '}', 0, 0)) goto nomem;
+  }
+  waxJson_luastack_alloc(L, S, -2);
+  return 1;
+
+  nomem:
+    lua_pushstring(L, "not enough memory");
+    return 0;
+}
+
+/* As cJSON print_number: non finite numbers are null */
+static int
+aux_jsonnum(lua_State *L, jbuf_s *B) {
+  char num[WNUM_BUFSZ];
+  double d;
+
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, -1))
+    return aux_bufput(B, num, wNum_itoa((long long) lua_tointeger(L, -1), num));
+#endif
+  d = (double) lua_tonumber(L, -1);
+  if (d != d || d - d != 0) return aux_bufput(B, "null", 4);
+  if (d >= INT_MIN && d <= INT_MAX && d == (double) (int) d)
+    return aux_bufput(B, num, wNum_itoa((int) d, num));
+  return aux_bufput(B, num, wNum_dtoa(d, num));
+}
+
+/* Escapes '"', '\' and control characters, as cJSON. Runs of bytes
+   without escapes are copied at once. */
+static int
+aux_jsonstr(jbuf_s *B, const char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *) s, *e = p + len, *run;
+  char *o;
+  int c;
+
+  if (!aux_bufneed(B, len + 2)) return 0;
+  B->b[B->len++] = '"';
+  while (p < e) {
+    for (run = p; p < e && *p >= 0x20 && *p != '"' && *p != '\\'; p++);
+    if (p > run && !aux_bufput(B, (const char *) run, (size_t) (p - run)))
+      return 0;
+    if (p == e) break;
+    if (!aux_bufneed(B, 6)) return 0;
+    o = B->b + B->len;
+    *o++ = '\\';
+    switch (c = *p++) {
+      case '"':  *o++ = '"';  break;
+      case '\\': *o++ = '\\'; break;
+      case '\b': *o++ = 'b';  break;
+      case '\f': *o++ = 'f';  break;
+      case '\n': *o++ = 'n';  break;
+      case '\r': *o++ = 'r';  break;
+      case '\t': *o++ = 't';  break;
+      default:
+        *o++ = 'u';
+        *o++ = '0';
+        *o++ = '0';
+        *o++ = hex[c >> 4];
+        *o++ = hex[c & 15];
+    }
+    B->len = (size_t) (o - B->b);
+  }
+  return waxJson_putbe(B, '"', 0, 0);
+}
+
+/* Writes the byte `tag` followed by the n lower bytes of v, big endian */
+int
+waxJson_putbe(jbuf_s *B, unsigned tag, unsigned long long v, int n) {
+  char *p;
+
+  if (!aux_bufneed(B, (size_t) n + 1)) return 0;
+  p = B->b + B->len;
+  B->len += n + 1;
+  *p++ = (char) tag;
+  while (n--) *p++ = (char) (v >> (8 * n));
+  return 1;
+}
+
+/* Grows the buffer in place when it is the last arena allocation */
+int
+waxJson_bufgrow(jbuf_s *B, size_t n) {
+  jarena_s *A   = aux_arena;
+  size_t    cap = B->cap ? B->cap : 256;
+  char     *b;
+
+  while (cap < B->len + n) cap *= 2;
+  if (B->heap) {
+    if ((b = realloc(B->b, cap)) == NULL) return 0;
+    B->b   = b;
+    B->cap = cap;
+    return 1;
+  }
+  if (A != NULL && B->b != NULL && B->b + B->cap == A->p
+      && (size_t) (A->end - B->b) >= cap) {
+    A->p   = B->b + cap;
+    B->cap = cap;
+    return 1;
+  }
+  if ((b = aux_arenalloc(cap)) == NULL) return 0;
+  if (B->len) memcpy(b, B->b, B->len);
+  B->b   = b;
+  B->cap = cap;
+  return 1;
+}
+
+static int
+aux_bufput(jbuf_s *B, const char *s, size_t len) {
+  if (!aux_bufneed(B, len)) return 0;
+  memcpy(B->b + B->len, s, len);
+  B->len += len;
+  return 1;
+}
+
+
+/*
+ * Creates the writer of the module function at the top of the call. The
+ * sink at index 1 is a function, a file handler, a file descriptor or a
+ * path, opened for writing. The options at index 2 can set the `buffer`
+ * size. If the path can't be opened pushes nil and the message and
+ * returns NULL.
+ */
+waxJsonWriter
+*waxJson_wnew(lua_State *L, const char *mt) {
+  waxJsonWriter *W;
+  int type = lua_type(L, 1), fd = -1;
+  lua_Integer size = WRITER_FLUSH;
+
+  luaL_argcheck(L, type == LUA_TFUNCTION || type == LUA_TUSERDATA
+                || type == LUA_TTABLE || type == LUA_TNUMBER
+                || type == LUA_TSTRING, 1,
+                "function, file, file descriptor or path expected");
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "buffer");
+    size = luaL_optinteger(L, -1, WRITER_FLUSH);
+    luaL_argcheck(L, size > 0, 2, "buffer size must be positive");
+    lua_pop(L, 1);
+  }
+  if (type == LUA_TSTRING
+      && (fd = open(lua_tostring(L, 1), O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return NULL;
+  }
+
+  W = lua_newuserdata(L, sizeof(*W));
+  memset(W, 0, sizeof(*W));
+  W->B.heap  = 1;
+  W->flush   = (size_t) size;
+  W->sinkref = LUA_NOREF;
+  W->fd      = fd;
+  W->open    = 1;
+  luaL_getmetatable(L, mt);
+  lua_setmetatable(L, -2);
+
+  W->nest = wArr_new(*W->nest, 8);
+  W->cnt  = wArr_new(*W->cnt, 8);
+  wLua_assert(L, W->nest != NULL && W->cnt != NULL, strerror(errno));
+  if (fd >= 0) {
+    lua_pushinteger(L, fd);
+  } else {
+    lua_pushvalue(L, 1);
+  }
+  W->sinkref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return W;
+}
+
+/* Finishes the open items with fn, flushes and releases the writer */
+int
+waxJson_wclose(lua_State *L, waxJsonWriter *W, lua_CFunction fn) {
+  if (!W->open) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_settop(L, 1);
+  while (wArr_len(W->nest) > 0) fn(L);
+  waxJson_wsink(L, W);
+  aux_wfree(L, W);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static void
+aux_wfree(lua_State *L, waxJsonWriter *W) {
+  if (!W->open) return;
+  free(W->B.b);
+  wArr_free(W->nest);
+  wArr_free(W->cnt);
+  luaL_unref(L, LUA_REGISTRYINDEX, W->sinkref);
+  if (W->fd >= 0) close(W->fd);
+  W->open = 0;
+}
+
+/*
+ * Collection of an open writer flushes the committed output to file
+ * descriptors and paths, as Lua files do, ignoring write errors. Function
+ * and file handler sinks can't be called from __gc and lose it.
+ */
+void
+waxJson_wgc(lua_State *L, waxJsonWriter *W) {
+  if (!W->open) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, W->sinkref);
+  if (lua_type(L, -1) == LUA_TNUMBER) aux_wfd(W, (int) lua_tointeger(L, -1));
+  lua_pop(L, 1);
+  aux_wfree(L, W);
+}
+
+/* Counts the written item on its parent and commits it */
+int
+waxJson_witem(lua_State *L, waxJsonWriter *W) {
+  int n = wArr_len(W->cnt);
+
+  if (n > 0) W->cnt[n-1]++;
+  W->mark = W->B.len;
+  if (W->mark >= W->flush) waxJson_wsink(L, W);
+  return 1;
+}
+
+/* Writes the committed output to `fd`. On errors returns 0, keeping the
+   bytes not written for the next flush. */
+static int
+aux_wfd(waxJsonWriter *W, int fd) {
+  size_t len = W->mark, off = 0;
+  ssize_t n;
+
+  while (off < len) {
+    if ((n = write(fd, W->B.b + off, len - off)) >= 0) {
+      off += (size_t) n;
+      continue;
+    }
+    if (errno == EINTR) continue;
+    memmove(W->B.b, W->B.b + off, len - off);
+    W->B.len = W->mark = len - off;
+    return 0;
+  }
+  W->B.len = W->mark = 0;
+  return 1;
+}
+
+/* Sends the committed output to the sink. Bytes not accepted by a file
+   descriptor are kept for the next flush. */
+int
+waxJson_wsink(lua_State *L, waxJsonWriter *W) {
+  size_t len = W->mark;
+  int fd;
+
+  if (len == 0) return 1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, W->sinkref);
+  switch (lua_type(L, -1)) {
+    case LUA_TNUMBER:
+      fd = (int) lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      if (!aux_wfd(W, fd)) return luaL_error(L, "%s", strerror(errno));
+      return 1;
+
+    case LUA_TFUNCTION:
+      lua_pushlstring(L, W->B.b, len);
+      lua_call(L, 1, 0);
+      break;
+
+    default:
+      lua_getfield(L, -1, "write");
+      lua_insert(L, -2);
+      lua_pushlstring(L, W->B.b, len);
+      lua_call(L, 2, 2);
+      if (lua_isnil(L, -2))
+        return luaL_error(L, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1)
+                                                       : "cannot write");
+      lua_pop(L, 2);
+  }
+  W->B.len = W->mark = 0;
+  return 1;
+}
+
+
+
+/* ---- Compiled encoder ---- */
+
+/*
+ * Compiles the encoder of records with the keys in opts.fields, written
+ * in that order. opts.types can restrict the values of a field to a
+ * "string", "number", "integer" or "boolean", "any" is the default.
+ */
+Lua
+wax_json_compile_encoder(lua_State *L) {
+  static const char *const types[] = {
+    "any", "string", "number", "integer", "boolean", NULL
+  };
+  static const int ltypes[] = {
+    LUA_TNONE, LUA_TSTRING, LUA_TNUMBER, LUA_TNUMBER, LUA_TBOOLEAN
+  };
+  waxJsonShape *W;
+  jfield_s *f;
+  const char *key, *type;
+  size_t len;
+  int i, n, t;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "fields");
+  luaL_argcheck(L, lua_istable(L, 2), 1, "fields list expected");
+  lua_getfield(L, 1, "types");
+  luaL_argcheck(L, lua_isnil(L, 3) || lua_istable(L, 3), 1,
+                "types must be a table");
+  n = wLua_rawlen(L, 2);
+
+  W = lua_newuserdata(L, sizeof(*W) + (size_t) n * sizeof(jfield_s));
+  memset(W, 0, sizeof(*W));
+  W->f      = (jfield_s *) (W + 1);
+  W->keyref = LUA_NOREF;
+  W->B.heap = 1;
+  luaL_getmetatable(L, UD_SHAPE);
+  lua_setmetatable(L, -2);
+
+  /* names of the fields, the texts are built in the output buffer */
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+                  "field names must be strings");
+    key = lua_tolstring(L, -1, &len);
+    f = W->f + i;
+    f->off  = W->B.len;
+    f->type = LUA_TNONE;
+    if (!waxJson_putbe(&W->B, ',', 0, 0) || !aux_jsonstr(&W->B, key, len)
+        || !waxJson_putbe(&W->B, ':', 0, 0))
+      return luaL_error(L, "not enough memory");
+    f->len = W->B.len - f->off;
+    for (t = 0; t < i; t++)
+      if (W->f[t].len == f->len
+          && memcmp(W->B.b + W->f[t].off, W->B.b + f->off, f->len) == 0)
+        return luaL_error(L, "duplicated field '%s'", key);
+
+    if (!lua_isnil(L, 3)) {
+      lua_pushvalue(L, -1);
+      lua_rawget(L, 3);
+      type = lua_isnil(L, -1) ? "any" : lua_tostring(L, -1);
+      for (t = 0; types[t] != NULL; t++)
+        if (type != NULL && strcmp(type, types[t]) == 0) break;
+      if (types[t] == NULL)
+        return luaL_error(L, "invalid type of field '%s'", key);
+      f->type    = ltypes[t];
+      f->integer = t == 3;
+      lua_pop(L, 1);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  W->keyref = luaL_ref(L, LUA_REGISTRYINDEX);
+  W->n      = n;
+  W->pre    = W->B.b;
+  W->B.b    = NULL;
+  W->B.len  = W->B.cap = 0;
+  return 1;
+}
+
+/* Encodes a record as a JSON object */
+Lua
+wax_json_shencode(lua_State *L) {
+  waxJsonShape *W = luaL_checkudata(L, 1, UD_SHAPE);
+  stack_s stack = { 0, LUA_MINSTACK };
+  int keys;
+
+  lua_settop(L, 2);
+  keys = aux_shkeys(L, W);
+  lua_pushvalue(L, 2);
+  stack.used = lua_gettop(L);
+  W->B.len = 0;
+  if (!aux_shrecord(L, W, keys, &stack)) return lua_error(L);
+  lua_pushlstring(L, W->B.b, W->B.len);
+  aux_shreset(W);
+  return 1;
+}
+
+/* Encodes a list of records as a JSON array */
+Lua
+wax_json_shlist(lua_State *L) {
+  waxJsonShape *W = luaL_checkudata(L, 1, UD_SHAPE);
+  stack_s stack = { 0, LUA_MINSTACK };
+  int i, len, keys;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  keys = aux_shkeys(L, W);
+  len  = wLua_rawlen(L, 2);
+  W->B.len = 0;
+  if (!waxJson_putbe(&W->B, '[', 0, 0)) return luaL_error(L, "not enough memory");
+  for (i = 1; i <= len; i++) {
+    if (i > 1 && !waxJson_putbe(&W->B, ',', 0, 0))
+      return luaL_error(L, "not enough memory");
+    lua_rawgeti(L, 2, i);
+    stack.used = lua_gettop(L);
+    if (!aux_shrecord(L, W, keys, &stack)) return lua_error(L);
+    lua_pop(L, 1);
+  }
+  if (!waxJson_putbe(&W->B, ']', 0, 0)) return luaL_error(L, "not enough memory");
+  lua_pushlstring(L, W->B.b, W->B.len);
+  aux_shreset(W);
+  return 1;
+}
+
+Lua
+wax_json_shfree(lua_State *L) {
+  waxJsonShape *W = luaL_checkudata(L, 1, UD_SHAPE);
+  free(W->B.b);
+  free(W->pre);
+  W->B.b   = W->pre = NULL;
+  W->B.cap = 0;
+  W->n     = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, W->keyref);
+  W->keyref = LUA_NOREF;
+  return 0;
+}
+
+/* Pushes the field names on the stack, returning the index of the first.
+   Values are then fetched with a pushvalue and a rawget. */
+static int
+aux_shkeys(lua_State *L, waxJsonShape *W) {
+  int i, base = lua_gettop(L) + 1;
+
+  if (!lua_checkstack(L, W->n + LUA_MINSTACK))
+    luaL_error(L, "Cannot allocate space for Lua stack");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, W->keyref);
+  for (i = 1; i <= W->n; i++) lua_rawgeti(L, base, i);
+  lua_remove(L, base);
+  return base;
+}
+
+/* Writes the record on top as an object, nil fields are left out. On
+   error pushes the message and returns 0. */
+static int
+aux_shrecord(lua_State *L, waxJsonShape *W, int keys, stack_s *S) {
+  char num[WNUM_BUFSZ];
+  jfield_s *f;
+  const char *str;
+  size_t len;
+  double d;
+  int i, t, ok, first = 1, rec = lua_gettop(L);
+
+  if (lua_type(L, rec) != LUA_TTABLE) {
+    lua_pushstring(L, "records must be tables");
+    return 0;
+  }
+  if (!waxJson_putbe(&W->B, '{', 0, 0)) goto nomem;
+  for (i = 0; i < W->n; i++) {
+    f = W->f + i;
+    lua_pushvalue(L, keys + i);
+    lua_rawget(L, rec);
+    if ((t = lua_type(L, -1)) == LUA_TNIL) {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (!aux_bufput(&W->B, W->pre + f->off + first, f->len - first))
+      goto nomem;
+    first = 0;
+
+    if (t != f->type) {
+      if (f->type != LUA_TNONE
+          && !(t == LUA_TLIGHTUSERDATA && lua_touserdata(L, -1) == &waxJsonNull)) {
+        lua_pushfstring(L, "field '%s' expected %s, got %s",
+                        lua_tostring(L, keys + i),
+                        f->integer ? "integer" : lua_typename(L, f->type),
+                        luaL_typename(L, -1));
+        return 0;
+      }
+      if (!aux_jsonval(L, &W->B, S, 0)) return 0;
+      lua_pop(L, 1);
+      continue;
+    }
+
+    switch (t) {
+      case LUA_TSTRING:
+        str = lua_tolstring(L, -1, &len);
+        ok  = aux_jsonstr(&W->B, str, len);
+        break;
+
+      case LUA_TNUMBER:
+        if (!f->integer) {
+          ok = aux_jsonnum(L, &W->B);
+          break;
+        }
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, -1)) {
+          ok = aux_bufput(&W->B, num,
+                          wNum_itoa((long long) lua_tointeger(L, -1), num));
+          break;
+        }
+#endif
+        d = (double) lua_tonumber(L, -1);
+        if (!(d >= -9007199254740992.0 && d <= 9007199254740992.0
+              && d == (double) (long long) d)) {
+          lua_pushfstring(L, "field '%s' expected integer, got number",
+                          lua_tostring(L, keys + i));
+          return 0;
+        }
+        ok = aux_bufput(&W->B, num, wNum_itoa((long long) d, num));
+        break;
+
+      default:
+        ok = lua_toboolean(L, -1) ? aux_bufput(&W->B, "true", 4)
+                                  : aux_bufput(&W->B, "false", 5);
+    }
+    if (!ok) goto nomem;
+    lua_pop(L, 1);
+  }
+  if (!waxJson_putbe(&W->B, '}', 0, 0)) goto nomem;
+  return 1;
+
+  nomem:
+    lua_pushstring(L, "not enough memory");
+    return 0;
+}
+
+/* Big outputs are not kept for the next call */
+static void
+aux_shreset(waxJsonShape *W) {
+  if (W->B.cap <= ARENA_KEEP) return;
+  free(W->B.b);
+  W->B.b   = NULL;
+  W->B.cap = 0;
+}
+
+
+
+/* ---- Canonical JSON ---- */
+
+/*
+ * Encodes as json.encode with the object keys sorted by their bytes, so
+ * equal values give equal text. With a true second argument also returns
+ * the XXH64 of the text, as 16 hex digits.
+ */
+Lua
+wax_json_canonical(lua_State *L) {
+  lua_settop(L, 2);
+  lua_pushboolean(L, lua_toboolean(L, 2));
+  lua_replace(L, 2);
+  return waxJson_inarena(L, aux_docanonical);
+}
+
+Lua
+aux_docanonical(lua_State *L) {
+  jbuf_s  B     = { NULL, 0, 0, 0, 0, 1 };
+  stack_s stack = { 0, LUA_MINSTACK };
+  char hex[17];
+  int hash = lua_toboolean(L, 2);
+
+  lua_settop(L, 1);
+  stack.used = 1;
+  if (!aux_jsonval(L, &B, &stack, 0)) lua_error(L);
+  lua_pushlstring(L, B.b, B.len);
+  if (!hash) return 1;
+  snprintf(hex, sizeof(hex), "%016llx",
+           aux_xxh64((const unsigned char *) B.b, B.len, 0));
+  lua_pushstring(L, hex);
+  return 2;
+}
+
+/* Writes the object at the top with its keys in order. The keys are
+   collected in the arena of the call and fetched again with rawget. */
+static int
+aux_jsonsorted(lua_State *L, jbuf_s *B, stack_s *S, int depth) {
+  int     idx = lua_gettop(L);
+  size_t  i, n = 0;
+  jsort_s *keys;
+
+  for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+    if (lua_type(L, -2) != LUA_TSTRING) {
+      lua_pushstring(L, "No string key found on table");
+      return 0;
+    }
+    n++;
+  }
+  if ((keys = aux_arenalloc(n * sizeof(*keys) + 1)) == NULL) goto nomem;
+  for (i = 0, lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1), i++)
+    keys[i].s = lua_tolstring(L, -2, &keys[i].len);
+  qsort(keys, n, sizeof(*keys), aux_sortcmp);
+
+  if (!waxJson_putbe(B, '{', 0, 0)) goto nomem;
+  for (i = 0; i < n; i++) {
+    if ((i > 0 && !waxJson_putbe(B, ',', 0, 0))
+        || !aux_jsonstr(B, keys[i].s, keys[i].len)
+        || !waxJson_putbe(B, ':', 0, 0))
+      goto nomem;
+    lua_pushlstring(L, keys[i].s, keys[i].len);
+    lua_rawget(L, idx);
+    if (!aux_jsonval(L, B, S, depth)) return 0;
+    lua_pop(L, 1);
+  }
+  if (!waxJson_putbe(B, '}', 0, 0)) goto nomem;
+  return 1;
+
+  nomem:
+    lua_pushstring(L, "not enough memory");
+    return 0;
+}
+
+static int
+aux_sortcmp(const void *a, const void *b) {
+  const jsort_s *x = a, *y = b;
+  int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
+  return c != 0 ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+/* XXH64 of Yann Collet, reading the input as little endian */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(acc,v) ((acc) += (v) * XXH_P2, \
+                          (acc) = XXH_ROTL((acc), 31), (acc) *= XXH_P1)
+
+static unsigned long long
+aux_xxhread(const unsigned char *p, int n) {
+  unsigned long long v = 0;
+  while (n-- > 0) v = (v << 8) | p[n];
+  return v;
+}
+
+static unsigned long long
+aux_xxh64(const unsigned char *p, size_t len, unsigned long long seed) {
+  const unsigned char *e = p + len;
+  unsigned long long h, k, v[4];
+  int i;
+
+  if (len >= 32) {
+    v[0] = seed + XXH_P1 + XXH_P2;
+    v[1] = seed + XXH_P2;
+    v[2] = seed;
+    v[3] = seed - XXH_P1;
+    for (; e - p >= 32; p += 32)
+      for (i = 0; i < 4; i++) {
+        k = aux_xxhread(p + 8 * i, 8);
+        XXH_ROUND(v[i], k);
+      }
+    h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7)
+      + XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+    for (i = 0; i < 4; i++) {
+      k = 0;
+      XXH_ROUND(k, v[i]);
+      h = (h ^ k) * XXH_P1 + XXH_P4;
+    }
+  } else {
+    h = seed + XXH_P5;
+  }
+  h += (unsigned long long) len;
+
+  for (; e - p >= 8; p += 8) {
+    k = 0;
+    XXH_ROUND(k, aux_xxhread(p, 8));
+    h ^= k;
+    h  = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if (e - p >= 4) {
+    h ^= aux_xxhread(p, 4) * XXH_P1;
+    h  = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < e; p++) {
+    h ^= *p * XXH_P5;
+    h  = XXH_ROTL(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+
+
+/* ---- Merge patch ---- */
+
+/* Merge patch of RFC 7386 that turns `a` into `b` */
+Lua
+wax_json_diff(lua_State *L) {
+  lua_settop(L, 2);
+  if (!aux_isobject(L, 1) || !aux_isobject(L, 2))
+    lua_pushvalue(L, 2);
+  else if (!aux_diff(L, 1, 2, 0))
+    lua_newtable(L);
+  return 1;
+}
+
+/* Applies a merge patch, changing the target in place if it is an
+   object */
+Lua
+wax_json_patch(lua_State *L) {
+  lua_settop(L, 2);
+  aux_patch(L, 1, 2, 0);
+  return 1;
+}
+
+/* As json.encode, tables without array items are objects */
+static int
+aux_isobject(lua_State *L, int idx) {
+  return lua_type(L, idx) == LUA_TTABLE && wLua_rawlen(L, idx) == 0;
+}
+
+/* Pushes the patch between the objects at `a` and `b` and returns 1, or
+   returns 0 if they are equal. The patch table is created at the first
+   difference, in the slot reserved below the traversals. */
+static int
+aux_diff(lua_State *L, int a, int b, int depth) {
+  int p, top;
+
+  if (depth >= PACK_DEPTH || !lua_checkstack(L, 8))
+    luaL_error(L, "Too many nesting levels");
+  lua_pushnil(L);
+  p = lua_gettop(L);
+
+  /* removed and changed keys */
+  for (lua_pushnil(L); lua_next(L, a); lua_pop(L, 1)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, b);
+    top = lua_gettop(L);
+    if (lua_isnil(L, top)) {
+      lua_pushvalue(L, top - 2);
+      aux_pushludata(L, waxJsonNull);
+    } else if (aux_isobject(L, top - 1) && aux_isobject(L, top)) {
+      if (!aux_diff(L, top - 1, top, depth + 1)) {
+        lua_pop(L, 1);
+        continue;
+      }
+      lua_pushvalue(L, top - 2);
+      lua_insert(L, -2);
+    } else if (!aux_equal(L, top - 1, top, depth + 1)) {
+      lua_pushvalue(L, top - 2);
+      lua_pushvalue(L, top);
+    } else {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (lua_isnil(L, p)) {
+      lua_newtable(L);
+      lua_replace(L, p);
+    }
+    lua_rawset(L, p);
+    lua_pop(L, 1);
+  }
+
+  /* added keys */
+  for (lua_pushnil(L); lua_next(L, b); lua_pop(L, 1)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, a);
+    if (lua_isnil(L, -1)) {
+      if (lua_isnil(L, p)) {
+        lua_newtable(L);
+        lua_replace(L, p);
+      }
+      lua_pushvalue(L, -3);
+      lua_pushvalue(L, -3);
+      lua_rawset(L, p);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (!lua_isnil(L, p)) return 1;
+  lua_pop(L, 1);
+  return 0;
+}
+
+/* Deep equality of the values at x and y, with the JSON view of tables */
+static int
+aux_equal(lua_State *L, int x, int y, int depth) {
+  int i, len, eq, top;
+  long n = 0;
+
+  if (lua_rawequal(L, x, y)) return 1;
+  if (lua_type(L, x) != LUA_TTABLE || lua_type(L, y) != LUA_TTABLE) return 0;
+  if (depth >= PACK_DEPTH || !lua_checkstack(L, 4))
+    luaL_error(L, "Too many nesting levels");
+
+  if ((len = wLua_rawlen(L, x)) != (int) wLua_rawlen(L, y)) return 0;
+  for (i = 1; i <= len; i++) {
+    lua_rawgeti(L, x, i);
+    lua_rawgeti(L, y, i);
+    top = lua_gettop(L);
+    eq  = aux_equal(L, top - 1, top, depth + 1);
+    lua_pop(L, 2);
+    if (!eq) return 0;
+  }
+  if (len > 0) return 1;
+
+  for (lua_pushnil(L); lua_next(L, x); lua_pop(L, 1), n++) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, y);
+    top = lua_gettop(L);
+    eq  = !lua_isnil(L, top) && aux_equal(L, top - 1, top, depth + 1);
+    lua_pop(L, 1);
+    if (!eq) {
+      lua_pop(L, 2);
+      return 0;
+    }
+  }
+  for (lua_pushnil(L); lua_next(L, y); lua_pop(L, 1)) n--;
+  return n == 0;
+}
+
+/* Pushes the result of the patch at p on the target at t. Objects of
+   the patch are merged in the objects of the target or in new tables,
+   other values are set as they are. */
+static void
+aux_patch(lua_State *L, int t, int p, int depth) {
+  int r, top;
+
+  if (!aux_isobject(L, p)) {
+    lua_pushvalue(L, p);
+    return;
+  }
+  if (depth >= PACK_DEPTH || !lua_checkstack(L, 8))
+    luaL_error(L, "Too many nesting levels");
+  if (aux_isobject(L, t))
+    lua_pushvalue(L, t);
+  else
+    lua_newtable(L);
+  r = lua_gettop(L);
+
+  for (lua_pushnil(L); lua_next(L, p); lua_pop(L, 1)) {
+    top = lua_gettop(L);
+    lua_pushvalue(L, top - 1);
+    if (lua_touserdata(L, top) == &waxJsonNull) {
+      lua_pushnil(L);
+    } else if (aux_isobject(L, top)) {
+      lua_pushvalue(L, top - 1);
+      lua_rawget(L, r);
+      aux_patch(L, top + 2, top, depth + 1);
+      lua_remove(L, -2);
+    } else {
+      lua_pushvalue(L, top);
+    }
+    lua_rawset(L, r);
+  }
+}
+
+
+
+/* ---- Arena ---- */
+
+/* Runs fn with the cJSON allocations in the arena of the Lua state.
+   fn runs protected so the arena is released even on errors, then
+   the error is raised again. */
+int
+waxJson_inarena(lua_State *L, lua_CFunction fn) {
+  jarena_s own = { NULL, NULL, NULL, 0 }, *A, *prev = aux_arena;
+  int st, n = lua_gettop(L);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, UD_ARENA);
+  if ((A = lua_touserdata(L, -1)) == NULL) {
+    A = lua_newuserdata(L, sizeof(*A));
+    memset(A, 0, sizeof(*A));
+    luaL_getmetatable(L, UD_ARENA);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, UD_ARENA);
+  }
+  lua_pop(L, 1);
+  if (A->busy) A = &own;   /* reentrant call, as from a finalizer */
+
+  A->busy   = 1;
+  aux_arena = A;
+  lua_pushcfunction(L, fn);
+  lua_insert(L, 1);
+  st = lua_pcall(L, n, LUA_MULTRET, 0);
+  aux_arena = prev;
+  A->busy   = 0;
+  aux_arenareset(A, A != &own);
+
+  if (st != 0) lua_error(L);
+  return lua_gettop(L);
+}
+
+static void
+*aux_arenalloc(size_t size) {
+  jarena_s *A = aux_arena;
+  jslab_s  *S;
+  size_t    n;
+  char     *p;
+
+  if (A == NULL) return malloc(size);
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if ((size_t) (A->end - A->p) < size) {
+    n = A->slab != NULL ? A->slab->size * 2 : ARENA_SLAB;
+    if (n < size) n = size;
+    if ((S = malloc(ARENA_HEAD + n)) == NULL) return NULL;
+    S->next = A->slab;
+    S->size = n;
+    A->slab = S;
+    A->p    = (char *) S + ARENA_HEAD;
+    A->end  = A->p + n;
+  }
+  p = A->p;
+  A->p += size;
+  return p;
+}
+
+/* Arena memory is only released by aux_arenareset */
+static void
+aux_arenafree(void *ptr) {
+  if (aux_arena == NULL) free(ptr);
+}
+
+/* Frees the slabs, keeping the last one for the next call if asked and
+   it isn't too big */
+static void
+aux_arenareset(jarena_s *A, int keep) {
+  jslab_s *S = A->slab, *next;
+
+  A->slab = NULL;
+  A->p = A->end = NULL;
+  if (keep && S != NULL && S->size <= ARENA_KEEP) {
+    A->slab = S;
+    A->p    = (char *) S + ARENA_HEAD;
+    A->end  = A->p + S->size;
+    S = S->next;
+    A->slab->next = NULL;
+  }
+  for (; S != NULL; S = next) {
+    next = S->next;
+    free(S);
+  }
+}
+
+Lua
+wax_json_afree(lua_State *L) {
+  aux_arenareset(luaL_checkudata(L, 1, UD_ARENA), 0);
+  return 0;
+}
+
+
+/* ---- Stack allocation ---- */
+
+void
+waxJson_luastack_alloc(lua_State *L, stack_s *stack, int size) {
   stack->used += size;
   if ( stack->used > stack->limit ) {
     if (lua_checkstack(L, (stack->limit += size)) != 1) {
@@ -0,0 +1,135 @@
+/*
+SPDX-License-Identifier: AGPL-3.0-or-later
+Copyright 2022-2023 - Thadeu de Paula and contributors
+*/
+
+/*
+ * Declarations shared by the sources of wax.json: init.c has the JSON
+ * functions, the call arena, the buffer helpers and the stream writers,
+ * msgpack.c the MessagePack codec and cbor.c the CBOR one. What they
+ * share is prefixed with waxJson_ and kept out of the module exports.
+ */
+#ifndef WAX_JSON_INCLUDED
+#define WAX_JSON_INCLUDED
+
+#include "../w/lua.h"
+
+typedef struct { int used; int limit; } stack_s;
+
+/* Object keys already pushed by a decode, slots are chosen by length and
+   first and last bytes. Repeated keys are pushed from the table at `idx`
+   without hashing them again. */
+#define KEYS_SLOTS 64
+typedef struct jkeys_s {
+  const char *key[KEYS_SLOTS];  /* key bytes, kept by the decoded tree */
+  size_t      len[KEYS_SLOTS];
+  int         idx;              /* Lua stack index of the strings table */
+} jkeys_s;
+
+/* Output of the binary encoders, grows inside the call arena or,
+   for the CBOR writer, on the heap */
+typedef struct jbuf_s {
+  char   *b;
+  size_t  len;
+  size_t  cap;
+  int     cbor;    /* CBOR instead of MessagePack */
+  int     heap;    /* grows with realloc */
+  int     canon;   /* JSON objects with sorted keys */
+} jbuf_s;
+
+/* Input of the binary decoders */
+#define PACK_DEPTH 10000   /* nesting limit of binary values */
+typedef struct jrd_s {
+  const unsigned char *s;       /* input start */
+  const unsigned char *p;       /* current position */
+  const unsigned char *e;       /* input end */
+  const char          *err;     /* error message */
+  size_t               errpos;  /* input offset of the error */
+  int                  depth;   /* open arrays and maps */
+  jkeys_s              K;
+} jrd_s;
+
+/* Streaming output of json.cborwriter and json.encoder. On CBOR open
+   items have indefinite length and are ended by a break byte. */
+#define UD_CBORW   "waxJsonCborWriter"
+#define UD_ENCODER "waxJsonEncoder"
+#define WRITER_FLUSH 65536
+typedef struct waxJsonWriter {
+  jbuf_s  B;
+  size_t  mark;      /* end of the last complete write */
+  size_t  flush;     /* output is buffered up to this size */
+  char   *nest;      /* wArr: kind of each open item */
+  size_t *cnt;       /* wArr: items written in each open item */
+  int     sinkref;   /* function, file handler or file descriptor */
+  int     fd;        /* descriptor opened from a path, or -1 */
+  int     open;
+} waxJsonWriter;
+
+#if defined(__GNUC__)
+#pragma GCC visibility push(hidden)
+#endif
+
+extern int waxJsonNull;
+
+/* init.c */
+void
+waxJson_luastack_alloc(lua_State *L, stack_s *stack, int size),
+waxJson_keysinit(lua_State *L, jkeys_s *K),
+waxJson_pushkey (lua_State *L, jkeys_s *K, const char *key, size_t len),
+waxJson_wgc     (lua_State *L, waxJsonWriter *W);
+
+int
+waxJson_inarena (lua_State *L, lua_CFunction fn),
+waxJson_append  (char **arr, const char *s, size_t len),
+waxJson_putbe   (jbuf_s *B, unsigned tag, unsigned long long v, int n),
+waxJson_bufgrow (jbuf_s *B, size_t n),
+waxJson_isutf8  (const unsigned char *s, size_t len),
+waxJson_binerror(lua_State *L, const char *err, size_t pos),
+waxJson_witem   (lua_State *L, waxJsonWriter *W),
+waxJson_wsink   (lua_State *L, waxJsonWriter *W),
+waxJson_wclose  (lua_State *L, waxJsonWriter *W, lua_CFunction fn);
+
+waxJsonWriter
+*waxJson_wnew(lua_State *L, const char *mt);
+
+/* msgpack.c */
+void
+wax_json_msgpack_open(lua_State *L);
+
+int
+waxJson_pack  (lua_State *L, jbuf_s *B, stack_s *S, int depth),
+waxJson_unpstr(lua_State *L, jrd_s *R, unsigned long long n,
+               const unsigned char *at),
+waxJson_getbe (jrd_s *R, int w, unsigned long long *u);
+
+/* cbor.c */
+void
+wax_json_cbor_open(lua_State *L);
+
+int
+waxJson_cborhead (jbuf_s *B, unsigned major, unsigned long long n),
+waxJson_cborfloat(jbuf_s *B, double d);
+
+#if defined(__GNUC__)
+#pragma GCC visibility pop
+#endif
+
+#define aux_pushludata(L,d) lua_pushlightuserdata((L),(void *)&(d));
+
+#if LUA_VERSION_NUM >= 503
+#define aux_pushint(L,i) lua_pushinteger((L),(lua_Integer)(i))
+#else
+#define aux_pushint(L,i) lua_pushnumber((L),(lua_Number)(i))
+#endif
+
+#if LUA_VERSION_NUM < 502
+#define aux_setfuncs(L,r) luaL_register((L), NULL, (r))
+#else
+#define aux_setfuncs(L,r) luaL_setfuncs((L), (r), 0)
+#endif
+
+#define aux_bufneed(B,n) ((B)->len + (n) <= (B)->cap || waxJson_bufgrow((B),(n)))
+#define aux_unpfail(R,msg,at) \
+  ((R)->err = (msg), (R)->errpos = (size_t) ((at) - (R)->s), 0)
+
+#endif /* WAX_JSON_INCLUDED */
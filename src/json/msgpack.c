@@ -0,0 +1,413 @@
+/*
+SPDX-License-Identifier: AGPL-3.0-or-later
+Copyright 2022-2023 - Thadeu de Paula and contributors
+*/
+#include "json.h"
+#include <string.h>
+
+
+
+/* ///////// DECLARATION ///////// */
+
+Lua
+wax_json_pack  (lua_State *L),
+wax_json_unpack(lua_State *L),
+aux_dopack     (lua_State *L);
+
+static int
+aux_packtable(lua_State *L, jbuf_s *B, stack_s *S, int depth),
+aux_packnum  (lua_State *L, jbuf_s *B),
+aux_packstr  (jbuf_s *B, const char *s, size_t len),
+aux_packhead (jbuf_s *B, unsigned fix, size_t fixn, unsigned t8, unsigned t16,
+              size_t n),
+aux_unpack   (lua_State *L, jrd_s *R),
+aux_unparr   (lua_State *L, jrd_s *R, unsigned long long n, const unsigned char *at),
+aux_unpmap   (lua_State *L, jrd_s *R, unsigned long long n, const unsigned char *at),
+aux_unpkey   (lua_State *L, jrd_s *R);
+
+LuaReg msgpack[] = {
+  { "pack",       wax_json_pack   },
+  { "unpack",     wax_json_unpack },
+  { NULL,         NULL            }
+};
+
+
+/* Sets the MessagePack functions on the module table at the top */
+void
+wax_json_msgpack_open(lua_State *L) {
+  aux_setfuncs(L, msgpack);
+}
+
+
+
+/* ///////// IMPLEMENTATION ///////// */
+
+/* ---- MessagePack ---- */
+
+Lua
+wax_json_pack(lua_State *L) {
+  lua_settop(L, 1);
+  return waxJson_inarena(L, aux_dopack);
+}
+
+/* The buffer grows inside the call arena, released even on errors */
+Lua
+aux_dopack(lua_State *L) {
+  jbuf_s  B     = { NULL, 0, 0, 0, 0, 0 };
+  stack_s stack = { 0, LUA_MINSTACK };
+
+  stack.used = lua_gettop(L);
+  if (!waxJson_pack(L, &B, &stack, 0)) lua_error(L);
+  lua_pushlstring(L, B.b, B.len);
+  return 1;
+}
+
+/* Packs the value on top of the stack as MessagePack or, if B->cbor
+   is set, as CBOR. On error pushes the message and returns 0. */
+int
+waxJson_pack(lua_State *L, jbuf_s *B, stack_s *S, int depth) {
+  const char *str;
+  size_t len;
+  int ok;
+
+  switch (lua_type(L, -1)) {
+    case LUA_TTABLE:
+      if (depth >= PACK_DEPTH) {
+        lua_pushstring(L, "Too many nesting levels");
+        return 0;
+      }
+      return aux_packtable(L, B, S, depth+1);
+
+    case LUA_TNUMBER:
+      ok = aux_packnum(L, B);
+      break;
+
+    case LUA_TSTRING:
+      str = lua_tolstring(L, -1, &len);
+      ok  = aux_packstr(B, str, len);
+      break;
+
+    case LUA_TBOOLEAN:
+      if (B->cbor) ok = waxJson_putbe(B, lua_toboolean(L, -1) ? 0xf5 : 0xf4, 0, 0);
+      else         ok = waxJson_putbe(B, lua_toboolean(L, -1) ? 0xc3 : 0xc2, 0, 0);
+      break;
+
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, -1) == &waxJsonNull) {
+        ok = waxJson_putbe(B, B->cbor ? 0xf6 : 0xc0, 0, 0);
+        break;
+      }
+      lua_pushstring(L, "Invalid lightuserdata found");
+      return 0;
+
+    default:
+      lua_pushstring(L, "Invalid table values");
+      return 0;
+  }
+
+  if (!ok) lua_pushstring(L, "not enough memory");
+  return ok;
+}
+
+/* Same rule of json.encode: a table with items at 1..#t is an array,
+   others are maps with string keys */
+static int
+aux_packtable(lua_State *L, jbuf_s *B, stack_s *S, int depth) {
+  int    i, len, idx = lua_gettop(L);
+  size_t n = 0, klen;
+  const char *key;
+
+  waxJson_luastack_alloc(L, S, 2);
+  if ((len = wLua_rawlen(L, idx)) > 0) {
+    if (B->cbor ? !waxJson_cborhead(B, 4, (unsigned long long) len)
+                : !aux_packhead(B, 0x90, 16, 0, 0xdc, len)) goto nomem;
+    for (i = 1; i <= len; i++) {
+      lua_rawgeti(L, idx, i);
+      if (!waxJson_pack(L, B, S, depth)) return 0;
+      lua_pop(L, 1);
+    }
+  } else {
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1), n++)
+      if (lua_type(L, -2) != LUA_TSTRING) {
+        lua_pushstring(L, "No string key found on table");
+        return 0;
+      }
+    if (B->cbor ? !waxJson_cborhead(B, 5, (unsigned long long) n)
+                : !aux_packhead(B, 0x80, 16, 0, 0xde, n)) goto nomem;
+    for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+      key = lua_tolstring(L, -2, &klen);
+      if (!aux_packstr(B, key, klen)) goto nomem;
+      if (!waxJson_pack(L, B, S, depth)) return 0;
+    }
+  }
+  waxJson_luastack_alloc(L, S, -2);
+  return 1;
+
+  nomem:
+    lua_pushstring(L, "not enough memory");
+    return 0;
+}
+
+/* Integers use the smallest format that holds them. Floats that don't
+   lose precision as float 32 use it. Before Lua 5.3 whole numbers are
+   packed as integers. */
+static int
+aux_packnum(lua_State *L, jbuf_s *B) {
+  unsigned long long bits;
+  long long i;
+  double    d;
+  float     f;
+
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, -1)) {
+    i = (long long) lua_tointeger(L, -1);
+    goto integer;
+  }
+  d = (double) lua_tonumber(L, -1);
+#else
+  d = (double) lua_tonumber(L, -1);
+  if (d >= -9223372036854775808.0 && d < 9223372036854775808.0
+      && (double) (i = (long long) d) == d)
+    goto integer;
+#endif
+
+  if (B->cbor) return waxJson_cborfloat(B, d);
+  f = (float) d;
+  if ((double) f == d) {
+    unsigned int fb;
+    memcpy(&fb, &f, sizeof(fb));
+    return waxJson_putbe(B, 0xca, fb, 4);
+  }
+  memcpy(&bits, &d, sizeof(bits));
+  return waxJson_putbe(B, 0xcb, bits, 8);
+
+  integer:
+  if (B->cbor)
+    return i >= 0 ? waxJson_cborhead(B, 0, (unsigned long long) i)
+                  : waxJson_cborhead(B, 1, (unsigned long long) (-1 - i));
+  if (i >= 0) {
+    if (i < 128)           return waxJson_putbe(B, (unsigned) i, 0, 0);
+    if (i <= 0xFF)         return waxJson_putbe(B, 0xcc, i, 1);
+    if (i <= 0xFFFF)       return waxJson_putbe(B, 0xcd, i, 2);
+    if (i <= 0xFFFFFFFFLL) return waxJson_putbe(B, 0xce, i, 4);
+    return waxJson_putbe(B, 0xcf, i, 8);
+  }
+  if (i >= -32)          return waxJson_putbe(B, (unsigned) (i & 0xFF), 0, 0);
+  if (i >= -128)         return waxJson_putbe(B, 0xd0, i, 1);
+  if (i >= -32768)       return waxJson_putbe(B, 0xd1, i, 2);
+  if (i >= -2147483647LL - 1) return waxJson_putbe(B, 0xd2, i, 4);
+  return waxJson_putbe(B, 0xd3, i, 8);
+}
+
+/* On CBOR, strings that aren't valid UTF-8 are byte strings */
+static int
+aux_packstr(jbuf_s *B, const char *s, size_t len) {
+  int text = B->cbor && waxJson_isutf8((const unsigned char *) s, len);
+
+  if (B->cbor ? !waxJson_cborhead(B, text ? 3 : 2, (unsigned long long) len)
+              : !aux_packhead(B, 0xa0, 32, 0xd9, 0xda, len))
+    return 0;
+  if (!aux_bufneed(B, len)) return 0;
+  memcpy(B->b + B->len, s, len);
+  B->len += len;
+  return 1;
+}
+
+/* Header of str, array and map: a fix form for n < fixn, then the
+   8 bit (if any), 16 and 32 bit lengths */
+static int
+aux_packhead(jbuf_s *B, unsigned fix, size_t fixn, unsigned t8, unsigned t16,
+             size_t n) {
+  if (n < fixn)        return waxJson_putbe(B, fix | (unsigned) n, 0, 0);
+  if (t8 && n <= 0xFF) return waxJson_putbe(B, t8, n, 1);
+  if (n <= 0xFFFF)     return waxJson_putbe(B, t16, n, 2);
+  if (n <= 0xFFFFFFFF) return waxJson_putbe(B, t16 + 1, n, 4);
+  return 0;
+}
+
+
+Lua
+wax_json_unpack(lua_State *L) {
+  jrd_s R;
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lua_Integer pos = luaL_optinteger(L, 2, 1);
+
+  luaL_argcheck(L, pos >= 1 && (size_t) pos <= len + 1, 2, "out of bounds");
+  lua_settop(L, 2);
+  R.s = (const unsigned char *) s;
+  R.p = R.s + pos - 1;
+  R.e = R.s + len;
+  R.depth = 0;
+  waxJson_keysinit(L, &R.K);       /* 3 */
+
+  if (!aux_unpack(L, &R)) return waxJson_binerror(L, R.err, R.errpos);
+  lua_pushinteger(L, (lua_Integer) (R.p - R.s) + 1);
+  return 2;
+}
+
+/* Pushes the value at R->p. On error sets R->err and returns 0. */
+static int
+aux_unpack(lua_State *L, jrd_s *R) {
+  const unsigned char *at = R->p;
+  unsigned long long u;
+  int c;
+
+  if (R->p >= R->e) return aux_unpfail(R, "unexpected end of input", at);
+  c = *R->p++;
+
+  if (c <= 0x7f) { aux_pushint(L, c);       return 1; }
+  if (c >= 0xe0) { aux_pushint(L, c - 256); return 1; }
+  if (c <= 0x8f) return aux_unpmap(L, R, c & 0x0f, at);
+  if (c <= 0x9f) return aux_unparr(L, R, c & 0x0f, at);
+  if (c <= 0xbf) return waxJson_unpstr(L, R, c & 0x1f, at);
+
+  switch (c) {
+    case 0xc0: aux_pushludata(L, waxJsonNull); return 1;
+    case 0xc2: lua_pushboolean(L, 0);          return 1;
+    case 0xc3: lua_pushboolean(L, 1);          return 1;
+
+    case 0xc4: case 0xc5: case 0xc6:           /* bin 8, 16, 32 */
+      if (!waxJson_getbe(R, 1 << (c - 0xc4), &u)) break;
+      return waxJson_unpstr(L, R, u, at);
+
+    case 0xd9: case 0xda: case 0xdb:           /* str 8, 16, 32 */
+      if (!waxJson_getbe(R, 1 << (c - 0xd9), &u)) break;
+      return waxJson_unpstr(L, R, u, at);
+
+    case 0xca: {                               /* float 32 */
+      unsigned int fb;
+      float f;
+      if (!waxJson_getbe(R, 4, &u)) break;
+      fb = (unsigned int) u;
+      memcpy(&f, &fb, sizeof(f));
+      lua_pushnumber(L, (lua_Number) f);
+      return 1;
+    }
+
+    case 0xcb: {                               /* float 64 */
+      double d;
+      if (!waxJson_getbe(R, 8, &u)) break;
+      memcpy(&d, &u, sizeof(d));
+      lua_pushnumber(L, (lua_Number) d);
+      return 1;
+    }
+
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: /* uint 8 to 64 */
+      if (!waxJson_getbe(R, 1 << (c - 0xcc), &u)) break;
+      if (u > 0x7FFFFFFFFFFFFFFFULL) lua_pushnumber(L, (lua_Number) u);
+      else aux_pushint(L, (long long) u);
+      return 1;
+
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: { /* int 8 to 64 */
+      int w = 1 << (c - 0xd0);
+      if (!waxJson_getbe(R, w, &u)) break;
+      if (w < 8 && (u >> (8 * w - 1)))
+        u |= ~0ULL << (8 * w);
+      aux_pushint(L, (long long) u);
+      return 1;
+    }
+
+    case 0xdc: case 0xdd:                      /* array 16, 32 */
+      if (!waxJson_getbe(R, c == 0xdc ? 2 : 4, &u)) break;
+      return aux_unparr(L, R, u, at);
+
+    case 0xde: case 0xdf:                      /* map 16, 32 */
+      if (!waxJson_getbe(R, c == 0xde ? 2 : 4, &u)) break;
+      return aux_unpmap(L, R, u, at);
+
+    case 0xc1:
+      return aux_unpfail(R, "invalid byte", at);
+
+    default:
+      return aux_unpfail(R, "unsupported extension type", at);
+  }
+  return aux_unpfail(R, "unexpected end of input", at);
+}
+
+int
+waxJson_unpstr(lua_State *L, jrd_s *R, unsigned long long n,
+               const unsigned char *at) {
+  if ((unsigned long long) (R->e - R->p) < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  lua_pushlstring(L, (const char *) R->p, (size_t) n);
+  R->p += n;
+  return 1;
+}
+
+/* Every item takes at least one byte, larger counts are truncated input */
+static int
+aux_unparr(lua_State *L, jrd_s *R, unsigned long long n,
+           const unsigned char *at) {
+  int i;
+
+  if ((unsigned long long) (R->e - R->p) < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  if (++R->depth > PACK_DEPTH || !lua_checkstack(L, 3))
+    return aux_unpfail(R, "too many nesting levels", at);
+
+  lua_createtable(L, (int) n, 0);
+  for (i = 1; i <= (int) n; i++) {
+    if (!aux_unpack(L, R)) return 0;
+    lua_rawseti(L, -2, i);
+  }
+  R->depth--;
+  return 1;
+}
+
+static int
+aux_unpmap(lua_State *L, jrd_s *R, unsigned long long n,
+           const unsigned char *at) {
+  unsigned long long i;
+
+  if ((unsigned long long) (R->e - R->p) / 2 < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  if (++R->depth > PACK_DEPTH || !lua_checkstack(L, 3))
+    return aux_unpfail(R, "too many nesting levels", at);
+
+  lua_createtable(L, 0, (int) n);
+  for (i = 0; i < n; i++) {
+    if (!aux_unpkey(L, R) || !aux_unpack(L, R)) return 0;
+    lua_rawset(L, -3);
+  }
+  R->depth--;
+  return 1;
+}
+
+/* String keys are pushed through the key cache */
+static int
+aux_unpkey(lua_State *L, jrd_s *R) {
+  const unsigned char *at = R->p;
+  unsigned long long n;
+  int c = R->p < R->e ? *R->p : 0;
+
+  if (c >= 0xa0 && c <= 0xbf) {
+    n = c & 0x1f;
+    R->p++;
+  } else if (c >= 0xd9 && c <= 0xdb) {
+    R->p++;
+    if (!waxJson_getbe(R, 1 << (c - 0xd9), &n))
+      return aux_unpfail(R, "unexpected end of input", at);
+  } else {
+    if (!aux_unpack(L, R)) return 0;
+    if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1))
+      return aux_unpfail(R, "invalid map key", at);
+    return 1;
+  }
+
+  if ((unsigned long long) (R->e - R->p) < n)
+    return aux_unpfail(R, "unexpected end of input", at);
+  waxJson_pushkey(L, &R->K, (const char *) R->p, (size_t) n);
+  R->p += n;
+  return 1;
+}
+
+/* Reads w bytes, big endian */
+int
+waxJson_getbe(jrd_s *R, int w, unsigned long long *u) {
+  if (R->e - R->p < w) return 0;
+  for (*u = 0; w > 0; w--) *u = (*u << 8) | *R->p++;
+  return 1;
+}
+
+/* vim: set fdm=indent fdn=1 ts=2 sts=2 sw=2: */
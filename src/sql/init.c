@@ -6,6 +6,10 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
 #include "../w/arr.h"
 #include <sqlite3.h>
 #include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 
 
 /*//////// DECLARATIONS ////////*/
@@ -13,9 +17,13 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
 #define is_int(n) (((n) - floor(n)) == 0)
 
 #define bindvalues(S,L) ((S)->btype == STMT_PNAME \
-                       ? bindnames((S),(L)) \
+                       ? bindnames((S),(L),2) \
                        : bindpos((S),(L)))
 
+#define bindrow(S,L,t)  ((S)->btype == STMT_PNAME \
+                       ? bindnames((S),(L),(t)) \
+                       : bindarray((S),(L),(t)))
+
 #define CONCHECK(L,D) if ((D)->conn == NULL) {\
   lua_pushnil((L));                           \
   lua_pushstring((L), "closed connection");   \
@@ -28,8 +36,88 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
   return 2;                                   \
 }
 
+/*
+ * Statements of db:query are cached by their SQL text in a registry
+ * table, mapping the text to the statement and the statement back to
+ * the text. Each hit stamps the statement with the connection tick, a
+ * miss over the size evicts the one of oldest tick.
+ */
+#define CACHE_SIZE 32
+
+/*
+ * Queries of db:async are queued to a pool of worker threads, each one
+ * with its own connection to the database file. Values cross threads as
+ * cells, the Lua tables of the rows are made when the result is taken.
+ * A byte written to a pipe tells the query ended, so event loops can
+ * poll its descriptor.
+ */
+#define ASYNC_WORKERS 4  /* threads of a pool, started as jobs queue up */
+
+typedef struct sqlcell_s {
+  int           type;      /* SQLITE_INTEGER, _FLOAT, _TEXT or _NULL */
+  sqlite3_int64 i;
+  double        d;
+  char         *s;         /* copy of the text */
+  int           len;
+  char         *name;      /* named parameter, without its prefix */
+} sqlcell_s;
+
+typedef struct sqljob_s {
+  pthread_mutex_t mu;
+  struct sqljob_s *next;   /* in the queue of the pool */
+  char           *sql;
+  sqlcell_s      *params;  /* wArr: positional values, then named ones */
+  int             npos;
+  char          **cols;    /* wArr: column names */
+  sqlcell_s      *cells;   /* wArr: values of the rows, row after row */
+  char           *err;
+  int             changes;
+  int             fd[2];   /* done pipe */
+  int             done;
+  int             refs;    /* the handle and the pool until it ends */
+} sqljob_s;
+
+typedef struct sqlpool_s {
+  pthread_mutex_t mu;
+  pthread_cond_t  cond;    /* signals queued jobs and the close */
+  char           *path;
+  int             flags;
+  int             busy;    /* busy timeout of the database */
+  sqljob_s       *head;    /* queued jobs, first in first out */
+  sqljob_s       *tail;
+  int             queued;
+  int             idle;    /* workers waiting for jobs */
+  int             closing;
+  int             nworkers;
+  pthread_t       workers[ASYNC_WORKERS];
+} sqlpool_s;
+
+typedef struct waxSqlAsync {
+  sqljob_s *J;
+} waxSqlAsync;
+
+/* Lua functions of an SQL function, step only for scalar ones */
+typedef struct sqlfunc_s {
+  lua_State *L;
+  int        step;
+  int        final;
+  int        threadref;
+} sqlfunc_s;
+
+typedef struct sqlagg_s {
+  int ref;                 /* state of the group, 0 before the first row */
+  int failed;
+} sqlagg_s;
+
 typedef struct waxSql {
-  sqlite3 *conn;
+  sqlite3       *conn;
+  sqlpool_s     *pool;      /* connections of db:async, or NULL */
+  int           cacheref;   /* registry table of cached statements */
+  int           cachesize;
+  int           cached;     /* statements in the cache */
+  unsigned long tick;
+  unsigned long hits;
+  unsigned long misses;
 } waxSql;
 
 
@@ -39,7 +127,12 @@ typedef struct waxSql {
 typedef struct waxSqlStmt {
   sqlite3_stmt  *S;
   int           cols;
+  int           namesref;   /* registry array of the column names */
+  int           array;      /* rows are fetched as arrays */
+  int           done;       /* fetched to the end since the last reset */
   const char    *err;
+  char          msg[256];   /* copy of the connection error, for err */
+  unsigned long tick;       /* last use from the cache, 0 if uncached */
 
   enum bindtype { STMT_PNAME, STMT_PANON, } btype;
   union {
@@ -59,16 +152,83 @@ wax_sql_open    (lua_State *L),
 wax_sql_close   (lua_State *L),
 wax_sql_exec    (lua_State *L),
 wax_sql_prep    (lua_State *L),
+wax_sql_query   (lua_State *L),
+wax_sql_cache   (lua_State *L),
 wax_sql_run     (lua_State *L),
+wax_sql_runmany (lua_State *L),
 wax_sql_fetch   (lua_State *L),
 wax_sql_fetchok (lua_State *L),
+wax_sql_fetchmany(lua_State *L),
+wax_sql_fetchall(lua_State *L),
 wax_sql_final   (lua_State *L),
+wax_sql_mode    (lua_State *L),
+wax_sql_columns (lua_State *L),
 wax_sql_version (lua_State *L),
-iter_fetch      (lua_State *L);
+wax_sql_async   (lua_State *L),
+wax_sql_asfd    (lua_State *L),
+wax_sql_asready (lua_State *L),
+wax_sql_aswait  (lua_State *L),
+wax_sql_asresult(lua_State *L),
+wax_sql_asfree  (lua_State *L),
+wax_sql_fn      (lua_State *L),
+wax_sql_agg     (lua_State *L),
+iter_fetch      (lua_State *L),
+runrows         (lua_State *L),
+runbindp        (lua_State *L);
+
+static int
+bindnames       (waxSqlStmt *S, lua_State *L, int t),
+bindpos         (waxSqlStmt *S, lua_State *L),
+bindarray       (waxSqlStmt *S, lua_State *L, int t),
+bindvalue       (waxSqlStmt *S, lua_State *L, int idx, int pos),
+bindnumber      (sqlite3_stmt *st, lua_State *L, int idx, int pos),
+toint64         (lua_State *L, int idx, sqlite3_int64 *i),
+stmtprep        (lua_State *L, waxSql *D, const char *sql),
+stmtfinal       (lua_State *L, waxSqlStmt *S),
+fetchrows       (lua_State *L, waxSqlStmt *S, int max, int t),
+runbind         (lua_State *L, int row);
 
 static int
-bindnames       (waxSqlStmt *S, lua_State *L),
-bindpos         (waxSqlStmt *S, lua_State *L);
+asyncparams     (lua_State *L, sqljob_s *J, int t),
+asynccell       (lua_State *L, sqlcell_s *C, int pos),
+asyncbind       (sqljob_s *J, sqlite3_stmt *st),
+asyncrows       (sqljob_s *J, sqlite3_stmt *st),
+poolpush        (sqlpool_s *P, sqljob_s *J),
+fnflags         (lua_State *L, int t),
+fnreturn        (lua_State *L, waxSql *D, int rc),
+optbool         (lua_State *L, int t, const char *name),
+optint          (lua_State *L, int t, const char *name, lua_Integer *v),
+optenum         (lua_State *L, int t, const char *name, const char *const list[]);
+
+static void
+*asyncwork      (void *pool);
+
+static sqlpool_s
+*poolnew        (waxSql *D);
+
+static sqlfunc_s
+*fnnew          (lua_State *L, int step, int final);
+
+static void
+poolfree        (sqlpool_s *P),
+steperror       (waxSqlStmt *S, int rc),
+asyncrun        (sqlpool_s *P, sqljob_s *J, sqlite3 **db),
+jobdone         (sqljob_s *J),
+jobrelease      (sqljob_s *J),
+joberror        (sqljob_s *J, const char *msg),
+fnfree          (void *fn),
+fnscalar        (sqlite3_context *ctx, int argc, sqlite3_value **argv),
+fnstep          (sqlite3_context *ctx, int argc, sqlite3_value **argv),
+fnfinal         (sqlite3_context *ctx),
+fnresult        (sqlite3_context *ctx, lua_State *L),
+fnerror         (sqlite3_context *ctx, lua_State *L),
+pushvalues      (lua_State *L, int argc, sqlite3_value **argv),
+stmtnames       (lua_State *L, waxSqlStmt *S),
+pushrow         (lua_State *L, waxSqlStmt *S),
+pushcolumn      (lua_State *L, waxSqlStmt *S, int c),
+pushcell        (lua_State *L, sqlcell_s *C),
+cacheevict      (lua_State *L, waxSql *D, int keep),
+cachefree       (lua_State *L, waxSql *D);
 
 static char
 *sqltrim        (const char *i, int *trimmed);
@@ -82,11 +242,21 @@ LuaReg module[] = {
   {"open",    wax_sql_open   },
   {"close",   wax_sql_close  },
   {"prepare", wax_sql_prep   },
+  {"query",   wax_sql_query  },
+  {"cache",   wax_sql_cache  },
   {"execute", wax_sql_exec   },
   {"fetch",   wax_sql_fetch  },
   {"fetchok", wax_sql_fetchok},
+  {"fetchmany", wax_sql_fetchmany},
+  {"fetchall",  wax_sql_fetchall },
   {"run",     wax_sql_run    },
+  {"runmany", wax_sql_runmany},
+  {"mode",    wax_sql_mode   },
+  {"columns", wax_sql_columns},
   {"version", wax_sql_version},
+  {"async",   wax_sql_async  },
+  {"create_function",  wax_sql_fn  },
+  {"create_aggregate", wax_sql_agg },
   { NULL,     NULL           },
 };
 
@@ -96,10 +266,15 @@ LuaReg module[] = {
 LuaReg wax_sql_mt[] = {
   { "execute", wax_sql_exec  },
   { "prepare", wax_sql_prep  },
+  { "query",   wax_sql_query },
+  { "cache",   wax_sql_cache },
+  { "async",   wax_sql_async },
+  { "create_function",  wax_sql_fn  },
+  { "create_aggregate", wax_sql_agg },
   { "close",   wax_sql_close },
-  { "_gc",     wax_sql_close },
+  { "__gc",    wax_sql_close },
   #if LUA_VERSION_NUM >= 504
-  { "_close",  wax_sql_close },
+  { "__close", wax_sql_close },
   #endif
   { NULL,      NULL },
 };
@@ -109,16 +284,32 @@ LuaReg wax_sql_mt[] = {
 LuaReg wax_sql_stmtmt[] = {
   { "fetch",   wax_sql_fetch  },
   { "fetchok", wax_sql_fetchok},
+  { "fetchmany", wax_sql_fetchmany},
+  { "fetchall",  wax_sql_fetchall },
   { "run",     wax_sql_run    },
+  { "runmany", wax_sql_runmany},
+  { "mode",    wax_sql_mode   },
+  { "columns", wax_sql_columns},
   { "finalize",wax_sql_final  },
-  { "_gc",     wax_sql_final  },
+  { "__gc",    wax_sql_final  },
   #if LUA_VERSION_NUM >= 504
-  { "_close",  wax_sql_final  },
+  { "__close", wax_sql_final  },
   #endif
   { NULL,      NULL },
 };
 
 
+#define UD_SQL_ASYNC "waxSqlAsync"
+LuaReg wax_sql_asyncmt[] = {
+  { "fd",      wax_sql_asfd     },
+  { "ready",   wax_sql_asready  },
+  { "wait",    wax_sql_aswait   },
+  { "result",  wax_sql_asresult },
+  { "__gc",    wax_sql_asfree   },
+  { NULL,      NULL },
+};
+
+
 #define is_name_param(n) ( (n) != NULL && (n)[0] != '?' )
 
 
@@ -128,6 +319,7 @@ LuaReg wax_sql_stmtmt[] = {
 int luaopen_wax_sql_initc(lua_State *L) {
   wLua_newuserdata_mt(L, UD_SQL,      wax_sql_mt);
   wLua_newuserdata_mt(L, UD_SQL_STMT, wax_sql_stmtmt);
+  wLua_newuserdata_mt(L, UD_SQL_ASYNC, wax_sql_asyncmt);
   wLua_export(L, module);
   
   lua_pushlightuserdata(L, (void *) &wax_sql_null);
@@ -136,10 +328,59 @@ int luaopen_wax_sql_initc(lua_State *L) {
 }
 
 
+/*
+ * Opens the database with the flags and pragmas of the options at 2.
+ * Options are checked before the database is opened, the pragmas run
+ * right after, so a failing one returns the error as open does.
+ */
 Lua
 wax_sql_open(lua_State *L) {
-  waxSql *D = lua_newuserdata(L, sizeof(*D));
-  int rc = sqlite3_open(luaL_checkstring(L,1), &(D->conn));
+  static const char *const syncs[] = { "off", "normal", "full", "extra", NULL };
+  static const char *const temps[] = { "default", "file", "memory", NULL };
+  const char *path  = luaL_checkstring(L, 1);
+  int         flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  int         sync, temp, rc, len = 0;
+  lua_Integer mmap, cache, busy = 0;
+  char        pragmas[256];
+  waxSql     *D;
+
+  if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+  if (optbool(L, 2, "readonly")) flags = SQLITE_OPEN_READONLY;
+  if (optbool(L, 2, "nomutex"))  flags |= SQLITE_OPEN_NOMUTEX;
+  if (optbool(L, 2, "wal"))
+    len += snprintf(pragmas + len, sizeof(pragmas) - len,
+                    "PRAGMA journal_mode=WAL;");
+  if ((sync = optenum(L, 2, "synchronous", syncs)) >= 0)
+    len += snprintf(pragmas + len, sizeof(pragmas) - len,
+                    "PRAGMA synchronous=%d;", sync);
+  if ((temp = optenum(L, 2, "temp_store", temps)) >= 0)
+    len += snprintf(pragmas + len, sizeof(pragmas) - len,
+                    "PRAGMA temp_store=%d;", temp);
+  if (optint(L, 2, "mmap_size", &mmap))
+    len += snprintf(pragmas + len, sizeof(pragmas) - len,
+                    "PRAGMA mmap_size=%lld;", (long long) mmap);
+  if (optint(L, 2, "cache_size", &cache))
+    len += snprintf(pragmas + len, sizeof(pragmas) - len,
+                    "PRAGMA cache_size=%lld;", (long long) cache);
+  optint(L, 2, "busy_timeout", &busy);
+  luaL_argcheck(L, busy >= 0 && busy <= INT_MAX, 2, "invalid busy_timeout");
+  lua_settop(L, 1);
+
+  D  = lua_newuserdata(L, sizeof(*D));
+  rc = sqlite3_open_v2(path, &(D->conn), flags, NULL);
+
+  D->pool      = NULL;
+  D->cacheref  = LUA_NOREF;
+  D->cachesize = CACHE_SIZE;
+  D->cached    = 0;
+  D->tick      = 0;
+  D->hits      = 0;
+  D->misses    = 0;
+
+  if (SQLITE_OK == rc && busy > 0)
+    rc = sqlite3_busy_timeout(D->conn, (int) busy);
+  if (SQLITE_OK == rc && len > 0)
+    rc = sqlite3_exec(D->conn, pragmas, NULL, NULL, NULL);
 
   if (SQLITE_OK == rc) {
     luaL_getmetatable(L,UD_SQL);
@@ -149,6 +390,7 @@ wax_sql_open(lua_State *L) {
   lua_pushnil(L);
   lua_pushstring(L, sqlite3_errmsg(D->conn));
   sqlite3_close(D->conn);
+  D->conn = NULL;
   return 2;
 }
 
@@ -160,8 +402,12 @@ wax_sql_close(lua_State *L) {
   if (D->conn == NULL) {
     lua_pushboolean(L,0);
   } else {
-    sqlite3_close(D->conn);
+    /* statements still held by Lua keep it open until finalized */
+    cachefree(L, D);
+    sqlite3_close_v2(D->conn);
     D->conn = NULL;
+    if (D->pool != NULL) poolfree(D->pool);
+    D->pool = NULL;
     lua_pushboolean(L,1);
   }
   return 1;
@@ -223,56 +469,90 @@ wax_sql_exec(lua_State *L) {
 
 Lua
 wax_sql_prep(lua_State *L) {
-  int i = 1;
-  int bpos;
-  const char *sql = luaL_checkstring(L, 2);
   waxSql     *D   = luaL_checkudata(L, 1, UD_SQL);
-  waxSqlStmt *S   = lua_newuserdata(L, sizeof(*S));
+  const char *sql = luaL_checkstring(L, 2);
   CONCHECK(L, D);
-  S->err = NULL;
-
-  if (SQLITE_OK != sqlite3_prepare_v2(D->conn, sql, -1, &S->S, NULL))
-    goto Error;
-
-  bpos = sqlite3_bind_parameter_count(S->S);
-  const char *name = bpos > 0 ? sqlite3_bind_parameter_name(S->S, i)
-                                : NULL;
-
-  if (is_name_param(name)) {
+  return stmtprep(L, D, sql);
+}
 
-    S->bnames = wArr_new(*S->bnames, 4);
-    wArr_push(S->bnames, (const char *) &name[1]);
 
-    for (i=2; i <= bpos; i++) {
-      name = sqlite3_bind_parameter_name(S->S, i);
-      wLua_assert(L,is_name_param(name), "Mixes named and unamed parameters");
-      wLua_assert(L,
-                 wArr_push(S->bnames, (const char *) &name[1]),
-                 strerror(errno));
-    }
-    
-    S->btype = STMT_PNAME;
+/*
+ * Returns the statement of the cache for the SQL text, reset, or
+ * prepares and caches a new one. Statements of the cache are shared by
+ * every caller of the same text.
+ */
+Lua
+wax_sql_query(lua_State *L) {
+  waxSql     *D   = luaL_checkudata(L, 1, UD_SQL);
+  const char *sql = luaL_checkstring(L, 2);
+  waxSqlStmt *S;
+  CONCHECK(L, D);
+  lua_settop(L, 2);
 
-  } else {
+  if (D->cacheref == LUA_NOREF) {
+    lua_newtable(L);
+    D->cacheref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, D->cacheref);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, 3);
+
+  S = lua_touserdata(L, -1);
+  if (S != NULL && S->S != NULL) {
+    D->hits++;
+    S->tick = ++D->tick;
+    S->err  = NULL;
+    S->done = 0;
+    sqlite3_reset(S->S);
+    return 1;
+  }
+  if (S != NULL) {               /* finalized by the user */
+    lua_pushnil(L);
+    lua_rawset(L, 3);
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, 3);
+    D->cached--;
+  }
+  lua_settop(L, 3);
+
+  D->misses++;
+  if (stmtprep(L, D, sql) != 1) return 2;
+  S = lua_touserdata(L, -1);
+  S->tick = ++D->tick;
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, 3);
+  lua_pushvalue(L, -1);
+  lua_pushvalue(L, 2);
+  lua_rawset(L, 3);
+  D->cached++;
+  cacheevict(L, D, D->cachesize);
+  return 1;
+}
 
-    for (i=1; i <= bpos; i++) {
-      name = sqlite3_bind_parameter_name(S->S, i);
-      wLua_assert(L, !is_name_param(name), "Mixes unamed and named parameters");
-    }
 
-    S->btype = STMT_PANON;
-    S->bpos = bpos;
+/*
+ * Sets the size of the statement cache, when given, and returns its
+ * counters.
+ */
+Lua
+wax_sql_cache(lua_State *L) {
+  waxSql *D = luaL_checkudata(L, 1, UD_SQL);
+  CONCHECK(L, D);
 
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0 && size <= INT_MAX, 2, "invalid cache size");
+    D->cachesize = (int) size;
+    cacheevict(L, D, D->cachesize);
   }
-  S->cols = -1;
-  luaL_getmetatable(L,UD_SQL_STMT);
-  lua_setmetatable(L,-2);
+  lua_createtable(L, 0, 4);
+  wLua_pair_si(L, "size",   D->cachesize);
+  wLua_pair_si(L, "count",  D->cached);
+  wLua_pair_si(L, "hits",   (lua_Integer) D->hits);
+  wLua_pair_si(L, "misses", (lua_Integer) D->misses);
   return 1;
-
-  Error:
-    lua_pushnil(L);
-    lua_pushstring(L, sqlite3_errmsg(D->conn));
-    return 2;
 }
 
 
@@ -280,9 +560,7 @@ Lua
 wax_sql_final(lua_State *L) {
   waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
   if (S->S != NULL) {
-    if (S->btype == STMT_PNAME) wArr_clear(S->bnames);
-    int rc = sqlite3_finalize(S->S);
-    S->S = NULL;
+    int rc = stmtfinal(L, S);
     if (SQLITE_OK == rc) {
       lua_pushboolean(L,1);
       return 1;
@@ -319,6 +597,110 @@ wax_sql_run(lua_State *L) {
 }
 
 
+/*
+ * Runs the statement for each row of the array at 2. By default the
+ * rows run inside a savepoint, a transaction of its own or nested in
+ * the one already open, released at the end or rolled back on the
+ * first error.
+ */
+Lua
+wax_sql_runmany(lua_State *L) {
+  waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
+  sqlite3    *db;
+  int trans = 1, st;
+  STMTCHECK(L,S);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "transaction");
+    trans = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  }
+  lua_settop(L, 2);
+  db = sqlite3_db_handle(S->S);
+
+  if (trans && SQLITE_OK != sqlite3_exec(db, "SAVEPOINT wax_runmany",
+                                         NULL, NULL, NULL)) {
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(db));
+    return 2;
+  }
+
+  lua_pushcfunction(L, runrows);
+  lua_insert(L, 1);
+  st = lua_pcall(L, 2, 2, 0);
+  sqlite3_reset(S->S);
+
+  if (trans && st == 0 && !lua_isnil(L, -2)
+      && SQLITE_OK != sqlite3_exec(db, "RELEASE wax_runmany", NULL, NULL, NULL)) {
+    lua_pop(L, 2);
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(db));
+  }
+  if (trans && (st != 0 || lua_isnil(L, -2))) {
+    sqlite3_exec(db, "ROLLBACK TO wax_runmany", NULL, NULL, NULL);
+    sqlite3_exec(db, "RELEASE wax_runmany", NULL, NULL, NULL);
+  }
+  if (st != 0) lua_error(L);
+  if (lua_isnil(L, -2)) return 2;
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+ * Protected loop of runmany, returns the rows changed or nil and the
+ * error message.
+ */
+Lua
+runrows(lua_State *L) {
+  waxSqlStmt *S  = lua_touserdata(L, 1);
+  sqlite3    *db = sqlite3_db_handle(S->S);
+  int i, rc, n = (int) wLua_rawlen(L, 2);
+  lua_Integer changes = 0;
+
+  for (i = 1; i <= n; i++) {
+    lua_settop(L, 2);
+    lua_rawgeti(L, 2, i);
+    wLua_assert(L, lua_istable(L, 3), "Row %d is not a table", i);
+
+    if    (SQLITE_OK   != (rc = sqlite3_reset(S->S)))     goto Error;
+    if    (SQLITE_OK   != (rc = runbind(L, i)))           goto Error;
+    while (SQLITE_ROW  == (rc = sqlite3_step(S->S)))      {};
+    if    (SQLITE_DONE != rc)                             goto Error;
+    changes += sqlite3_changes(db);
+  }
+  lua_pushinteger(L, changes);
+  lua_pushnil(L);
+  return 2;
+
+  Error:
+    lua_pushnil(L);
+    lua_pushfstring(L, "row %d %s", i, sqlite3_errmsg(db));
+    return 2;
+}
+
+
+/*
+ * Binds the row at 3 to the statement at 1 for runrows, invalid values
+ * are raised with the number of the row. Returns the SQLite code.
+ */
+static int runbind(lua_State *L, int row) {
+  lua_pushcfunction(L, runbindp);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 3);
+  if (lua_pcall(L, 2, 1, 0) != 0)
+    return luaL_error(L, "row %d %s", row, lua_tostring(L, -1));
+  return (int) lua_tointeger(L, -1);
+}
+
+Lua
+runbindp(lua_State *L) {
+  lua_pushinteger(L, bindrow((waxSqlStmt *) lua_touserdata(L, 1), L, 2));
+  return 1;
+}
+
+
 /*
  * Actually it is the binder function that returns the
  * userdata and the iterator to run the steps
@@ -329,14 +711,17 @@ wax_sql_fetch(lua_State *L) {
   int rc;
   STMTCHECK(L,S);
 
-  if (S->cols < 0)
-    S->cols = sqlite3_column_count(S->S);
+  if (S->cols < 0) {
+    stmtnames(L, S);
+    lua_pop(L, 1);
+  }
   
   if (SQLITE_OK != (rc=sqlite3_reset(S->S)) || SQLITE_OK != (rc=bindvalues(S, L))) {
     S->err = sqlite3_errstr(rc);
     return 0;
   } else {
-    S->err = "unstarted";
+    S->err  = "unstarted";
+    S->done = 0;
     lua_pushvalue(L,1);
     lua_pushcclosure(L, iter_fetch,1);
     return 1;
@@ -349,41 +734,124 @@ iter_fetch(lua_State *L) {
   waxSqlStmt *S = lua_touserdata(L, lua_upvalueindex(1));
   int c = S->cols;
   int rc;
-  if (!c) return 0;
+  if (!c || S->done) return 0;
 
   rc = sqlite3_step(S->S);
   if (SQLITE_ROW == rc) {
     S->err = "pending";
-    lua_newtable(L);
-    for (; --c >= 0 ;) switch(sqlite3_column_type(S->S, c)) {
-      case SQLITE_INTEGER:
-        wLua_pair_si(L,
-                    sqlite3_column_name(S->S,c),
-                    sqlite3_column_int(S->S, c));
-        break;
-      case SQLITE_FLOAT:
-        wLua_pair_sn(L,
-                    sqlite3_column_name(S->S,c),
-                    sqlite3_column_double(S->S, c));
-        break;
-      case SQLITE_NULL:
-        wLua_pair_slu(L,
-                     sqlite3_column_name(S->S,c),
-                     &(wax_sql_null));
-        break;
-      default: /* for blob, text and others */
-        wLua_pair_ss(L,
-                    sqlite3_column_name(S->S,c),
-                    (const char *) sqlite3_column_text(S->S, c));
-        rc = 1;
-    }
+    pushrow(L, S);
     return 1;
   }
-  S->err = SQLITE_DONE == rc ? NULL : sqlite3_errstr(rc);
+  S->done = 1;
+  steperror(S, rc);
   return 0;
 }
 
 
+/*
+ * Sets how rows are fetched: "hash" tables keyed by the column names,
+ * the default, or "array" tables of the values in column order.
+ * Returns the statement.
+ */
+Lua
+wax_sql_mode(lua_State *L) {
+  static const char *const modes[] = { "hash", "array", NULL };
+  waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
+  int mode = luaL_checkoption(L, 2, NULL, modes);
+  STMTCHECK(L,S);
+
+  S->array = mode == 1;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+ * Returns an array of the result column names
+ */
+Lua
+wax_sql_columns(lua_State *L) {
+  waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
+  int c;
+  STMTCHECK(L,S);
+
+  stmtnames(L, S);
+  lua_createtable(L, S->cols, 0);
+  for (c = 1; c <= S->cols; c++) {
+    lua_rawgeti(L, -2, c);
+    lua_rawseti(L, -2, c);
+  }
+  return 1;
+}
+
+
+/*
+ * Fetches up to `n` of the next rows of the statement, bound by fetch()
+ * or not needing values, in an array. The array at 3, when given, is
+ * reused, cleared of the items after the rows. Once the rows are over
+ * every call returns an empty array, until the statement is reset.
+ */
+Lua
+wax_sql_fetchmany(lua_State *L) {
+  waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  int i, len = 0;
+  STMTCHECK(L,S);
+  luaL_argcheck(L, n > 0 && n <= INT_MAX, 2, "invalid number of rows");
+
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_createtable(L, n < 256 ? (int) n : 256, 0);
+  } else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    len = (int) wLua_rawlen(L, 3);
+  }
+
+  if ((i = fetchrows(L, S, (int) n, 3)) < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(sqlite3_db_handle(S->S)));
+    return 2;
+  }
+  for (; len > i; len--) {
+    lua_pushnil(L);
+    lua_rawseti(L, 3, len);
+  }
+  return 1;
+}
+
+
+/*
+ * Applies the values to the statement as fetch() and returns all of
+ * its rows in an array.
+ */
+Lua
+wax_sql_fetchall(lua_State *L) {
+  waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
+  int rc;
+  STMTCHECK(L,S);
+
+  if (S->cols < 0) {
+    stmtnames(L, S);
+    lua_pop(L, 1);
+  }
+  if (SQLITE_OK != (rc=sqlite3_reset(S->S)) || SQLITE_OK != (rc=bindvalues(S, L))) {
+    S->err = sqlite3_errstr(rc);
+    lua_pushnil(L);
+    lua_pushstring(L, S->err);
+    return 2;
+  }
+  S->done = 0;
+  lua_newtable(L);
+  if (fetchrows(L, S, INT_MAX, lua_gettop(L)) < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(sqlite3_db_handle(S->S)));
+    return 2;
+  }
+  return 1;
+}
+
+
 Lua
 wax_sql_fetchok(lua_State *L) {
   waxSqlStmt *S = luaL_checkudata(L, 1, UD_SQL_STMT);
@@ -398,6 +866,224 @@ wax_sql_fetchok(lua_State *L) {
 }
 
 
+/*
+ * Registers `fn` as the SQL function `name` of `nargs` arguments, -1 for
+ * any number of them. The values of the arguments and of the result map
+ * as the ones of run() and fetch().
+ */
+Lua
+wax_sql_fn(lua_State *L) {
+  waxSql     *D    = luaL_checkudata(L, 1, UD_SQL);
+  const char *name = luaL_checkstring(L, 2);
+  int        nargs = (int) luaL_checkinteger(L, 3);
+  sqlfunc_s  *F;
+  int rc;
+  CONCHECK(L, D);
+
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 5)) luaL_checktype(L, 5, LUA_TTABLE);
+
+  F  = fnnew(L, 4, 0);
+  rc = sqlite3_create_function_v2(D->conn, name, nargs, fnflags(L, 5), F,
+                                  fnscalar, NULL, NULL, fnfree);
+  return fnreturn(L, D, rc);
+}
+
+
+/*
+ * Registers the SQL aggregate function `name`. For each row of a group
+ * step(state, ...) returns the new state, nil on the first row, and
+ * final(state) returns the value of the group.
+ */
+Lua
+wax_sql_agg(lua_State *L) {
+  waxSql      *D    = luaL_checkudata(L, 1, UD_SQL);
+  const char  *name = luaL_checkstring(L, 2);
+  lua_Integer nargs = -1;
+  sqlfunc_s   *F;
+  int rc;
+  CONCHECK(L, D);
+
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 5)) luaL_checktype(L, 5, LUA_TTABLE);
+  optint(L, 5, "nargs", &nargs);
+
+  F  = fnnew(L, 3, 4);
+  rc = sqlite3_create_function_v2(D->conn, name, (int) nargs, fnflags(L, 5), F,
+                                  NULL, fnstep, fnfinal, fnfree);
+  return fnreturn(L, D, rc);
+}
+
+
+/*
+ * Queues the query to the workers of the database, returning the handle
+ * of its result. The values of the table at 3 are applied as
+ * run() does, positional ones from its array and named ones from its
+ * fields.
+ */
+Lua
+wax_sql_async(lua_State *L) {
+  waxSql      *D   = luaL_checkudata(L, 1, UD_SQL);
+  const char  *sql = luaL_checkstring(L, 2);
+  waxSqlAsync *A;
+  sqljob_s    *J;
+  CONCHECK(L, D);
+
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  if (!sqlite3_threadsafe()) {
+    lua_pushnil(L);
+    lua_pushstring(L, "SQLite built without threads");
+    return 2;
+  }
+  if (D->pool == NULL && (D->pool = poolnew(D)) == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, errno ? strerror(errno) : "async needs a database file");
+    return 2;
+  }
+
+  A = lua_newuserdata(L, sizeof(*A));
+  A->J = NULL;
+  luaL_getmetatable(L, UD_SQL_ASYNC);
+  lua_setmetatable(L, -2);
+
+  wLua_assert(L, (J = calloc(1, sizeof(*J))) != NULL, strerror(errno));
+  J->fd[0] = J->fd[1] = -1;
+  J->refs  = 1;
+  A->J     = J;
+  pthread_mutex_init(&J->mu, NULL);
+  wLua_assert(L, (J->sql = strdup(sql)) != NULL, strerror(errno));
+  asyncparams(L, J, 3);
+  wLua_assert(L, (J->cols  = wArr_new(*J->cols, 8)) != NULL, strerror(errno));
+  wLua_assert(L, (J->cells = wArr_new(*J->cells, 64)) != NULL, strerror(errno));
+  wLua_assert(L, pipe(J->fd) == 0, strerror(errno));
+  fcntl(J->fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(J->fd[1], F_SETFD, FD_CLOEXEC);
+
+  /* without any worker the query runs now */
+  J->refs = 2;
+  if (!poolpush(D->pool, J)) {
+    sqlite3 *db = NULL;
+    asyncrun(D->pool, J, &db);
+    sqlite3_close(db);
+    jobdone(J);
+  }
+  return 1;
+}
+
+
+/* Descriptor readable when the query ends, for poll() and select() */
+Lua
+wax_sql_asfd(lua_State *L) {
+  waxSqlAsync *A = luaL_checkudata(L, 1, UD_SQL_ASYNC);
+  lua_pushinteger(L, A->J->fd[0]);
+  return 1;
+}
+
+
+Lua
+wax_sql_asready(lua_State *L) {
+  waxSqlAsync *A = luaL_checkudata(L, 1, UD_SQL_ASYNC);
+  pthread_mutex_lock(&A->J->mu);
+  lua_pushboolean(L, A->J->done);
+  pthread_mutex_unlock(&A->J->mu);
+  return 1;
+}
+
+
+/* Blocks until the query ends and returns its result */
+Lua
+wax_sql_aswait(lua_State *L) {
+  waxSqlAsync *A = luaL_checkudata(L, 1, UD_SQL_ASYNC);
+  struct pollfd p;
+
+  p.fd     = A->J->fd[0];
+  p.events = POLLIN;
+  while (poll(&p, 1, -1) < 0 && errno == EINTR);
+  return wax_sql_asresult(L);
+}
+
+
+/*
+ * Returns the rows of an ended query, as "hash" or "array" tables, and
+ * the number of rows it changed. Before it ends returns nil and
+ * "pending", on errors nil and the message.
+ */
+Lua
+wax_sql_asresult(lua_State *L) {
+  static const char *const modes[] = { "hash", "array", NULL };
+  waxSqlAsync *A = luaL_checkudata(L, 1, UD_SQL_ASYNC);
+  sqljob_s    *J = A->J;
+  int array = luaL_checkoption(L, 2, "hash", modes) == 1;
+  int done, ncols, nrows, r, c;
+  sqlcell_s *C;
+
+  pthread_mutex_lock(&J->mu);
+  done = J->done;
+  pthread_mutex_unlock(&J->mu);
+
+  if (!done || J->err != NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, done ? J->err : "pending");
+    return 2;
+  }
+  lua_settop(L, 1);
+  ncols = (int) wArr_len(J->cols);
+  nrows = ncols > 0 ? (int) (wArr_len(J->cells) / ncols) : 0;
+
+  lua_createtable(L, ncols, 0);   /* column names, at 2 */
+  for (c = 0; c < ncols; c++) {
+    lua_pushstring(L, J->cols[c]);
+    lua_rawseti(L, 2, c + 1);
+  }
+  lua_createtable(L, nrows, 0);
+  for (r = 0; r < nrows; r++) {
+    C = J->cells + (size_t) r * ncols;
+    if (array) {
+      lua_createtable(L, ncols, 0);
+      for (c = 0; c < ncols; c++) {
+        pushcell(L, &C[c]);
+        lua_rawseti(L, -2, c + 1);
+      }
+    } else {
+      /* last to first, so the first of repeated names wins, as pushrow() */
+      lua_createtable(L, 0, ncols);
+      for (c = ncols - 1; c >= 0; c--) {
+        lua_rawgeti(L, 2, c + 1);
+        pushcell(L, &C[c]);
+        lua_rawset(L, -3);
+      }
+    }
+    lua_rawseti(L, -2, r + 1);
+  }
+  lua_pushinteger(L, J->changes);
+  return 2;
+}
+
+
+/* Pushes the value of a cell of the query result */
+static void pushcell(lua_State *L, sqlcell_s *C) {
+  switch (C->type) {
+    case SQLITE_INTEGER: lua_pushinteger(L, (lua_Integer) C->i); break;
+    case SQLITE_FLOAT:   lua_pushnumber(L, C->d);                break;
+    case SQLITE_NULL:    lua_pushlightuserdata(L, &wax_sql_null); break;
+    default:             lua_pushlstring(L, C->s, C->len);
+  }
+}
+
+
+/* A queued or running query goes on, it is released by the pool */
+Lua
+wax_sql_asfree(lua_State *L) {
+  waxSqlAsync *A = luaL_checkudata(L, 1, UD_SQL_ASYNC);
+  if (A->J != NULL) jobrelease(A->J);
+  A->J = NULL;
+  return 0;
+}
+
+
 Lua
 wax_sql_version(lua_State *L) {
   if (SQLITE_VERSION_NUMBER != sqlite3_libversion_number()) {
@@ -453,24 +1139,853 @@ char *sqltrim(const char *in, int *trimmed) {
 }
 
 
+/*
+ * Options from the table at `t` when given. A value of a wrong type is
+ * a misuse and throws an error.
+ */
+static int optbool(lua_State *L, int t, const char *name) {
+  int v;
+  if (lua_isnoneornil(L, t)) return 0;
+  lua_getfield(L, t, name);
+  if (!lua_isnil(L, -1) && !lua_isboolean(L, -1))
+    luaL_error(L, "option %s must be a boolean", name);
+  v = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return v;
+}
+
+
+/* Returns 1 and sets `v` when the integer option is given */
+static int optint(lua_State *L, int t, const char *name, lua_Integer *v) {
+  lua_Number n;
+  if (lua_isnoneornil(L, t)) return 0;
+  lua_getfield(L, t, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  n = lua_tonumber(L, -1);
+  if (lua_type(L, -1) != LUA_TNUMBER || !is_int(n))
+    luaL_error(L, "option %s must be an integer", name);
+  *v = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/* Index of the option in `list`, given by name or index, or -1 */
+static int optenum(lua_State *L, int t, const char *name, const char *const list[]) {
+  lua_Integer i = -1;
+  int n;
+
+  for (n = 0; list[n] != NULL; n++);
+  if (lua_isnoneornil(L, t)) return -1;
+  lua_getfield(L, t, name);
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    for (i = n - 1; i >= 0 && strcmp(list[i], lua_tostring(L, -1)) != 0; i--);
+  } else if (lua_type(L, -1) == LUA_TNUMBER) {
+    i = is_int(lua_tonumber(L, -1)) ? lua_tointeger(L, -1) : n;
+  } else if (!lua_isnil(L, -1)) {
+    i = n;
+  }
+  if (i < -1 || i >= n || (i == -1 && !lua_isnil(L, -1)))
+    luaL_error(L, "invalid option %s", name);
+  lua_pop(L, 1);
+  return (int) i;
+}
+
+
+/*
+ * Prepares the statement, pushing it or nil and the error message.
+ * Returns the number of values pushed.
+ */
+static int stmtprep(lua_State *L, waxSql *D, const char *sql) {
+  int i = 1;
+  int bpos;
+  const char *name;
+  waxSqlStmt *S = lua_newuserdata(L, sizeof(*S));
+  S->S        = NULL;
+  S->err      = NULL;
+  S->tick     = 0;
+  S->namesref = LUA_NOREF;
+  S->array    = 0;
+  S->done     = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(D->conn, sql, -1, &S->S, NULL))
+    goto Error;
+
+  S->btype = STMT_PANON;
+  S->bpos  = 0;
+  S->cols  = -1;
+  luaL_getmetatable(L,UD_SQL_STMT);
+  lua_setmetatable(L,-2);
+
+  bpos = sqlite3_bind_parameter_count(S->S);
+  name = bpos > 0 ? sqlite3_bind_parameter_name(S->S, i) : NULL;
+
+  if (is_name_param(name)) {
+
+    S->bnames = wArr_new(*S->bnames, 4);
+    S->btype  = STMT_PNAME;
+    wArr_push(S->bnames, (const char *) &name[1]);
+
+    for (i=2; i <= bpos; i++) {
+      name = sqlite3_bind_parameter_name(S->S, i);
+      wLua_assert(L,is_name_param(name), "Mixes named and unamed parameters");
+      wLua_assert(L,
+                 wArr_push(S->bnames, (const char *) &name[1]),
+                 strerror(errno));
+    }
+
+  } else {
+
+    for (i=1; i <= bpos; i++) {
+      name = sqlite3_bind_parameter_name(S->S, i);
+      wLua_assert(L, !is_name_param(name), "Mixes unamed and named parameters");
+    }
+
+    S->bpos = bpos;
+
+  }
+  return 1;
+
+  Error:
+    sqlite3_finalize(S->S);
+    S->S = NULL;
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(D->conn));
+    return 2;
+}
+
+
+/* Finalizes the statement, returning the SQLite result code */
+static int stmtfinal(lua_State *L, waxSqlStmt *S) {
+  int rc;
+  if (S->btype == STMT_PNAME) wArr_clear(S->bnames);
+  luaL_unref(L, LUA_REGISTRYINDEX, S->namesref);
+  S->namesref = LUA_NOREF;
+  rc = sqlite3_finalize(S->S);
+  S->S = NULL;
+  return rc;
+}
+
+
+/*
+ * Removes the least recently used statements of the cache until `keep`
+ * are left. Statements held by Lua stay usable, the others are
+ * finalized by the garbage collector.
+ */
+static void cacheevict(lua_State *L, waxSql *D, int keep) {
+  waxSqlStmt *S, *old;
+  int t = lua_gettop(L) + 1;
+
+  if (D->cacheref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, D->cacheref);
+
+  for (; D->cached > keep; D->cached--) {
+    old = NULL;
+    lua_pushnil(L);  /* the oldest statement */
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+      S = lua_type(L, -2) == LUA_TUSERDATA ? lua_touserdata(L, -2) : NULL;
+      if (S != NULL && (old == NULL || S->tick < old->tick)) {
+        old = S;
+        lua_pushvalue(L, -2);
+        lua_replace(L, t + 1);
+      }
+      lua_pop(L, 1);
+    }
+    if (old == NULL) break;
+    old->tick = 0;
+    lua_pushvalue(L, t + 1);
+    lua_rawget(L, t);        /* its text */
+    lua_pushnil(L);
+    lua_rawset(L, t);
+    lua_pushnil(L);
+    lua_rawset(L, t);
+  }
+  lua_settop(L, t - 1);
+}
+
+
+/* Finalizes the statements of the cache as the connection closes */
+static void cachefree(lua_State *L, waxSql *D) {
+  waxSqlStmt *S;
+
+  if (D->cacheref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, D->cacheref);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    S = lua_type(L, -2) == LUA_TUSERDATA ? lua_touserdata(L, -2) : NULL;
+    if (S != NULL && S->S != NULL) stmtfinal(L, S);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, D->cacheref);
+  D->cacheref = LUA_NOREF;
+  D->cached   = 0;
+}
+
+
+/*
+ * Pushes the array of column names of the statement. The names are made
+ * Lua strings once, then every row reuses them as keys.
+ */
+static void stmtnames(lua_State *L, waxSqlStmt *S) {
+  int c;
+
+  if (S->namesref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, S->namesref);
+    return;
+  }
+  S->cols = sqlite3_column_count(S->S);
+  lua_createtable(L, S->cols, 0);
+  for (c = 0; c < S->cols; c++) {
+    lua_pushstring(L, sqlite3_column_name(S->S, c));
+    lua_rawseti(L, -2, c + 1);
+  }
+  lua_pushvalue(L, -1);
+  S->namesref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+/*
+ * Steps up to `max` rows of the statement into the array at `t`.
+ * Returns their number, or -1 on errors, that are kept for fetchok().
+ */
+static int fetchrows(lua_State *L, waxSqlStmt *S, int max, int t) {
+  int n = 0;
+  int rc;
+
+  if (S->cols < 0) {
+    stmtnames(L, S);
+    lua_pop(L, 1);
+  }
+  if (S->cols == 0 || S->done) return 0;
+
+  while (n < max) {
+    rc = sqlite3_step(S->S);
+    if (SQLITE_ROW != rc) {
+      S->done = 1;
+      steperror(S, rc);
+      return SQLITE_DONE == rc ? n : -1;
+    }
+    pushrow(L, S);
+    lua_rawseti(L, t, ++n);
+  }
+  S->err = "pending";
+  return n;
+}
+
+
+/*
+ * Keeps for fetchok() the result of the last step. SQLITE_ERROR has the
+ * message of the connection, as the one of a failed SQL function, that
+ * is copied as the next calls on the connection replace it.
+ */
+static void steperror(waxSqlStmt *S, int rc) {
+  if (rc == SQLITE_DONE) {
+    S->err = NULL;
+    return;
+  }
+  if (rc != SQLITE_ERROR) {
+    S->err = sqlite3_errstr(rc);
+    return;
+  }
+  snprintf(S->msg, sizeof(S->msg), "%s",
+           sqlite3_errmsg(sqlite3_db_handle(S->S)));
+  S->err = S->msg;
+}
+
+
+/* Pushes the current row as a table, by the mode of the statement */
+static void pushrow(lua_State *L, waxSqlStmt *S) {
+  int c;
+
+  if (S->array) {
+    lua_createtable(L, S->cols, 0);
+    for (c = 0; c < S->cols; c++) {
+      pushcolumn(L, S, c);
+      lua_rawseti(L, -2, c + 1);
+    }
+    return;
+  }
+  /* last to first, so the first of repeated names wins, as it always did */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, S->namesref);
+  lua_createtable(L, 0, S->cols);
+  for (c = S->cols - 1; c >= 0; c--) {
+    lua_rawgeti(L, -2, c + 1);
+    pushcolumn(L, S, c);
+    lua_rawset(L, -3);
+  }
+  lua_remove(L, -2);
+}
+
+
+/* Pushes the value of column `c` of the current row */
+static void pushcolumn(lua_State *L, waxSqlStmt *S, int c) {
+  const char *text;
+
+  switch(sqlite3_column_type(S->S, c)) {
+    case SQLITE_INTEGER:
+      lua_pushinteger(L, (lua_Integer) sqlite3_column_int64(S->S, c));
+      break;
+    case SQLITE_FLOAT:
+      lua_pushnumber(L, sqlite3_column_double(S->S, c));
+      break;
+    case SQLITE_NULL:
+      lua_pushlightuserdata(L, &wax_sql_null);
+      break;
+    default: /* for blob, text and others */
+      text = (const char *) sqlite3_column_text(S->S, c);
+      lua_pushlstring(L, text, sqlite3_column_bytes(S->S, c));
+  }
+}
+
+
+/*
+ * Keeps the Lua functions of an SQL function. SQLite calls them on the
+ * main thread of the state, as the coroutine that registered them may
+ * be suspended or dead by then.
+ */
+static sqlfunc_s *fnnew(lua_State *L, int step, int final) {
+  sqlfunc_s *F = malloc(sizeof(*F));
+  wLua_assert(L, F != NULL, strerror(errno));
+
+  #if LUA_VERSION_NUM >= 502
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  F->L = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  F->threadref = LUA_NOREF;
+  #else
+  /* no way to reach the main thread, the caller is kept alive instead */
+  F->L = L;
+  lua_pushthread(L);
+  F->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
+  #endif
+
+  lua_pushvalue(L, step);
+  F->step = luaL_ref(L, LUA_REGISTRYINDEX);
+  F->final = LUA_NOREF;
+  if (final) {
+    lua_pushvalue(L, final);
+    F->final = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return F;
+}
+
+
+/* Called by SQLite when the function is replaced or the database closed */
+static void fnfree(void *fn) {
+  sqlfunc_s *F = fn;
+  luaL_unref(F->L, LUA_REGISTRYINDEX, F->step);
+  luaL_unref(F->L, LUA_REGISTRYINDEX, F->final);
+  luaL_unref(F->L, LUA_REGISTRYINDEX, F->threadref);
+  free(F);
+}
+
+
+static int fnflags(lua_State *L, int t) {
+  int flags = SQLITE_UTF8;
+  if (optbool(L, t, "deterministic")) flags |= SQLITE_DETERMINISTIC;
+  return flags;
+}
+
+
+/* SQLite already freed the function when its registration failed */
+static int fnreturn(lua_State *L, waxSql *D, int rc) {
+  if (SQLITE_OK != rc) {
+    lua_pushnil(L);
+    lua_pushstring(L, sqlite3_errmsg(D->conn));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static void fnscalar(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  sqlfunc_s *F = sqlite3_user_data(ctx);
+  lua_State *L = F->L;
+  int top = lua_gettop(L);
+
+  if (!lua_checkstack(L, argc + 1)) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, F->step);
+  pushvalues(L, argc, argv);
+  if (lua_pcall(L, argc, 1, 0) != 0)
+    fnerror(ctx, L);
+  else
+    fnresult(ctx, L);
+  lua_settop(L, top);
+}
+
+
+/*
+ * The state of a group lives in the registry. Its aggregate context is
+ * zeroed by SQLite and luaL_ref never returns 0, so 0 is no state yet.
+ */
+static void fnstep(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  sqlfunc_s *F = sqlite3_user_data(ctx);
+  sqlagg_s  *A = sqlite3_aggregate_context(ctx, sizeof(*A));
+  lua_State *L = F->L;
+  int top = lua_gettop(L);
+
+  if (A == NULL || !lua_checkstack(L, argc + 2)) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if (A->failed) return;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, F->step);
+  if (A->ref != 0) lua_rawgeti(L, LUA_REGISTRYINDEX, A->ref);
+  else             lua_pushnil(L);
+  pushvalues(L, argc, argv);
+
+  if (lua_pcall(L, argc + 1, 1, 0) != 0) {
+    A->failed = 1;
+    fnerror(ctx, L);
+  } else {
+    if (A->ref != 0) luaL_unref(L, LUA_REGISTRYINDEX, A->ref);
+    A->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_settop(L, top);
+}
+
+
+/* Also called after a failed step, then only to free the state */
+static void fnfinal(sqlite3_context *ctx) {
+  sqlfunc_s *F = sqlite3_user_data(ctx);
+  sqlagg_s  *A = sqlite3_aggregate_context(ctx, 0);
+  lua_State *L = F->L;
+  int top = lua_gettop(L);
+
+  if (!lua_checkstack(L, 2)) {
+    sqlite3_result_error_nomem(ctx);
+  } else if (A == NULL || !A->failed) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, F->final);
+    if (A != NULL && A->ref != 0) lua_rawgeti(L, LUA_REGISTRYINDEX, A->ref);
+    else                          lua_pushnil(L);
+    if (lua_pcall(L, 1, 1, 0) != 0)
+      fnerror(ctx, L);
+    else
+      fnresult(ctx, L);
+  }
+  if (A != NULL && A->ref != 0) luaL_unref(L, LUA_REGISTRYINDEX, A->ref);
+  lua_settop(L, top);
+}
+
+
+/* Pushes the arguments of a function as pushcolumn() pushes columns */
+static void pushvalues(lua_State *L, int argc, sqlite3_value **argv) {
+  const char *text;
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    switch(sqlite3_value_type(argv[i])) {
+      case SQLITE_INTEGER:
+        lua_pushinteger(L, (lua_Integer) sqlite3_value_int64(argv[i]));
+        break;
+      case SQLITE_FLOAT:
+        lua_pushnumber(L, sqlite3_value_double(argv[i]));
+        break;
+      case SQLITE_NULL:
+        lua_pushlightuserdata(L, &wax_sql_null);
+        break;
+      default: /* for blob, text and others */
+        text = (const char *) sqlite3_value_text(argv[i]);
+        lua_pushlstring(L, text, sqlite3_value_bytes(argv[i]));
+    }
+  }
+}
+
+
+/* Sets the value at the top as result, as bindvalue() binds values */
+static void fnresult(sqlite3_context *ctx, lua_State *L) {
+  sqlite3_int64 i;
+  size_t len;
+  const char *text;
+
+  switch (lua_type(L, -1)) {
+    case LUA_TNUMBER:
+      if (toint64(L, -1, &i))
+        sqlite3_result_int64(ctx, i);
+      else
+        sqlite3_result_double(ctx, lua_tonumber(L, -1));
+      break;
+
+    case LUA_TSTRING:
+      text = lua_tolstring(L, -1, &len);
+      sqlite3_result_text(ctx, text, (int) len, SQLITE_TRANSIENT);
+      break;
+
+    case LUA_TNIL:
+      sqlite3_result_null(ctx);
+      break;
+
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, -1) == &wax_sql_null) {
+        sqlite3_result_null(ctx);
+        break;
+      }
+      /* FALLTHROUGH */
+
+    default:
+      sqlite3_result_error(ctx, "Invalid type of function result", -1);
+  }
+}
+
+
+static void fnerror(sqlite3_context *ctx, lua_State *L) {
+  const char *msg = lua_tostring(L, -1);
+  sqlite3_result_error(ctx, msg != NULL ? msg : "error in Lua function", -1);
+}
+
+
+/*
+ * Pool of workers of the database file, with its flags and busy timeout.
+ * Fails for databases in memory. Read-only databases get read-only
+ * connections.
+ */
+static sqlpool_s *poolnew(waxSql *D) {
+  const char   *path = sqlite3_db_filename(D->conn, "main");
+  sqlite3_stmt *st;
+  sqlpool_s    *P;
+
+  errno = 0;
+  if (path == NULL || path[0] == '\0') return NULL;
+  if ((P = calloc(1, sizeof(*P))) == NULL) return NULL;
+  if ((P->path = strdup(path)) == NULL) {
+    free(P);
+    return NULL;
+  }
+  P->flags = (sqlite3_db_readonly(D->conn, "main") == 1
+              ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE)
+           | SQLITE_OPEN_NOMUTEX;
+  if (SQLITE_OK == sqlite3_prepare_v2(D->conn, "PRAGMA busy_timeout", -1, &st, NULL)) {
+    if (SQLITE_ROW == sqlite3_step(st)) P->busy = sqlite3_column_int(st, 0);
+    sqlite3_finalize(st);
+  }
+  pthread_mutex_init(&P->mu, NULL);
+  pthread_cond_init(&P->cond, NULL);
+  return P;
+}
+
+
+/*
+ * Queues a job, starting a worker when the idle ones are fewer than the
+ * queued jobs. Returns 0, leaving the job out, when no worker could ever
+ * be started.
+ */
+static int poolpush(sqlpool_s *P, sqljob_s *J) {
+  pthread_mutex_lock(&P->mu);
+  if (P->queued >= P->idle && P->nworkers < ASYNC_WORKERS
+   && pthread_create(&P->workers[P->nworkers], NULL, asyncwork, P) == 0)
+    P->nworkers++;
+
+  if (P->nworkers == 0) {
+    pthread_mutex_unlock(&P->mu);
+    return 0;
+  }
+  J->next = NULL;
+  if (P->tail != NULL) P->tail->next = J;
+  else                 P->head = J;
+  P->tail = J;
+  P->queued++;
+  pthread_cond_signal(&P->cond);
+  pthread_mutex_unlock(&P->mu);
+  return 1;
+}
+
+
+/*
+ * Closing the database fails the queued jobs and waits the running ones,
+ * so no worker runs code of the module after it is collected.
+ */
+static void poolfree(sqlpool_s *P) {
+  sqljob_s *J;
+  int i;
+
+  pthread_mutex_lock(&P->mu);
+  P->closing = 1;
+  while ((J = P->head) != NULL) {
+    P->head = J->next;
+    joberror(J, "closed connection");
+    jobdone(J);
+  }
+  P->tail   = NULL;
+  P->queued = 0;
+  pthread_cond_broadcast(&P->cond);
+  pthread_mutex_unlock(&P->mu);
+
+  for (i = 0; i < P->nworkers; i++) pthread_join(P->workers[i], NULL);
+  pthread_cond_destroy(&P->cond);
+  pthread_mutex_destroy(&P->mu);
+  free(P->path);
+  free(P);
+}
+
+
+/* Tells the handle the query ended, dropping the reference of the pool */
+static void jobdone(sqljob_s *J) {
+  pthread_mutex_lock(&J->mu);
+  J->done = 1;
+  pthread_mutex_unlock(&J->mu);
+  while (write(J->fd[1], "", 1) < 0 && errno == EINTR);
+  jobrelease(J);
+}
+
+
+static void jobrelease(sqljob_s *J) {
+  size_t i;
+  int last;
+
+  pthread_mutex_lock(&J->mu);
+  last = --J->refs == 0;
+  pthread_mutex_unlock(&J->mu);
+  if (!last) return;
+
+  if (J->params != NULL) {
+    for (i = 0; i < wArr_len(J->params); i++) {
+      free(J->params[i].s);
+      free(J->params[i].name);
+    }
+    wArr_free(J->params);
+  }
+  if (J->cols != NULL) {
+    for (i = 0; i < wArr_len(J->cols); i++) free(J->cols[i]);
+    wArr_free(J->cols);
+  }
+  if (J->cells != NULL) {
+    for (i = 0; i < wArr_len(J->cells); i++) free(J->cells[i].s);
+    wArr_free(J->cells);
+  }
+  if (J->fd[0] >= 0) close(J->fd[0]);
+  if (J->fd[1] >= 0) close(J->fd[1]);
+  pthread_mutex_destroy(&J->mu);
+  free(J->sql);
+  free(J->err);
+  free(J);
+}
+
+
+/* Keeps the first error of the query */
+static void joberror(sqljob_s *J, const char *msg) {
+  if (J->err == NULL) J->err = strdup(msg != NULL ? msg : "not enough memory");
+}
+
+
+/*
+ * Copies the values of the table at `t` to cells: the items of its array
+ * part as positional values, then its string keys as named ones.
+ */
+static int asyncparams(lua_State *L, sqljob_s *J, int t) {
+  sqlcell_s C;
+  int i, n;
+
+  wLua_assert(L, (J->params = wArr_new(*J->params, 8)) != NULL, strerror(errno));
+  if (lua_isnil(L, t)) return 0;
+
+  n = (int) wLua_rawlen(L, t);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, t, i);
+    asynccell(L, &C, i);
+    lua_pop(L, 1);
+    wLua_assert(L, wArr_push(J->params, C), strerror(errno));
+  }
+  J->npos = n;
+
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      asynccell(L, &C, 0);
+      wLua_assert(L, wArr_push(J->params, C), strerror(errno));
+      C.name = strdup(lua_tostring(L, -2));
+      J->params[wArr_len(J->params) - 1].name = C.name;
+      wLua_assert(L, C.name != NULL, strerror(errno));
+    }
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+
+/* Copies the value at `idx` to a cell, with the types of bindvalue() */
+static int asynccell(lua_State *L, sqlcell_s *C, int pos) {
+  memset(C, 0, sizeof(*C));
+  switch (lua_type(L, -1)) {
+    case LUA_TNUMBER:
+      if (toint64(L, -1, &C->i)) {
+        C->type = SQLITE_INTEGER;
+      } else {
+        C->type = SQLITE_FLOAT;
+        C->d    = lua_tonumber(L, -1);
+      }
+      break;
+
+    case LUA_TSTRING:
+      C->type = SQLITE_TEXT;
+      C->len  = (int) wLua_rawlen(L, -1);
+      C->s    = malloc(C->len + 1);
+      wLua_assert(L, C->s != NULL, strerror(errno));
+      memcpy(C->s, lua_tostring(L, -1), C->len + 1);
+      break;
+
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, -1) == &wax_sql_null) {
+        C->type = SQLITE_NULL;
+        break;
+      }
+      /* FALLTHROUGH */
+
+    default:
+      if (pos > 0) return luaL_error(L, "Invalid type for field %d", pos);
+      return luaL_error(L, "Wrong value type for named parameter %s",
+                        lua_tostring(L, -2));
+  }
+  return 0;
+}
+
+
+/* Binds the cells of the job to the statement, SQLITE_OK on success */
+static int asyncbind(sqljob_s *J, sqlite3_stmt *st) {
+  int i, k, n = sqlite3_bind_parameter_count(st), rc = SQLITE_OK;
+  int len = (int) wArr_len(J->params);
+  const char *name;
+  sqlcell_s *C;
+
+  for (i = 1; i <= n && rc == SQLITE_OK; i++) {
+    name = sqlite3_bind_parameter_name(st, i);
+    C    = NULL;
+    if (is_name_param(name)) {
+      for (k = J->npos; k < len && C == NULL; k++)
+        if (strcmp(J->params[k].name, &name[1]) == 0) C = &J->params[k];
+    } else if (i <= J->npos) {
+      C = &J->params[i - 1];
+    }
+    if (C == NULL) {
+      joberror(J, "Insufficient values for statement");
+      return SQLITE_MISUSE;
+    }
+    switch (C->type) {
+      case SQLITE_INTEGER: rc = sqlite3_bind_int64(st, i, C->i);  break;
+      case SQLITE_FLOAT:   rc = sqlite3_bind_double(st, i, C->d); break;
+      case SQLITE_NULL:    rc = sqlite3_bind_null(st, i);         break;
+      default: rc = sqlite3_bind_text(st, i, C->s, C->len, SQLITE_STATIC);
+    }
+  }
+  return rc;
+}
+
+
+/* Steps the statement, copying the rows, SQLITE_DONE on success */
+static int asyncrows(sqljob_s *J, sqlite3_stmt *st) {
+  int c, n = sqlite3_column_count(st), rc;
+  const char *s;
+  sqlcell_s C;
+
+  for (c = 0; c < n; c++) {
+    s = sqlite3_column_name(st, c);
+    if (!wArr_push(J->cols, strdup(s)) || J->cols[c] == NULL) return SQLITE_NOMEM;
+  }
+  while (SQLITE_ROW == (rc = sqlite3_step(st))) {
+    for (c = 0; c < n; c++) {
+      memset(&C, 0, sizeof(C));
+      switch (C.type = sqlite3_column_type(st, c)) {
+        case SQLITE_INTEGER: C.i = sqlite3_column_int64(st, c);  break;
+        case SQLITE_FLOAT:   C.d = sqlite3_column_double(st, c); break;
+        case SQLITE_NULL:    break;
+        default: /* for blob, text and others */
+          C.type = SQLITE_TEXT;
+          s      = (const char *) sqlite3_column_text(st, c);
+          C.len  = sqlite3_column_bytes(st, c);
+          if ((C.s = malloc(C.len + 1)) == NULL) return SQLITE_NOMEM;
+          memcpy(C.s, s != NULL ? s : "", C.len);
+          C.s[C.len] = '\0';
+      }
+      if (!wArr_push(J->cells, C)) {
+        free(C.s);
+        return SQLITE_NOMEM;
+      }
+    }
+  }
+  return rc;
+}
+
+
+/* Worker of a pool, keeping its connection from job to job */
+static void *asyncwork(void *pool) {
+  sqlpool_s *P  = pool;
+  sqlite3   *db = NULL;
+  sqljob_s  *J;
+
+  pthread_mutex_lock(&P->mu);
+  for (;;) {
+    while (P->head == NULL && !P->closing) {
+      P->idle++;
+      pthread_cond_wait(&P->cond, &P->mu);
+      P->idle--;
+    }
+    if ((J = P->head) == NULL) break;
+    if ((P->head = J->next) == NULL) P->tail = NULL;
+    P->queued--;
+    pthread_mutex_unlock(&P->mu);
+
+    asyncrun(P, J, &db);
+    jobdone(J);
+    pthread_mutex_lock(&P->mu);
+  }
+  pthread_mutex_unlock(&P->mu);
+  sqlite3_close(db);
+  return NULL;
+}
+
+
+/* Runs a job on `db`, opened to the file of the pool when NULL */
+static void asyncrun(sqlpool_s *P, sqljob_s *J, sqlite3 **db) {
+  sqlite3_stmt *st = NULL;
+  int rc, total;
+
+  if (*db == NULL) {
+    rc = sqlite3_open_v2(P->path, db, P->flags, NULL);
+    if (SQLITE_OK == rc && P->busy > 0) rc = sqlite3_busy_timeout(*db, P->busy);
+    if (SQLITE_OK != rc) {
+      joberror(J, *db != NULL ? sqlite3_errmsg(*db) : sqlite3_errstr(rc));
+      sqlite3_close(*db);
+      *db = NULL;
+      return;
+    }
+  }
+
+  /* connections are reused, changes of earlier queries are left on them */
+  total = sqlite3_total_changes(*db);
+  if (SQLITE_OK   != (rc = sqlite3_prepare_v2(*db, J->sql, -1, &st, NULL))
+   || SQLITE_OK   != (rc = asyncbind(J, st))
+   || SQLITE_DONE != (rc = asyncrows(J, st)))
+    joberror(J, rc == SQLITE_NOMEM ? NULL : sqlite3_errmsg(*db));
+  else if (!sqlite3_stmt_readonly(st) && sqlite3_total_changes(*db) != total)
+    J->changes = sqlite3_changes(*db);
+  sqlite3_finalize(st);
+}
+
+
 /* return SQLITE_OK on success */
-static int bindnames(waxSqlStmt *S, lua_State *L) {
+static int bindnames(waxSqlStmt *S, lua_State *L, int t) {
   int rc = SQLITE_OK;
   int i;
-  double number;
   lua_pushnil(L);
 
-  if (lua_type(L,2) != LUA_TTABLE)
+  if (lua_type(L,t) != LUA_TTABLE)
     luaL_error(L,"Named parameters require a record table with values");
 
   for (i = wArr_len(S->bnames); i > 0; i--) {
-    lua_getfield(L, 2, S->bnames[i-1]);
+    lua_getfield(L, t, S->bnames[i-1]);
     switch(lua_type(L,-1)) {
       case LUA_TNUMBER:
-        number = luaL_checknumber(L,-1);
-        rc = is_int(number)
-          ? sqlite3_bind_int(S->S, i, (int) number)
-          : sqlite3_bind_double(S->S, i, number);
+        rc = bindnumber(S->S, L, -1, i);
         break;
 
       case LUA_TSTRING:
@@ -482,7 +1997,8 @@ static int bindnames(waxSqlStmt *S, lua_State *L) {
         break;
 
       default:
-        return luaL_error(L, "Wrong value type for named parameter %q", S->bnames[i]);
+        return luaL_error(L, "Wrong value type for named parameter %s",
+                          S->bnames[i-1]);
     }
     lua_pop(L,1);
     if (rc != SQLITE_OK)
@@ -497,35 +2013,87 @@ static int bindpos(waxSqlStmt *S, lua_State *L) {
   int lua_arg = lua_gettop(L);
   int sql_arg = lua_arg -1;
   int rc = SQLITE_OK;
-  double number;
   
   wLua_assert(L,sql_arg >= S->bpos, /* -1 to not count the userdata first parameter */
              "Insufficient values for statement");
   
-  for( ; lua_arg > 1; lua_arg--, sql_arg-- ) {
-    switch( lua_type(L, lua_arg) ) {
-      case LUA_TNUMBER:
-        number = luaL_checknumber(L, lua_arg);
-        if ( is_int(number) )
-          rc = sqlite3_bind_int(S->S, sql_arg, (int) number);
-        else
-          rc = sqlite3_bind_double(S->S, sql_arg, number);
-        break;
+  for( ; lua_arg > 1; lua_arg--, sql_arg-- )
+    rc = bindvalue(S, L, lua_arg, sql_arg);
+  return rc;
+}
 
-      case LUA_TSTRING:
-        rc = sqlite3_bind_text(S->S, sql_arg, luaL_checkstring(L,lua_arg), -1, SQLITE_TRANSIENT);
-        break;
 
-      case LUA_TLIGHTUSERDATA:
-        if (lua_touserdata(L, lua_arg) != &wax_sql_null)
-          return luaL_error(L, "Invalid type for field %d", sql_arg);
-        rc = sqlite3_bind_null(S->S, sql_arg);
-        break;
-      
-      default:
-        return luaL_error(L, "Invalid type for field %d", sql_arg);
-    }
-    if (rc != SQLITE_OK) return luaL_error(L, sqlite3_errstr(rc));
+/* Binds the anonymous parameters to the items of the array at `t` */
+static int bindarray(waxSqlStmt *S, lua_State *L, int t) {
+  int rc = SQLITE_OK;
+  int i;
+
+  wLua_assert(L, (int) wLua_rawlen(L, t) >= S->bpos,
+             "Insufficient values for statement");
+
+  for (i = 1; i <= S->bpos; i++) {
+    lua_rawgeti(L, t, i);
+    rc = bindvalue(S, L, lua_gettop(L), i);
+    lua_pop(L, 1);
+  }
+  return rc;
+}
+
+
+/* Integers are bound as 64 bits ones, exactly when Lua has them */
+static int bindnumber(sqlite3_stmt *st, lua_State *L, int idx, int pos) {
+  sqlite3_int64 i;
+
+  if (toint64(L, idx, &i)) return sqlite3_bind_int64(st, pos, i);
+  return sqlite3_bind_double(st, pos, lua_tonumber(L, idx));
+}
+
+
+/*
+ * Gets the number at `idx` as an integer when Lua has it as one or it
+ * is a whole float in the 64 bits range, [-2^63, 2^63). Returns 0 for
+ * the other numbers, that are kept as doubles.
+ */
+static int toint64(lua_State *L, int idx, sqlite3_int64 *i) {
+  double number;
+
+  #if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, idx)) {
+    *i = (sqlite3_int64) lua_tointeger(L, idx);
+    return 1;
+  }
+  #endif
+  number = lua_tonumber(L, idx);
+  if (!is_int(number) || number <  -9223372036854775808.0
+                      || number >=  9223372036854775808.0)
+    return 0;
+  *i = (sqlite3_int64) number;
+  return 1;
+}
+
+
+/* Binds the value at `idx` to the parameter `pos`, SQLITE_OK on success */
+static int bindvalue(waxSqlStmt *S, lua_State *L, int idx, int pos) {
+  int rc = SQLITE_OK;
+
+  switch( lua_type(L, idx) ) {
+    case LUA_TNUMBER:
+      rc = bindnumber(S->S, L, idx, pos);
+      break;
+
+    case LUA_TSTRING:
+      rc = sqlite3_bind_text(S->S, pos, luaL_checkstring(L,idx), -1, SQLITE_TRANSIENT);
+      break;
+
+    case LUA_TLIGHTUSERDATA:
+      if (lua_touserdata(L, idx) != &wax_sql_null)
+        return luaL_error(L, "Invalid type for field %d", pos);
+      rc = sqlite3_bind_null(S->S, pos);
+      break;
+
+    default:
+      return luaL_error(L, "Invalid type for field %d", pos);
   }
+  if (rc != SQLITE_OK) return luaL_error(L, "%s", sqlite3_errstr(rc));
   return rc;
 }
@@ -13,6 +13,9 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
 //| returning by functions (the pattern of double return).
 */
 
+#ifndef WAX_LUA_INCLUDED
+#define WAX_LUA_INCLUDED
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <string.h>
@@ -193,7 +196,7 @@ Copyright 2022-2023 - Thadeu de Paula and contributors
 //| The message can be informed like in printf, i.e, with `msg` containing
 //| the template to be filled by subsequent parameters.
 */
-void wLua_error(lua_State *L, char *fmt, ...) {
+static inline void wLua_error(lua_State *L, char *fmt, ...) {
   va_list va;
   char msg[1024];
   va_start(va, fmt);
@@ -262,3 +265,4 @@ void wLua_error(lua_State *L, char *fmt, ...) {
 #define wLua_failboolean(L, cond) \
   wLua_failboolean_m(L, cond, strerror(errno))
 
+#endif /* WAX_LUA_INCLUDED */
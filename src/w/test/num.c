@@ -0,0 +1,66 @@
+/*
+SPDX-License-Identifier: AGPL-3.0-or-later
+Copyright 2022-2023 - Thadeu de Paula and contributors
+*/
+#include "../num.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static double parse(const char *s, int kind) {
+  const char *p = s;
+  double d = 0;
+  long long i = 0;
+
+  assert(wNum_parse(&p, s + strlen(s), &d, &i) == kind);
+  return d;
+}
+
+
+static int test_parse() {
+  const char *s = "-12x";
+  double d;
+  long long i;
+
+  assert(wNum_parse(&s, s + 4, &d, &i) == WNUM_INT);
+  assert(i == -12 && *s == 'x');
+
+  assert(parse("0.1", WNUM_FLT) == 0.1);
+  assert(parse("1e400", WNUM_FLT) > 1.7976931348623157e308);
+  assert(parse("4.9e-324", WNUM_FLT) == 4.9e-324);
+  assert(parse("1.7976931348623157e308", WNUM_FLT) == 1.7976931348623157e308);
+  assert(parse("9007199254740993", WNUM_INT) == 9007199254740992.0);
+  assert(parse("9223372036854775808", WNUM_FLT) == 9223372036854775808.0);
+  assert(parse("123456789012345678901234567890", WNUM_FLT) == 1.2345678901234568e29);
+  assert(parse("1.", WNUM_NONE) == 0);
+  assert(parse("-", WNUM_NONE) == 0);
+  assert(parse("1e+", WNUM_NONE) == 0);
+  return 0;
+}
+
+
+static int test_print() {
+  char buf[WNUM_BUFSZ];
+
+  wNum_dtoa(0.1, buf);     assert(strcmp(buf, "0.1") == 0);
+  wNum_dtoa(1.0/3, buf);   assert(strcmp(buf, "0.3333333333333333") == 0);
+  wNum_dtoa(1e21, buf);    assert(strcmp(buf, "1e+21") == 0);
+  wNum_dtoa(1e20, buf);    assert(strcmp(buf, "100000000000000000000") == 0);
+  wNum_dtoa(1e-7, buf);    assert(strcmp(buf, "1e-7") == 0);
+  wNum_dtoa(-1.5e-6, buf); assert(strcmp(buf, "-0.0000015") == 0);
+  wNum_dtoa(5e-324, buf);  assert(strcmp(buf, "5e-324") == 0);
+
+  wNum_itoa(-9223372036854775807LL - 1, buf);
+  assert(strcmp(buf, "-9223372036854775808") == 0);
+  wNum_itoa(0, buf);       assert(strcmp(buf, "0") == 0);
+
+  return 0;
+}
+
+
+int main() {
+  test_parse();
+  test_print();
+  return 0;
+}
@@ -15,12 +15,59 @@ do
 local res = json.encode { 10, true, { a="hi" }, 1/0, json.null}
 assert( res == '[10,true,{"a":"hi"},null,null]')
 
+-- errors in the middle of encoding release the call memory
+assert(not pcall(json.encode, { 1, { a = function() end } }))
+assert(json.encode { 1, { a = 2 } } == '[1,{"a":2}]')
 end
 
---$ json.decode( jsonstr: string) : table
+--| Numbers are written with the shortest digits that are decoded
+--| back to the same value, independent of the C locale.
+do
+--{
+assert(json.encode {0.1, 1/3, -1.5e-10, 1e21, 2^40}
+  == '[0.1,0.3333333333333333,-1.5e-10,1e+21,1099511627776]')
+--}
+for _, n in ipairs {0.1, 1/3, 2^-1074, 1.7976931348623157e308, 5e-324, 123.456} do
+  assert(json.decode(json.encode {n})[1] == n)
+end
+end
+
+--| On Lua 5.3 and later integers keep all their 64 bits, so big IDs
+--| don't need to be carried as strings.
+if math.type then
+--{
+local ids = json.decode '[9007199254740993, -9223372036854775808, 1.0]'
+assert(ids[1] == 9007199254740993 and math.type(ids[1]) == 'integer')
+assert(ids[2] == math.mininteger)
+assert(math.type(ids[3]) == 'float')
+assert(json.encode {math.maxinteger, 9007199254740993}
+  == '[9223372036854775807,9007199254740993]')
+--}
+end
+
+--$ json.canonical(value: any, hash: boolean?) : string, string?
+--| Encodes `value` as `json.encode`, with the keys of the objects sorted
+--| by their bytes, so equal tables always give the same text. With `hash`
+--| also returns the XXH64 of the text as 16 hex digits, to be used as the
+--| key of caches.
+do
+--{
+local text, hash = json.canonical({ b = 1, a = { 2, { d = 3, c = 4 } } }, true)
+assert(text == '{"a":[2,{"c":4,"d":3}],"b":1}')
+assert(hash == select(2, json.canonical({ a = { 2, { c = 4, d = 3 } }, b = 1 }, true)))
+--}
+assert(#hash == 16)
+assert(select(2, json.canonical("abc", true)) == "b1eecd3f6492c244")
+assert(json.canonical { ["\0"] = 1, A = 2, a = 3, ab = 4 }
+  == [[{"\u0000":1,"A":2,"a":3,"ab":4}]])
+assert(not pcall(json.canonical, { a = { [2.5] = 1 } }))
+end
+
+--$ json.decode( jsonstr: string) : table | nil, string
 --| Convert the `jsonstr` string into a Lua table.
 --| Every non array or object is converted to respective Lua
---| counterpart:
+--| counterpart. On invalid JSON returns `nil` and a message
+--| with the offset of the error:
 do
 --{
 assert(json.decode[["hi"]] == "hi")
@@ -29,6 +76,7 @@ assert(json.decode[[10.9]] == 10.9)
 assert(json.decode[[109]]  == 109)
 assert(json.decode[[true]] == true)
 assert(json.decode[[false]] == false)
+assert(select(2, json.decode[[{"a":}]]) == "unexpected character at offset 5")
 
 local object = json.decode([[{
   "str":"A string", "num":10.667, "int":70999,
@@ -44,6 +92,11 @@ assert(object.nul   == json.null)
 assert(#object.arr  == 2)
 assert(object.obj.k == "v")
 --}
+
+-- keys of same length, first and last bytes share a cache slot
+local recs = json.decode '[{"axb":1,"ayb":2,"":0},{"ayb":4,"axb":3,"":5}]'
+assert(recs[1].axb == 1 and recs[1].ayb == 2 and recs[1][""] == 0)
+assert(recs[2].axb == 3 and recs[2].ayb == 4 and recs[2][""] == 5)
 end
 
 
@@ -173,3 +226,548 @@ do
   assert(decoded.z == 10)
 end
 
+
+
+--$ json.decodefile(path: string) : any | nil, string
+--| Decodes the JSON file at `path` as `json.decode`, parsing it straight
+--| from a memory map instead of reading it to a Lua string first, so big
+--| files don't need a copy on the Lua heap. Pipes and other files that
+--| can't be mapped, as the ones on `/proc` that report no size, are read.
+--| On errors returns `nil` and a message.
+do
+--{
+  local name = os.tmpname()
+  local file = io.open(name, 'w')
+  file:write '{"planets": ["Mercury", "Venus", "Earth"]}'
+  file:close()
+
+  assert(json.decodefile(name).planets[3] == "Earth")
+  os.remove(name)
+
+  local ok, err = json.decodefile(name)
+  assert(ok == nil and type(err) == 'string')
+
+  if io.open '/proc/sys/kernel/pid_max' then
+    assert(type(json.decodefile '/proc/sys/kernel/pid_max') == 'number')
+  end
+--}
+end
+
+
+--$ json.decode_into(jsonstr: string, target: table) : table | nil, string
+--| Decodes the JSON object or array of `jsonstr` into the `target` table,
+--| returning it. Keys present in both are overwritten, keys missing from
+--| the JSON are cleared and nested tables of `target` are updated in place
+--| instead of being replaced, so decoding the same document again and
+--| again creates no new tables. A table reached twice in `target`, as a
+--| shared or cyclic one, is reused only once. Tables are accessed raw,
+--| ignoring metamethods.
+--|
+--| On invalid JSON, or a top level value that isn't an object or array,
+--| returns `nil` and a message and `target` is left untouched.
+do
+--{
+  local state = {}
+  json.decode_into('{"up": true, "disks": [{"free": 10}, {"free": 20}]}', state)
+  local disks, first = state.disks, state.disks[1]
+
+  json.decode_into('{"disks": [{"free": 5}], "load": 0.5}', state)
+  assert(state.disks == disks and state.disks[1] == first)
+  assert(first.free == 5 and #disks == 1 and disks[2] == nil)
+  assert(state.up == nil and state.load == 0.5)
+
+  local ok, err = json.decode_into('"text"', state)
+  assert(ok == nil and err == "expected object or array at offset 0")
+  assert(state.load == 0.5)
+--}
+
+  -- shared and cyclic tables get new ones where reached again
+  local s = {}
+  local u = { a = s, b = s }
+  u.self = u
+  json.decode_into('{"a":{"x":1},"b":{"y":2},"self":{"z":3}}', u)
+  assert(u.a == s and u.b ~= s and u.self ~= u)
+  assert(s.x == 1 and s.y == nil and u.b.y == 2 and u.self.z == 3)
+
+  -- other keys of objects and arrays are cleared, as are duplicates
+  local t = { [1] = 'x', [true] = 1, list = { 1, 2, [0] = 0, [1.5] = 1 } }
+  local list = t.list
+  json.decode_into('{"list":[3],"k":1,"k":2}', t)
+  assert(t.list == list and list[1] == 3 and next(list, 1) == nil)
+  assert(t[1] == nil and t[true] == nil and t.k == 2)
+
+  -- an object reuses an array table and the other way
+  json.decode_into('{"list":{"a":1},"k":[1]}', t)
+  assert(t.list == list and list.a == 1 and list[1] == nil and t.k[1] == 1)
+end
+
+
+--$ json.lines(path: string, opts: table = {}) : function | nil, string
+--| Iterates the values of the JSON Lines file at `path`, one per line.
+--| Blank lines are skipped. The lines are parsed by `opts.threads`
+--| worker threads, by default one per processor, while the values
+--| already parsed are converted to Lua ones by the iterator, so the
+--| parsing of big files is spread over all cores.
+--|
+--| An invalid line raises an error with its line number. If the file can't
+--| be read returns `nil` and a message.
+do
+--{
+  local name = os.tmpname()
+  local file = io.open(name, 'w')
+  file:write '{"id": 1, "name": "Ana"}\n\n{"id": 2, "name": "Bia"}\n'
+  file:close()
+
+  local names = {}
+  for user in json.lines(name, { threads = 2 }) do
+    names[user.id] = user.name
+  end
+  assert(names[1] == "Ana" and names[2] == "Bia")
+--}
+  file = io.open(name, 'w')
+  file:write '[1]\n[2,]\n'
+  file:close()
+  local count = 0
+  local ok, err = pcall(function()
+    for _ in json.lines(name) do count = count + 1 end
+  end)
+  assert(not ok and err:find "at line 2, offset 7" and count == 1)
+
+  os.remove(name)
+  assert(json.lines(name) == nil)
+end
+
+
+--$ json.valid(jsonstr: string) : true | nil, string, integer
+--| Checks the JSON syntax and the UTF-8 of strings, without building any
+--| value, so malformed payloads can be rejected cheaply. Returns `true` or
+--| `nil`, the message and the offset of the error.
+do
+--{
+  assert(json.valid '{"id": 1, "tags": ["a", "b"]}')
+
+  local ok, err, offset = json.valid '{"id": 1,}'
+  assert(ok == nil and err == 'unexpected character at offset 9')
+  assert(offset == 9)
+--}
+  assert(json.valid [["\ud83d\ude00 \u00e9"]])
+  assert(not json.valid [["\ud83d"]])
+  assert(not json.valid('"' .. string.char(0xc3) .. '"'))
+  assert(not json.valid '[1] [2]')
+  assert(select(2, json.decode '[1,') == 'unexpected end of input at offset 3')
+end
+
+
+
+--$ json.parser() : waxJsonParser
+--| Creates a parser for JSON arriving in chunks, as when it is read from
+--| pipes, sockets or decompressors. The chunks can be split at any byte,
+--| even in the middle of a string or a number, and the document doesn't
+--| need to be buffered before the parsing starts.
+--|
+--| The parser accepts a sequence of JSON values, separated by whitespace
+--| or newlines (like on JSON Lines), and each value is available through
+--| `waxJsonParser:values()` as soon as it is complete.
+--|
+--| - `waxJsonParser:feed(chunk: string) : true | nil, string`
+--|   Parses the chunk. On syntax error returns `nil` and a message with the
+--|   offset of the error on the whole input. After an error all further
+--|   feeds fail. Calling `feed()` without a chunk signals the input end.
+--| - `waxJsonParser:values() : iterator() : any`
+--|   Iterates over the values completed so far, removing them from parser.
+--| - `waxJsonParser:close() : boolean`
+--|   Releases the parser memory.
+do
+--{
+  local parser = json.parser()
+
+  assert(parser:feed '{"planet":"Ea')
+  assert(parser:feed 'rth","moons":[{"na')
+  assert(parser:feed 'me":"Moon"}]}\n{"planet":"Mars", "moo')
+
+  local values = {}
+  for v in parser:values() do values[#values+1] = v end
+  assert(#values == 1)
+  assert(values[1].planet == 'Earth')
+  assert(values[1].moons[1].name == 'Moon')
+
+  assert(parser:feed 'ns":[]} 10')
+  assert(parser:feed()) -- input end completes the number
+  for v in parser:values() do values[#values+1] = v end
+  assert(#values == 3)
+  assert(values[2].planet == 'Mars')
+  assert(values[3] == 10)
+
+  local ok, err = json.parser():feed '{"a":1,}'
+  assert(ok == nil and err == 'unexpected character at offset 7')
+--}
+  parser = json.parser()
+  assert(parser:feed '[0.1, 1e400, -2.5E-3, 12345678901234567890, 0.0000000000000000000000000001]')
+  local nums = parser:values()()
+  assert(nums[1] == 0.1 and nums[2] == 1/0 and nums[3] == -0.0025)
+  assert(nums[4] == 12345678901234567890 and nums[5] == 1e-28)
+
+  -- numbers and literals need a delimiter after them
+  local ok, err = json.parser():feed '1true[2]"a"3'
+  assert(ok == nil and err == 'unexpected character at offset 1', err)
+  parser = json.parser()
+  assert(parser:feed '1 2 tr')
+  ok, err = parser:feed 'ue3'
+  assert(ok == nil and err == 'unexpected character at offset 8', err)
+  parser = json.parser()
+  assert(parser:feed '1\n[2]{"a":true}"x" null')
+  assert(parser:feed())
+  local n = 0
+  for v in parser:values() do n = n + 1 end
+  assert(n == 5)
+end
+
+
+--$ json.events(source: string | function | file) : iterator() : string, any, integer
+--| Iterates over the JSON parsing events, without building the decoded
+--| values, so huge documents can be walked through with constant memory.
+--|
+--| The `source` can be the JSON string, a function returning the next
+--| chunk of the document on each call (or nil at end) or a file handler,
+--| from where the chunks are read.
+--|
+--| Each iteration returns the event name, its value and the depth.
+--| The events are `start_object`, `end_object`, `start_array` and
+--| `end_array` with nil value, `key` with the key string as value and
+--| `value` with the scalar (string, number, boolean or `json.null`).
+--| Containers have the same depth of their keys and items. The top level
+--| scalar values have depth 0.
+--|
+--| A syntax error in the source throws a Lua error.
+do
+--{
+  local events = {}
+  for ev, val, depth in json.events '{"moons":["Phobos","Deimos"]}' do
+    events[#events+1] = ('%s %s %d'):format(ev, tostring(val), depth)
+  end
+  assert(events[1] == 'start_object nil 1')
+  assert(events[2] == 'key moons 1')
+  assert(events[3] == 'start_array nil 2')
+  assert(events[4] == 'value Phobos 2')
+  assert(events[5] == 'value Deimos 2')
+  assert(events[6] == 'end_array nil 2')
+  assert(events[7] == 'end_object nil 1')
+
+  -- Picking the names of a file with an array of records
+  local file = io.tmpfile()
+  file:write '[{"name":"Earth","moons":1},{"name":"Mars","moons":2}]'
+  file:seek 'set'
+
+  local names = {}
+  local key
+  for ev, val, depth in json.events(file) do
+    if ev == 'key' then key = val end
+    if ev == 'value' and depth == 2 and key == 'name' then
+      names[#names+1] = val
+    end
+  end
+  file:close()
+  assert(names[1] == 'Earth' and names[2] == 'Mars')
+--}
+end
+
+
+--$ json.select(jsonstr: string, paths: {string}) : table | nil, string
+--| Decodes only the parts of `jsonstr` pointed by `paths`, as JSON Pointers
+--| (RFC 6901), skipping all other subtrees without decoding them.
+--| A path segment `*` matches any key or array item.
+--|
+--| The result table has the paths as keys. Paths with `*` get a list of the
+--| values found, in document order. On invalid JSON returns `nil` and a
+--| message.
+do
+--{
+  local res = json.select([[{
+    "data": {"items": [{"id":1,"name":"Earth"},{"id":2,"name":"Mars"}]},
+    "meta": {"count": 2, "a/b": true}
+  }]], { "/data/items/*/id", "/meta/count", "/meta/a~1b", "/meta/none" })
+
+  assert(res["/data/items/*/id"][1] == 1)
+  assert(res["/data/items/*/id"][2] == 2)
+  assert(res["/meta/count"] == 2)
+  assert(res["/meta/a~1b"] == true)
+  assert(res["/meta/none"] == nil)
+--}
+end
+
+
+--$ json.diff(a: any, b: any) : any
+--$ json.patch(doc: any, patch: any) : any
+--| Computes and applies JSON Merge Patches (RFC 7386) on Lua values.
+--|
+--| `json.diff` returns the patch that turns `a` into `b`: an object with
+--| the changed keys, where removed keys are `json.null` and changed
+--| objects have their own patches. Equal objects give an empty table.
+--| If `a` or `b` is not an object the patch is `b` itself.
+--|
+--| `json.patch` merges the patch into `doc`, changing it in place if it is
+--| an object, and returns the result. As on JSON, tables without array
+--| items are objects; arrays and other values are replaced as a whole.
+--| Merge patches can't set a key to `json.null`, that removes it.
+do
+--{
+  local old = { name = "wax", tags = { "lua" }, meta = { stars = 1, fork = true } }
+  local new = { name = "wax", tags = { "lua", "c" }, meta = { stars = 2 } }
+
+  local patch = json.diff(old, new)
+  assert(json.canonical(patch)
+         == '{"meta":{"fork":null,"stars":2},"tags":["lua","c"]}')
+
+  local doc = json.patch(old, patch)
+  assert(doc == old and doc.meta.stars == 2 and doc.meta.fork == nil)
+  assert(next(json.diff(doc, new)) == nil)
+--}
+  assert(json.canonical(json.patch({ a = "b" }, { a = { b = "c", d = json.null } }))
+         == '{"a":{"b":"c"}}')
+  assert(json.patch({ a = 1 }, json.null) == json.null)
+  assert(json.patch({ 1, 2 }, { a = 1 }).a == 1)
+  assert(json.diff(1, "x") == "x")
+end
+
+
+--$ json.encoder(sink: function | file | integer | string, opts: table = {}) : waxJsonEncoder | nil, string
+--| Creates an encoder that streams JSON to `sink`: a function called with
+--| each chunk, a file handler, a file descriptor or a file path, that is
+--| created or truncated. Big arrays and objects can be written item by
+--| item, without building the whole document in memory.
+--|
+--| The output is buffered and sent to the sink in writes of `opts.buffer`
+--| bytes (default 64KB). Values are encoded as `json.encode`. Each top
+--| level value ends with a new line, so many values make JSON Lines.
+--|
+--| - `waxJsonEncoder:write(value: any) : waxJsonEncoder`
+--| - `waxJsonEncoder:item([key: string,] value: any) : waxJsonEncoder`
+--|   Writes the value on top level or as the next item of the open array.
+--|   Inside an open object the key comes before the value.
+--| - `waxJsonEncoder:begin_array([key: string]) : waxJsonEncoder`
+--| - `waxJsonEncoder:begin_object([key: string]) : waxJsonEncoder`
+--|   Opens an array or object, with its key if inside an object.
+--| - `waxJsonEncoder:finish() : waxJsonEncoder`
+--|   Closes the last open array or object.
+--| - `waxJsonEncoder:flush() : waxJsonEncoder`
+--|   Sends the buffered output to the sink.
+--| - `waxJsonEncoder:close() : boolean`
+--|   Closes the open arrays and objects, flushes and releases the encoder.
+--|   Collected without closing, it flushes what was written to file
+--|   descriptors and paths, as Lua files do, leaving open arrays and
+--|   objects unclosed; the output not flushed to functions and file
+--|   handlers is lost.
+do
+--{
+  local chunks = {}
+  local encoder = json.encoder(function(chunk) chunks[#chunks+1] = chunk end)
+
+  encoder:begin_object():item("total", 2):begin_array "rows"
+  for id = 1, 2 do encoder:item { id = id } end
+  encoder:close()
+
+  assert(table.concat(chunks) == '{"total":2,"rows":[{"id":1},{"id":2}]}\n')
+
+  local name = os.tmpname()
+  encoder = json.encoder(name)
+  encoder:write { 1, 2 }
+  encoder:write "two"
+  encoder:close()
+
+  local file = io.open(name)
+  assert(file:read '*a' == '[1,2]\n"two"\n')
+  file:close()
+  os.remove(name)
+--}
+  encoder = json.encoder(function() end)
+  encoder:begin_array():item(1)
+  assert(not pcall(encoder.item, encoder, { print }))
+  encoder:begin_object()
+  assert(not pcall(encoder.item, encoder, 1, 2))
+  assert(json.encoder '/nonexistent/file.json' == nil)
+
+  -- collection flushes to paths what was written
+  local name = os.tmpname()
+  encoder = json.encoder(name)
+  encoder:write { a = 1 }
+  encoder:begin_array():item(1)
+  encoder = nil
+  collectgarbage() collectgarbage()
+  local file = io.open(name)
+  assert(file:read '*a' == '{"a":1}\n[1')
+  file:close()
+  os.remove(name)
+end
+
+
+--$ json.compile_encoder(shape: {fields: string[], types: table?}) : waxJsonShape
+--| Compiles an encoder of records that have the keys listed in `fields`.
+--| The quoted keys are escaped once, so encoding is a lookup of each
+--| field, written in the order of the list. Other keys are ignored and
+--| nil fields are left out.
+--|
+--| `types` can restrict the values of a field to `"string"`, `"number"`,
+--| `"integer"` or `"boolean"`; `"any"` is the default and accepts the
+--| values of `json.encode`. `json.null` is accepted by any field.
+--|
+--| - `waxJsonShape:encode(record: table) : string`
+--| - `waxJsonShape:encodelist(records: table[]) : string`
+--|   Encodes the record as an object or the list of records as an array.
+do
+--{
+  local users = json.compile_encoder {
+    fields = { "id", "name", "roles" },
+    types  = { id = "integer", name = "string" },
+  }
+
+  assert(users:encode { id = 1, name = "Ana", roles = { "admin" } }
+         == '{"id":1,"name":"Ana","roles":["admin"]}')
+  assert(users:encodelist { { id = 2, name = "Bia" }, { id = 3, other = 0 } }
+         == '[{"id":2,"name":"Bia"},{"id":3}]')
+  assert(users:encodelist {} == '[]')
+--}
+  assert(users:encode { id = 4.0, name = json.null } == '{"id":4,"name":null}')
+  assert(not pcall(users.encode, users, { id = 1.5 }))
+  assert(not pcall(users.encode, users, { name = 1 }))
+  assert(not pcall(json.compile_encoder, { fields = { "a", "a" } }))
+  assert(not pcall(json.compile_encoder, { fields = { "a" }, types = { a = "date" } }))
+end
+
+
+--$ json.pack(value: any) : string
+--$ json.unpack(data: string, pos: integer = 1) : any, integer | nil, string
+--| Encodes and decodes values as MessagePack, a compact binary format
+--| without text parsing or number formatting. Values map as in
+--| `json.encode` and `json.decode`: tables with items at 1..#t are arrays,
+--| other tables are maps with string keys and `json.null` is `nil`.
+--| Integers and floats keep their Lua subtype.
+--|
+--| `json.unpack` decodes the value starting at byte `pos` and returns it
+--| with the position after it, so concatenated values can be read in
+--| sequence. On invalid data returns `nil` and a message.
+do
+--{
+  local data = json.pack { id = 7, tags = {"a", "b"}, parent = json.null }
+  local value, nextpos = json.unpack(data)
+  assert(value.id == 7 and value.tags[2] == "b" and value.parent == json.null)
+  assert(nextpos == #data + 1)
+
+  local stream = json.pack "first" .. json.pack(2.5)
+  local first, pos = json.unpack(stream)
+  assert(first == "first" and json.unpack(stream, pos) == 2.5)
+
+  local ok, err = json.unpack(data:sub(1, 5))
+  assert(ok == nil and err:match "^unexpected end of input")
+--}
+  assert(json.pack(1) == string.char(1))
+  assert(json.pack(-1) == string.char(0xff))
+  assert(json.pack(json.null) == string.char(0xc0))
+  assert(json.pack {} == string.char(0x80))
+  assert(json.pack {1, 2} == string.char(0x92, 1, 2))
+  assert(not pcall(json.pack, { [1.5] = true }))
+end
+
+
+--$ json.tocbor(value: any) : string
+--$ json.fromcbor(data: string, pos: integer = 1) : any, integer | nil, string
+--| Encodes and decodes values as CBOR (RFC 8949). Values map as in
+--| `json.pack`: tables with items at 1..#t are arrays, other tables are
+--| maps with string keys and `json.null` is CBOR `null`. Strings that are
+--| valid UTF-8 are text strings, others are byte strings. Floats use the
+--| smallest of half, single or double precision that keeps the value.
+--|
+--| `json.fromcbor` also reads indefinite length arrays, maps and strings,
+--| byte strings (as Lua strings) and `undefined` (as `json.null`). Tags
+--| are skipped and their item is decoded. It returns the value and the
+--| position after it or, on invalid data, `nil` and a message.
+do
+--{
+  local data = json.tocbor { id = 7, temp = 21.5, tags = {"a", "b"} }
+  local value, nextpos = json.fromcbor(data)
+  assert(value.id == 7 and value.temp == 21.5 and value.tags[2] == "b")
+  assert(nextpos == #data + 1)
+
+  -- [1, [2, 3]] with indefinite lengths, as written by streaming encoders
+  local list = json.fromcbor(string.char(0x9f, 0x01, 0x9f, 0x02, 0x03, 0xff, 0xff))
+  assert(list[1] == 1 and list[2][2] == 3)
+
+  local ok, err = json.fromcbor(data:sub(1, 5))
+  assert(ok == nil and err:match "^unexpected end of input")
+--}
+  assert(json.tocbor(json.null) == string.char(0xf6))
+  assert(json.tocbor(1.5) == string.char(0xf9, 0x3e, 0x00))
+  assert(json.tocbor(-100) == string.char(0x38, 0x63))
+  assert(json.tocbor(string.char(0xff)) == string.char(0x41, 0xff))
+  assert(json.fromcbor(string.char(0xf7)) == json.null)
+  assert(json.fromcbor(string.char(0x7f, 0x61, 0x61, 0x61, 0x62, 0xff)) == "ab")
+end
+
+
+--$ json.cborwriter(sink: function | file | integer | string, opts: table = {}) : waxJsonCborWriter
+--| Creates a writer that streams CBOR to `sink`, as `json.encoder` does.
+--| Arrays, maps and strings can be opened before their items are known,
+--| with indefinite lengths.
+--|
+--| - `waxJsonCborWriter:write(value: any) : waxJsonCborWriter`
+--|   Writes the value, as `json.tocbor`. Inside an open map keys and
+--|   values are written in turns, inside an open string only string chunks.
+--| - `waxJsonCborWriter:array() : waxJsonCborWriter`
+--| - `waxJsonCborWriter:map() : waxJsonCborWriter`
+--| - `waxJsonCborWriter:text() : waxJsonCborWriter`
+--| - `waxJsonCborWriter:bytes() : waxJsonCborWriter`
+--|   Opens an indefinite length item.
+--| - `waxJsonCborWriter:finish() : waxJsonCborWriter`
+--|   Closes the last open item.
+--| - `waxJsonCborWriter:flush() : waxJsonCborWriter`
+--|   Sends the buffered output to the sink.
+--| - `waxJsonCborWriter:close() : boolean`
+--|   Closes the open items, flushes and releases the writer. Collected
+--|   without closing it flushes as `waxJsonEncoder`.
+--|
+--$ json.cborparser() : waxJsonCborParser
+--| Creates a parser for CBOR values arriving in chunks, split at any byte.
+--| It works as `json.parser`: `feed(chunk)` returns `true` or `nil` and
+--| a message, `feed()` signals the input end, `values()` iterates over the
+--| complete values and `close()` releases the parser.
+do
+--{
+  local chunks = {}
+  local writer = json.cborwriter(function(chunk) chunks[#chunks+1] = chunk end)
+
+  writer:map():write "readings":array()
+  for i = 1, 3 do writer:write { sensor = i, temp = 20 + i / 2 } end
+  writer:finish():finish()
+  writer:write "done"
+  writer:close()
+
+  local data = table.concat(chunks)
+  local parser = json.cborparser()
+  for i = 1, #data, 5 do assert(parser:feed(data:sub(i, i + 4))) end
+  assert(parser:feed())
+
+  local values = {}
+  for v in parser:values() do values[#values+1] = v end
+  assert(values[1].readings[3].temp == 21.5 and values[2] == "done")
+--}
+  local w = json.cborwriter(function() end)
+  w:map():write "key"
+  assert(not pcall(w.finish, w))
+  w:text()
+  assert(not pcall(w.write, w, 1))
+
+  local p = json.cborparser()
+  local ok, err = p:feed(string.char(0x01, 0xff))
+  assert(ok == nil and err == 'unexpected break at offset 1')
+  assert(p:values()() == 1)
+
+  -- collection flushes to paths what was written
+  local name = os.tmpname()
+  w = json.cborwriter(name)
+  w:write(1):write "x"
+  w = nil
+  collectgarbage() collectgarbage()
+  local file = io.open(name, 'rb')
+  assert(file:read '*a' == '\1\97x')
+  file:close()
+  os.remove(name)
+end
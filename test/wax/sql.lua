@@ -135,6 +135,11 @@ do
 --| - `waxSql:close()`
 --| - `waxSql:execute()`
 --| - `waxSql:prepare()`
+--| - `waxSql:query()`
+--| - `waxSql:cache()`
+--| - `waxSql:async()`
+--| - `waxSql:create_function()`
+--| - `waxSql:create_aggregate()`
 --|
 --| It is retrieved after a successfull database open with `sql.open()`
 --|
@@ -143,11 +148,26 @@ do
 --| following functions:
 --|
 --| - `waxSqlStmt:fetch()`
+--| - `waxSqlStmt:fetchmany()`
+--| - `waxSqlStmt:fetchall()`
+--| - `waxSqlStmt:mode()`
+--| - `waxSqlStmt:columns()`
 --| - `waxSqlStmt:finalize()`
 --| - `waxSqlStmt:run()`
+--| - `waxSqlStmt:runmany()`
 --|
 --| A new instance of `waxSqlStmt` is obtained for every successfull call to
---| `waxSql:prepare()`
+--| `waxSql:prepare()`, or shared from the cache of the connection by
+--| `waxSql:query()`
+--|
+--$ waxSqlAsync
+--| It is the userdatum of a query running in background, returned by
+--| `waxSql:async()`, with the following functions:
+--|
+--| - `waxSqlAsync:fd()`
+--| - `waxSqlAsync:ready()`
+--| - `waxSqlAsync:wait()`
+--| - `waxSqlAsync:result()`
 --|
 --$ sql.null
 --|
@@ -183,9 +203,24 @@ do
 
 
 
---$ sql.open(filename:string) : waxSql | nil, string, number
+--$ sql.open(filename:string, opts: table = {}) : waxSql | nil, string
 --| Open the database file, creating it if not exists
 --|
+--| The `opts` table sets how the database is opened and the pragmas run
+--| before it is returned:
+--|
+--| - `readonly`: opens the file for reading only, failing if it doesn't
+--|   exist;
+--| - `nomutex`: doesn't serialize the use of the connection by threads;
+--| - `wal`: sets the journal mode to write-ahead log;
+--| - `synchronous`: `"off"`, `"normal"`, `"full"` or `"extra"`;
+--| - `temp_store`: `"default"`, `"file"` or `"memory"`;
+--| - `mmap_size`: bytes of the file read through a memory map;
+--| - `cache_size`: pages of the page cache, or KB when negative;
+--| - `busy_timeout`: milliseconds to wait for a locked database.
+--|
+--| Invalid options throw an error.
+--|
 --| A successful example:
 --{
   local db, err = sql.open '/tmp/solarsystem.db'
@@ -202,6 +237,22 @@ assert(db:close())
   assert(err == 'unable to open database file')
 --}
 
+--| Options of a database written by many processes:
+--{
+  local db = assert(sql.open('/tmp/solarsystem.db', {
+    wal = true, synchronous = 'normal', busy_timeout = 5000,
+  }))
+  local mode
+  for row in db:prepare('PRAGMA journal_mode'):mode('array'):fetch() do
+    mode = row[1]
+  end
+  assert(mode == 'wal')
+  db:close()
+
+  local ok = pcall(sql.open, '/tmp/solarsystem.db', { synchronous = 'fast' })
+  assert(not ok)
+--}
+
 
 
 --$ sql.close(db: waxSql) : boolean
@@ -299,6 +350,201 @@ assert(type(sql.prepare) == 'function' and type(db.prepare) == 'function')
 
 
 
+--$ sql.query(db: waxSql, sql: string) : waxSqlStmt | nil, string
+--$ (waxSql):query(sql: string) : waxSqlStmt | nil, string
+--| Returns the prepared statement of `sql` from the statement cache of
+--| the connection, reset to run again, preparing and caching it when
+--| missing. Code that runs the same queries over and over skips the
+--| preparation of every call but the first.
+--|
+--| The same statement is returned to every caller of the same text, so
+--| it shouldn't be fetched by two loops at the same time. When the cache is
+--| full the least recently used statement is dropped from it; if it is
+--| still held it keeps working and is finalized when collected. Closing
+--| the connection finalizes every statement of the cache.
+--{
+  local stmt = assert(db:query 'SELECT moons FROM planets WHERE name = ?')
+  assert(stmt == db:query 'SELECT moons FROM planets WHERE name = ?')
+
+  local moons
+  for row in db:query('SELECT moons FROM planets WHERE name = ?'):fetch('Earth') do
+    moons = row.moons
+  end
+  assert(moons == 1)
+
+  stmt, err = db:query 'SELECT something FROM a_table_that_not_exists'
+  assert(stmt == nil and err)
+--}
+
+
+
+--$ sql.cache(db: waxSql, size: integer = nil) : table
+--$ (waxSql):cache(size: integer = nil) : table
+--| Sets the number of statements kept by `waxSql:query()`, 32 by
+--| default, when `size` is given. Returns the `size` and the `count` of
+--| statements of the cache, and the `hits` and `misses` of the queries.
+--{
+  local info = db:cache()
+  assert(info.size == 32 and info.count == 1)
+  assert(info.hits == 2 and info.misses == 2)
+
+  db:cache(0)
+  assert(db:cache().count == 0)
+  db:cache(32)
+--}
+
+
+
+--$ sql.async(db: waxSql, sql: string, params: table = nil) : waxSqlAsync | nil, string
+--$ (waxSql):async(sql: string, params: table = nil) : waxSqlAsync | nil, string
+--| Queues `sql` to run in background and returns at once the handle of
+--| the query. The values of `params` fill the placeholders, positional
+--| ones from its array part and named ones from its fields. The rows are
+--| kept until taken by `waxSqlAsync:result()`.
+--|
+--| Queries run in the order they are queued by up to 4 threads of `db`,
+--| each one with its own connection to the database file, opened with the
+--| flags and busy timeout of `db`. So each query sees the committed state
+--| of the file: changes of an open transaction of `db` aren't seen.
+--| Databases in memory return `nil` and an error. Closing `db` waits the
+--| queries already running and fails the queued ones with
+--| `"closed connection"`.
+--|
+--$ (waxSqlAsync):fd() : integer
+--| Returns a descriptor that becomes readable when the query ends, to be
+--| watched by `poll()` or an event loop.
+--|
+--$ (waxSqlAsync):ready() : boolean
+--| Returns if the query ended.
+--|
+--$ (waxSqlAsync):wait(mode: string = "hash") : table, integer | nil, string
+--| Blocks until the query ends and returns its `result()`.
+--|
+--$ (waxSqlAsync):result(mode: string = "hash") : table, integer | nil, string
+--| Returns the list of rows of the ended query, as tables by column names
+--| (the first column of repeated names, as `sql.fetch()`) or, when `mode`
+--| is `"array"`, by column positions, and the number of
+--| rows changed. Returns `nil` and `"pending"` while the query runs, or
+--| `nil` and the error message when it fails. Can be called many times.
+--{
+  local count = 0
+  for _ in db:prepare('SELECT name FROM planets WHERE moons > ?'):fetch(0) do
+    count = count + 1
+  end
+
+  local job = assert(db:async('SELECT name FROM planets WHERE moons > ?', {0}))
+  local task = coroutine.wrap(function()
+    while not job:ready() do coroutine.yield() end
+    return job:result()
+  end)
+
+  local rows
+  repeat rows = task() until rows
+  assert(#rows == count and type(rows[1].name) == 'string')
+  assert(job:result('array')[1][1] == rows[1].name)
+
+  local err
+  local changes
+  rows, changes = db:async([[
+    INSERT INTO planets (name, moons) VALUES ('Vulcan', 0), ('Nibiru', 0)
+  ]]):wait()
+  assert(#rows == 0 and changes == 2)
+  rows, changes = db:async('SELECT name FROM planets'):wait()
+  assert(#rows > 0 and changes == 0)
+  rows, changes = db:async([[
+    DELETE FROM planets WHERE name IN ('Vulcan', 'Nibiru')
+  ]]):wait()
+  assert(changes == 2)
+
+  rows = db:async('SELECT 1 AS x, 2 AS x, ? AS big, ? AS r',
+                  {5000000000, 1e20}):wait()
+  assert(rows[1].x == 1 and rows[1].big == 5000000000 and rows[1].r == 1e20)
+  if math.maxinteger then
+    rows = db:async('SELECT ? AS v', {math.maxinteger}):wait()
+    assert(rows[1].v == math.maxinteger)
+  end
+
+  rows, err = db:async('SELECT * FROM a_table_that_not_exists'):wait()
+  assert(rows == nil and err:find 'no such table')
+
+  rows, err = sql.open(':memory:'):async 'SELECT 1'
+  assert(rows == nil and err)
+--}
+
+
+
+--$ sql.create_function(db: waxSql, name: string, nargs: integer, fn: function, opts: table = {}) : boolean | nil, string
+--$ (waxSql):create_function(name: string, nargs: integer, fn: function, opts: table = {}) : boolean | nil, string
+--| Registers `fn` as the SQL function `name` taking `nargs` arguments, or
+--| any number of them when `nargs` is -1, so rows can be filtered and
+--| transformed by SQLite itself instead of being fetched to Lua first.
+--| Registering the same name and number of arguments again replaces the
+--| function, what fails while a statement using it still runs.
+--|
+--| The arguments arrive as the values of `fetch()` and the result is
+--| stored as the values given to `run()`, with `nil` stored as `NULL`.
+--| An error thrown by `fn` fails the statement with its message.
+--|
+--| When `opts.deterministic` is true `fn` is declared to always return the
+--| same result for the same arguments, allowing SQLite to factor its calls
+--| out and to use it on indexes of expressions.
+--|
+--| Queries of `waxSql:async()` don't see the registered functions.
+--{
+  assert(db:create_function('initial', 1, function(name)
+    return name:sub(1, 1)
+  end, { deterministic = true }))
+
+  local rows = db:prepare([[
+    SELECT name FROM planets WHERE initial(name) = ? ORDER BY name
+  ]]):fetchall('M')
+  assert(rows[1].name == 'Mars')
+
+  assert(db:create_function('fail', 0, function() error 'failed' end))
+  local ok, err = db:prepare('SELECT fail()'):run()
+  assert(ok == nil and err:find 'failed')
+
+  local stmt = db:prepare('SELECT fail()')
+  for _ in stmt:fetch() do end
+  ok, err = stmt:fetchok()
+  assert(ok == nil and err:find 'failed')
+  stmt:finalize()
+
+  assert(db:create_function('huge', 0, function() return 1e20 end))
+  local row = db:prepare('SELECT typeof(huge()) AS t, huge() AS v'):fetch()()
+  assert(row.t == 'real' and row.v == 1e20)
+--}
+
+
+
+--$ sql.create_aggregate(db: waxSql, name: string, step: function, final: function, opts: table = {}) : boolean | nil, string
+--$ (waxSql):create_aggregate(name: string, step: function, final: function, opts: table = {}) : boolean | nil, string
+--| Registers the SQL aggregate function `name`. For each row of a group
+--| `step(state, ...)` receives the state returned by its previous call,
+--| `nil` on the first row, and the arguments of the row, returning the
+--| new state. At the end of the group `final(state)` returns its value.
+--|
+--| Takes any number of arguments unless `opts.nargs` is given, and
+--| `opts.deterministic` is as in `waxSql:create_function()`.
+--{
+  assert(db:create_aggregate('names', function(list, name)
+    list = list or {}
+    list[#list + 1] = name
+    return list
+  end, function(list)
+    return list and table.concat(list, ',') or sql.null
+  end, { nargs = 1 }))
+
+  local rows = db:prepare([[
+    SELECT names(name) AS n FROM (
+      SELECT name FROM planets WHERE moons > 50 ORDER BY name
+    )
+  ]]):fetchall()
+  assert(rows[1].n == 'Jupiter,Saturn')
+--}
+
+
+
 --$ sql.run(stmt: waxSqlStmt, ...) : integer | nil, string
 --$ (waxSqlStmt):run(...) : integer | nil, string
 --| Execute the statement replacing the placeholders by its arguments.
@@ -312,6 +558,9 @@ assert(type(sql.prepare) == 'function' and type(db.prepare) == 'function')
 --| should receive a single table, where each key correspont to a named
 --| parameter of the statement.
 --|
+--| Integers and whole numbers from -2^63 up to, but not including, 2^63 are
+--| bound as SQL integers, other numbers as reals.
+--|
 --| In case of success the function returns the number of rows changed.
 --| Otherwise it returns `nil` and a descriptive error message.
 --|
@@ -337,11 +586,50 @@ assert(type(sql.run) == 'function' and type(stmt.run) == 'function')
 
 
 
+--$ sql.runmany(stmt: waxSqlStmt, rows: table, opts: table = {}) : integer | nil, string
+--$ (waxSqlStmt):runmany(rows: table, opts: table = {}) : integer | nil, string
+--| Executes the statement once for each row of the `rows` array. Each row
+--| is an array with the values of anonymous parameters or a table with the
+--| named ones, as the arguments of `sql.run()`.
+--|
+--| The rows run inside a savepoint, that is a transaction of their own or
+--| nested in the transaction already open, so they are written at once
+--| instead of one commit per row. On the first error every row is rolled
+--| back. Set `opts.transaction` to `false` to run them as they are.
+--|
+--| Returns the total of rows changed, or `nil` and a message with the
+--| number of the failed row. Invalid values throw an error as `sql.run()`.
+--{
+  local stmt = db:prepare 'INSERT INTO planets (name, moons) VALUES (?, ?)'
+  assert(stmt:runmany { {'Haumea', 2}, {'Makemake', 1}, {'Eris', 1} } == 3)
+
+  local ok, err = pcall(stmt.runmany, stmt, { {'Ceres', 0}, {'Orcus', {}} })
+  assert(not ok and err:find 'row 2 Invalid type for field 2')
+  stmt:finalize()
+
+  stmt = db:prepare 'INSERT INTO planets (name, moons) VALUES (:name, :moons)'
+  assert(stmt:runmany { {name='Sedna', moons=0}, {name='Quaoar', moons=1} } == 2)
+
+  local ok, err = pcall(stmt.runmany, stmt, { {name='Ceres', moons=0},
+                                              {name='Orcus', moons={}} })
+  assert(not ok and err:find 'row 2' and err:find 'parameter moons')
+  stmt:finalize()
+
+  stmt = db:prepare 'DELETE FROM planets WHERE name = ?'
+  assert(stmt:runmany { {'Haumea'}, {'Makemake'}, {'Eris'}, {'Sedna'}, {'Quaoar'} } == 5)
+  stmt:finalize()
+--}
+
+
+
 --$ sql.fetch(stmt: waxSqlStmt, ...) : iterator() : table | nil
 --$ waxSqlStmt:fetch(...) : iterator() : table | nil
 --| Apply values to a statement, run the query and returns an iterator
 --| function. The iterator fetches a Sqlite row in each call or nil at
 --| an error or at the end.
+--|
+--| Rows are tables by column names. When names repeat, as with `SELECT *`
+--| on joins, the value is the one of the first column of the name.
 --{
   local stmt = assert(db:prepare [[ SELECT * FROM planets ]])
   local res = {}
@@ -354,11 +642,93 @@ assert(type(sql.run) == 'function' and type(stmt.run) == 'function')
   assert(res.Mars == 2)
 
   stmt:finalize()
+
+  local row = db:prepare('SELECT 1 AS x, 2 AS x, ? AS big'):fetch(5000000000)()
+  assert(row.x == 1 and row.big == 5000000000)
+
+  row = db:prepare('SELECT typeof(?1) AS t, ?1 AS v'):fetch(1e20)()
+  assert(row.t == 'real' and row.v == 1e20)
 --}
 assert(type(sql.fetch) == 'function' and type(stmt.fetch) == 'function')
 
 
 
+--$ sql.fetchall(stmt: waxSqlStmt, ...) : table | nil, string
+--$ waxSqlStmt:fetchall(...) : table | nil, string
+--| Applies the values to the statement as `sql.fetch()` and returns an
+--| array with all of its rows, or `nil` and an error message.
+--{
+  local stmt = assert(db:prepare 'SELECT name FROM planets WHERE moons > ? ORDER BY name')
+  local rows = stmt:fetchall(50)
+
+  assert(#rows == 2 and rows[1].name == 'Jupiter' and rows[2].name == 'Saturn')
+--}
+
+
+
+--$ sql.fetchmany(stmt: waxSqlStmt, n: integer, rows: table = {}) : table | nil, string
+--$ waxSqlStmt:fetchmany(n: integer, rows: table = {}) : table | nil, string
+--| Fetches the next `n` rows of the statement, or less when they are over,
+--| in an array. Values are applied to the statement by `sql.fetch()`, whose
+--| iterator doesn't need to be called. Statements without parameters can be
+--| fetched right away.
+--|
+--| When the `rows` array is given, it is filled and returned instead of a
+--| new one, with any item after the fetched rows cleared. After the last row
+--| an empty array is returned, until the statement is fetched again.
+--{
+  stmt:fetch(0)
+  local rows = stmt:fetchmany(2)
+  assert(#rows == 2)
+
+  local seen = #rows
+  repeat
+    rows = stmt:fetchmany(2, rows)
+    seen = seen + #rows
+  until #rows == 0
+  assert(seen == #stmt:fetchall(0))
+
+  for _ in stmt:fetch(0) do end
+  assert(#stmt:fetchmany(10) == 0)
+
+  stmt:finalize()
+--}
+
+
+
+--$ sql.mode(stmt: waxSqlStmt, mode: string) : waxSqlStmt
+--$ waxSqlStmt:mode(mode: string) : waxSqlStmt
+--| Sets how the rows of the statement are fetched: as tables keyed by the
+--| column names, with `"hash"` (the default), or as arrays of the values in
+--| the column order, with `"array"`. Arrays skip the column names, what
+--| makes the fetch of wide rows faster. Returns the statement.
+--{
+  local stmt = assert(db:prepare 'SELECT name, moons FROM planets WHERE name = ?')
+
+  for row in stmt:mode('array'):fetch('Earth') do
+    assert(row[1] == 'Earth' and row[2] == 1 and row.name == nil)
+  end
+
+  for row in stmt:mode('hash'):fetch('Earth') do
+    assert(row.name == 'Earth' and row.moons == 1)
+  end
+--}
+
+
+
+--$ sql.columns(stmt: waxSqlStmt) : table
+--$ waxSqlStmt:columns() : table
+--| Returns the names of the result columns of the statement, in order.
+--| Statements returning no data, as `INSERT`, have none.
+--{
+  local cols = stmt:columns()
+  assert(#cols == 2 and cols[1] == 'name' and cols[2] == 'moons')
+
+  stmt:finalize()
+--}
+
+
+
 --$ sql.fetchok(stmt: waxSqlStmt): true | nil, string
 --$ waxSqlStmt:fetchok(stmt: waxSqlStmt): true | nil, string
 --| Check if the last `fetch()` occurred without any error.